@@ -22,6 +22,13 @@
 // FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
 // IN THE SOFTWARE.
 
+#include <algorithm>
+#include <cstdlib>
+#include <fcntl.h>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <unistd.h>
+
 #include "alloc.h"
 
 
@@ -37,3 +44,133 @@ _EruHazmat::AllocatorEntryDeleter<EruGate>::AllocatorEntryDeleter(
 void _EruHazmat::AllocatorEntryDeleter<EruGate>::operator() (EruGate *ptr) {
     delete_gate_bootstrapping_ciphertext_array(_size, ptr);
 }
+
+// Spill store
+
+_EruHazmat::SpillStore::SpillStore(const std::string &dir, size_t chunk) :
+        _fd(-1), _chunk(chunk), _file_size(0), _used(0), _cur(nullptr),
+        _left(0) {
+    std::string base = dir;
+    if (base.empty()) {
+        const char *tmp = getenv("TMPDIR");
+        base = tmp != nullptr && *tmp != '\0' ? tmp : "/tmp";
+    }
+    std::string path = base + "/eru-spill-XXXXXX";
+    std::vector<char> name(path.begin(), path.end());
+    name.push_back('\0');
+    _fd = mkstemp(name.data());
+    if (_fd < 0)
+        throw std::runtime_error("cannot create spill file");
+    unlink(name.data());  // the mappings keep it alive
+}
+
+_EruHazmat::SpillStore::~SpillStore() {
+    for (auto &map : _maps)
+        munmap(map.first, map.second);
+    close(_fd);
+}
+
+void _EruHazmat::SpillStore::_grow(size_t bytes) {
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t length = std::max(bytes, _chunk);
+    length = (length + page - 1) / page * page;
+    if (ftruncate(_fd, _file_size + length) != 0)
+        throw std::runtime_error("cannot grow spill file");
+    void *ptr = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_SHARED,
+        _fd, _file_size);
+    if (ptr == MAP_FAILED)
+        throw std::runtime_error("cannot map spill file");
+    _file_size += length;
+    _maps.push_back(std::make_pair((char*)ptr, length));
+    _cur = (char*)ptr;
+    _left = length;
+}
+
+void* _EruHazmat::SpillStore::allocate(size_t bytes) {
+    bytes = (bytes + 63) / 64 * 64;
+    if (bytes > _left)
+        _grow(bytes);
+    void *ptr = _cur;
+    _cur += bytes;
+    _left -= bytes;
+    _used += bytes;
+    return ptr;
+}
+
+void _EruHazmat::SpillStore::advise(void *ptr, size_t bytes,
+        SpillAdvice advice) {
+    uintptr_t page = sysconf(_SC_PAGESIZE);
+    uintptr_t begin = (uintptr_t)ptr, end = begin + bytes;
+    if (advice == SPILL_DISCARD) {
+        // only pages wholly inside, the rest may belong to other blocks
+        begin = (begin + page - 1) / page * page;
+        end = end / page * page;
+    } else {
+        begin = begin / page * page;
+        end = (end + page - 1) / page * page;
+    }
+    if (begin >= end)
+        return;
+    switch (advice) {
+    case SPILL_PREFETCH:
+        madvise((void*)begin, end - begin, MADV_WILLNEED);
+        break;
+    case SPILL_EVICT:
+#ifdef MADV_PAGEOUT
+        madvise((void*)begin, end - begin, MADV_PAGEOUT);
+#else
+        msync((void*)begin, end - begin, MS_ASYNC);
+        madvise((void*)begin, end - begin, MADV_DONTNEED);
+#endif
+        break;
+    case SPILL_DISCARD:
+        // frees the file blocks and the cached pages alike
+        madvise((void*)begin, end - begin, MADV_REMOVE);
+        break;
+    }
+}
+
+uint64_t _EruHazmat::SpillStore::size() {
+    return _used;
+}
+
+// Only the LWE masks are spilled, the samples themselves are small
+
+template <>
+size_t _EruHazmat::allocator_block_bytes<EruGate>(size_t size, void *data) {
+    auto params = (TFheGateBootstrappingParameterSet*)data;
+    return size * (sizeof(EruGate) +
+        params->in_out_params->n * sizeof(Torus32));
+}
+
+template <>
+EruGate* _EruHazmat::allocator_spill_creator<EruGate>(size_t size,
+        void *data, SpillStore *store) {
+    auto params = (TFheGateBootstrappingParameterSet*)data;
+    size_t n = params->in_out_params->n;
+    auto ptr = (EruGate*)malloc(size * sizeof(EruGate));
+    if (ptr == nullptr)
+        throw std::bad_alloc();
+    auto mask = (Torus32*)store->allocate(size * n * sizeof(Torus32));
+    for (size_t i = 0; i < size; i++) {
+        ptr[i].a = mask + i * n;
+        ptr[i].b = 0;
+        ptr[i].current_variance = 0.0;
+    }
+    return ptr;
+}
+
+template <>
+void _EruHazmat::allocator_spill_deleter<EruGate>(EruGate *ptr,
+        size_t size) {
+    free(ptr);
+}
+
+template <>
+void _EruHazmat::allocator_spill_advise<EruGate>(EruGate *ptr, size_t size,
+        void *data, SpillStore *store, SpillAdvice advice) {
+    auto params = (TFheGateBootstrappingParameterSet*)data;
+    size_t n = params->in_out_params->n;
+    // the masks of a block are contiguous
+    store->advise(ptr[0].a, size * n * sizeof(Torus32), advice);
+}
@@ -26,7 +26,12 @@
 #define _LIBERU_ALLOC_H
 
 #include <map>
+#include <memory>
+#include <mutex>
+#include <set>
 #include <stack>
+#include <string>
+#include <vector>
 
 #include "crypto.h"
 
@@ -58,6 +63,77 @@ namespace _EruHazmat {
         AllocatorEntryDeleter(size_t size);
         void operator() (EruGate *ptr);
     };
+
+    /// Page hints for spilled blocks.
+    enum SpillAdvice {
+        SPILL_PREFETCH = 0,  // about to be read, fault it in ahead of time
+        SPILL_EVICT = 1,  // cold for a while, write it out now
+        SPILL_DISCARD = 2,  // contents are dead, drop them without writing
+    };
+
+    /// Grow-only store of file-backed memory. Memory comes from a shared
+    /// mapping of an unlinked temporary file, so the kernel may write cold
+    /// pages back to the file and drop them, and faults them in again on
+    /// the next access, instead of counting them against the process. Not
+    /// thread-safe by itself.
+    class SpillStore {
+    private:
+        int _fd;
+        size_t _chunk;
+        uint64_t _file_size;
+        std::vector<std::pair<char*, size_t>> _maps;
+        uint64_t _used;
+        char *_cur;
+        size_t _left;
+        void _grow(size_t bytes);
+    public:
+        /// @param dir: where to create the file, "" for $TMPDIR or /tmp.
+        /// @param chunk: bytes mapped at a time.
+        SpillStore(const std::string &dir, size_t chunk = (size_t)64 << 20);
+        SpillStore(const SpillStore &other) = delete;
+        ~SpillStore();
+        /// Cache-line aligned memory, valid until the store is destroyed.
+        void* allocate(size_t bytes);
+        void advise(void *ptr, size_t bytes, SpillAdvice advice);
+        /// Bytes handed out so far. The file is larger, but sparse.
+        uint64_t size();
+    };
+
+    /// Bytes of memory held by a block of size items.
+    template <typename _T>
+    size_t allocator_block_bytes(size_t size, void *data) {
+        return size * sizeof(_T);
+    }
+    template <>
+    size_t allocator_block_bytes<EruGate>(size_t size, void *data);
+
+    /// Like allocator_pool_creator, with the bulk of the block in store.
+    /// Types with nothing worth spilling allocate as usual.
+    template <typename _T>
+    _T* allocator_spill_creator(size_t size, void *data, SpillStore *store) {
+        return allocator_pool_creator<_T>(size, data);
+    }
+    template <>
+    EruGate* allocator_spill_creator<EruGate>(size_t size, void *data,
+        SpillStore *store);
+
+    /// Deletes blocks made by allocator_spill_creator. The part in the
+    /// store goes away with the store.
+    template <typename _T>
+    void allocator_spill_deleter(_T *ptr, size_t size) {
+        AllocatorEntryDeleter<_T> deleter(size);
+        deleter(ptr);
+    }
+    template <>
+    void allocator_spill_deleter<EruGate>(EruGate *ptr, size_t size);
+
+    /// Pass a hint on to the part of a spilled block living in store.
+    template <typename _T>
+    void allocator_spill_advise(_T *ptr, size_t size, void *data,
+            SpillStore *store, SpillAdvice advice) {}
+    template <>
+    void allocator_spill_advise<EruGate>(EruGate *ptr, size_t size,
+        void *data, SpillStore *store, SpillAdvice advice);
 }
 
 /// Allocator returned data delegate. Do remember to free this as it would
@@ -81,16 +157,37 @@ public:
 };
 
 /// Allocator that returns data delegates upon user requirement. The data
-/// pointers are guaranteed to be consequent.
+/// pointers are guaranteed to be consequent. Safe to share between threads.
+///
+/// With a memory budget set, blocks beyond the budget are placed in a
+/// file-backed spill store, where the kernel pages cold ones out to disk
+/// and back in on access. Large jobs then slow down instead of running out
+/// of memory. Blocks are never moved between memory and the store.
 template <typename _T>
 class EruAllocator {
 private:
+    std::mutex _lock;
     /// The pool ensures no stack is empty at any time.
     std::map<size_t, std::stack<_T*>> _pool;  // size > stack
     /// This map holds of currently allocated objects.
     std::map<_T*, size_t> _pool_used;
     size_t _size;
     void *_params;  // bootstrap params, leave null if not encrypting
+    size_t _budget;  // bytes of blocks kept in memory
+    size_t _resident;  // bytes of blocks in memory, used or pooled
+    std::unique_ptr<_EruHazmat::SpillStore> _store;
+    std::set<_T*> _spilled;  // blocks living in the store
+    _T* _pool_create(size_t size) {
+        size_t bytes = _EruHazmat::allocator_block_bytes<_T>(size, _params);
+        if (_store != nullptr && _resident + bytes > _budget) {
+            _T *ptr = _EruHazmat::allocator_spill_creator<_T>(size, _params,
+                _store.get());
+            _spilled.insert(ptr);
+            return ptr;
+        }
+        _resident += bytes;
+        return _EruHazmat::allocator_pool_creator<_T>(size, _params);
+    }
     _T* _pool_get(size_t size) {
         _T *ptr;
         if (_pool.find(size) != _pool.end()) {
@@ -99,7 +196,7 @@ private:
             if (_pool[size].empty())
                 _pool.erase(size);
         } else {
-            ptr = _EruHazmat::allocator_pool_creator<_T>(size, _params);
+            ptr = _pool_create(size);
         }
         _pool_used[ptr] = size;
         return ptr;
@@ -109,23 +206,37 @@ private:
             _pool[size] = std::stack<_T*>();
         _pool[size].push(ptr);
         _pool_used.erase(ptr);
+        // pooled contents are dead, don't let them reach the disk
+        _advise(ptr, size, _EruHazmat::SPILL_DISCARD);
+    }
+    void _advise(_T *ptr, size_t size, _EruHazmat::SpillAdvice advice) {
+        if (_store != nullptr && _spilled.count(ptr) > 0)
+            _EruHazmat::allocator_spill_advise<_T>(ptr, size, _params,
+                _store.get(), advice);
+    }
+    void _delete(_T *ptr, size_t size) {
+        if (_spilled.count(ptr) > 0)
+            _EruHazmat::allocator_spill_deleter<_T>(ptr, size);
+        else
+            _EruHazmat::AllocatorEntryDeleter<_T>{size}(ptr);
     }
 public:
     EruAllocator(void *params) {
         _pool.clear();
         _size = 0;
         _params = params;
+        _budget = 0;
+        _resident = 0;
     }
     ~EruAllocator() {
         for (auto &pr : _pool) {
-            auto deleter = _EruHazmat::AllocatorEntryDeleter<_T>(pr.first);
             while (!pr.second.empty()) {
-                deleter(pr.second.top());
+                _delete(pr.second.top(), pr.first);
                 pr.second.pop();
             }
         }
         for (auto &pr : _pool_used) {
-            _EruHazmat::AllocatorEntryDeleter<_T>(pr.second)(pr.first);
+            _delete(pr.first, pr.second);
         }
     }
     /// Get number of allocated elements.
@@ -137,13 +248,47 @@ public:
     /// @param size: number of consequent objects to allocate.
     /// @return Delegate EruBits object to allocated array.
     EruBits<_T> allocate(size_t size) {
+        std::lock_guard<std::mutex> guard(_lock);
         _T *ptr = _pool_get(size);
         return EruBits<_T>(ptr, size);
     }
     /// Free allocated object for later use. They will remain in pool anyway.
     void free(EruBits<_T> ptr) {
+        std::lock_guard<std::mutex> guard(_lock);
         _pool_put(ptr.ptr(), ptr._size());
     }
+    /// Keep at most budget bytes of blocks in memory and spill the ones
+    /// allocated beyond it. Blocks that already exist stay where they are.
+    /// @param dir: directory of the spill file, "" for $TMPDIR or /tmp.
+    void set_spill(size_t budget, const std::string &dir = "") {
+        std::lock_guard<std::mutex> guard(_lock);
+        if (_store == nullptr)
+            _store = std::unique_ptr<_EruHazmat::SpillStore>(
+                new _EruHazmat::SpillStore(dir));
+        _budget = budget;
+    }
+    /// Hint that ptr is read soon, e.g. the next chunk of a scan. Only
+    /// spilled blocks are affected.
+    void prefetch(EruBits<_T> ptr) {
+        std::lock_guard<std::mutex> guard(_lock);
+        _advise(ptr.ptr(), ptr._size(), _EruHazmat::SPILL_PREFETCH);
+    }
+    /// Hint that ptr stays untouched for a while, so its pages can go to
+    /// disk ahead of memory pressure. Only spilled blocks are affected.
+    void evict(EruBits<_T> ptr) {
+        std::lock_guard<std::mutex> guard(_lock);
+        _advise(ptr.ptr(), ptr._size(), _EruHazmat::SPILL_EVICT);
+    }
+    /// Bytes of blocks held in memory, used or pooled.
+    size_t resident_bytes() {
+        std::lock_guard<std::mutex> guard(_lock);
+        return _resident;
+    }
+    /// Bytes of the spill store, 0 unless spilling.
+    size_t spilled_bytes() {
+        std::lock_guard<std::mutex> guard(_lock);
+        return _store != nullptr ? _store->size() : 0;
+    }
 };
 
 #endif  // _LIBERU_ALLOC_H
@@ -0,0 +1,240 @@
+
+// archive.cpp: memory-mapped archives of fixed-size ciphertext records
+// MIT License
+//
+// Copyright (c) 2021 Geoffrey Tang
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+
+#include <cstring>
+#include <fcntl.h>
+#include <openssl/sha.h>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "archive.h"
+
+using namespace std;
+
+
+static const char archive_magic[8] = {'E', 'R', 'U', 'A', 'R', 'C', 'V', '1'};
+static const uint32_t archive_version = 1;
+static const size_t archive_header_size = 64;
+static const uint64_t archive_align = 4096;
+
+EruData _EruHazmat::archive_fingerprint(const EruData &params) {
+    unsigned char md[SHA256_DIGEST_LENGTH];
+    SHA256((const unsigned char*)params.data(), params.length(), md);
+    return EruData((char*)md, SHA256_DIGEST_LENGTH);
+}
+
+// Reader
+
+_EruHazmat::ArchiveMap::ArchiveMap(const string &path) : _fd(-1),
+        _data(nullptr), _length(0) {
+    _fd = open(path.c_str(), O_RDONLY);
+    if (_fd < 0)
+        throw runtime_error("cannot open archive");
+    struct stat st;
+    if (fstat(_fd, &st) != 0 || (size_t)st.st_size < archive_header_size) {
+        close(_fd);
+        throw runtime_error("truncated archive");
+    }
+    _length = st.st_size;
+    void *p = mmap(nullptr, _length, PROT_READ, MAP_SHARED, _fd, 0);
+    if (p == MAP_FAILED) {
+        close(_fd);
+        throw runtime_error("cannot map archive");
+    }
+    _data = (const char*)p;
+    try {
+        _parse();
+    } catch (...) {
+        munmap((void*)_data, _length);
+        close(_fd);
+        throw;
+    }
+}
+
+_EruHazmat::ArchiveMap::~ArchiveMap() {
+    munmap((void*)_data, _length);
+    close(_fd);
+}
+
+void _EruHazmat::ArchiveMap::_parse() {
+    auto u32 = [&](size_t pos) {
+        uint32_t v;
+        memcpy(&v, _data + pos, 4);
+        return v;
+    };
+    auto u64 = [&](size_t pos) {
+        if (pos > _length || _length - pos < 8)
+            throw runtime_error("truncated archive");
+        uint64_t v;
+        memcpy(&v, _data + pos, 8);
+        return v;
+    };
+    if (memcmp(_data, archive_magic, 8) != 0)
+        throw runtime_error("not an archive");
+    if (u32(8) != archive_version)
+        throw runtime_error("unsupported archive version");
+    _gate_size = u32(12);
+    _fingerprint = EruData(_data + 16, 32);
+    uint64_t pos = u64(48), count = u64(56);
+    if (pos == 0)
+        throw runtime_error("unfinished archive");
+    for (uint64_t i = 0; i < count; i++) {
+        EruArchiveColumn col;
+        col.offset = u64(pos);
+        col.rows = u64(pos + 8);
+        col.bits = u64(pos + 16);
+        uint64_t name = u64(pos + 24);
+        pos += 32;
+        if (name > _length - pos)
+            throw runtime_error("truncated archive");
+        col.name = string(_data + pos, name);
+        pos += name;
+        // rows * bits * gate_size bytes must lie inside the file
+        uint64_t record = col.bits * _gate_size;
+        if (col.offset > _length || (col.bits != 0 &&
+                record / col.bits != _gate_size) || (record != 0 &&
+                col.rows > (_length - col.offset) / record))
+            throw runtime_error("truncated archive");
+        _columns.push_back(col);
+    }
+}
+
+size_t _EruHazmat::ArchiveMap::gate_size() const {
+    return _gate_size;
+}
+
+const EruData& _EruHazmat::ArchiveMap::fingerprint() const {
+    return _fingerprint;
+}
+
+const vector<EruArchiveColumn>& _EruHazmat::ArchiveMap::columns()
+        const {
+    return _columns;
+}
+
+const char* _EruHazmat::ArchiveMap::record(size_t col, size_t row) const {
+    auto &c = _columns[col];
+    return _data + c.offset + row * c.bits * _gate_size;
+}
+
+void _EruHazmat::ArchiveMap::advise(size_t col, size_t row,
+        size_t count) const {
+    // madvise wants a page-aligned start
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t begin = record(col, row) - _data;
+    size_t end = begin + count * _columns[col].bits * _gate_size;
+    begin -= begin % page;
+    madvise((void*)(_data + begin), end - begin, MADV_SEQUENTIAL);
+    madvise((void*)(_data + begin), end - begin, MADV_WILLNEED);
+}
+
+// Writer
+
+_EruHazmat::ArchiveSink::ArchiveSink(const string &path, size_t gate_size,
+        const EruData &fingerprint) : _gate_size(gate_size),
+        _fingerprint(fingerprint), _pos(0), _open(false), _finished(false) {
+    if (gate_size == 0)
+        throw runtime_error("gates have no fixed-size encoding");
+    _out.open(path, ios::binary | ios::trunc);
+    if (!_out)
+        throw runtime_error("cannot create archive");
+    _header(0);
+    _pos = archive_header_size;
+}
+
+_EruHazmat::ArchiveSink::~ArchiveSink() {
+    // the header written up front still says unfinished, so a writer
+    // unwound by an exception can't leave a half index behind
+    _out.close();
+}
+
+void _EruHazmat::ArchiveSink::_header(uint64_t index_offset) {
+    char header[archive_header_size];
+    uint32_t gate_size = _gate_size;
+    uint64_t count = _columns.size();
+    memcpy(header, archive_magic, 8);
+    memcpy(header + 8, &archive_version, 4);
+    memcpy(header + 12, &gate_size, 4);
+    memcpy(header + 16, _fingerprint.data(), 32);
+    memcpy(header + 48, &index_offset, 8);
+    memcpy(header + 56, &count, 8);
+    _out.seekp(0);
+    _out.write(header, archive_header_size);
+}
+
+void _EruHazmat::ArchiveSink::begin_column(const string &name, size_t bits) {
+    if (_finished || _open)
+        throw runtime_error("archive column already open");
+    if (bits == 0)
+        throw runtime_error("empty archive records");
+    // pad up to the next page so that columns map page-aligned
+    uint64_t pad = (archive_align - _pos % archive_align) % archive_align;
+    for (uint64_t i = 0; i < pad; i++)
+        _out.put('\0');
+    _pos += pad;
+    EruArchiveColumn col = {name, _pos, 0, bits};
+    _columns.push_back(col);
+    _open = true;
+}
+
+void _EruHazmat::ArchiveSink::write(const char *data, size_t length) {
+    if (!_open)
+        throw runtime_error("no archive column open");
+    auto &col = _columns.back();
+    size_t record = col.bits * _gate_size;
+    if (record == 0 || length % record != 0)
+        throw runtime_error("partial archive record");
+    _out.write(data, length);
+    if (!_out)
+        throw runtime_error("archive write failed");
+    _pos += length;
+    col.rows += length / record;
+}
+
+void _EruHazmat::ArchiveSink::end_column() {
+    if (!_open)
+        throw runtime_error("no archive column open");
+    _open = false;
+}
+
+void _EruHazmat::ArchiveSink::finish() {
+    if (_finished)
+        return;
+    _open = false;
+    uint64_t index_offset = _pos;
+    for (auto &col : _columns) {
+        uint64_t fields[4] = {col.offset, col.rows, col.bits,
+            col.name.length()};
+        _out.write((const char*)fields, sizeof(fields));
+        _out.write(col.name.data(), col.name.length());
+    }
+    _header(index_offset);
+    _out.flush();
+    _finished = true;
+    if (!_out)
+        throw runtime_error("archive write failed");
+    _out.close();
+}
@@ -0,0 +1,246 @@
+
+// archive.h: memory-mapped archives of fixed-size ciphertext records
+// MIT License
+//
+// Copyright (c) 2021 Geoffrey Tang
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+
+#ifndef _LIBERU_ARCHIVE_H
+#define _LIBERU_ARCHIVE_H
+
+#include <algorithm>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "context.h"
+#include "table.h"
+#include "utils.h"
+
+
+/// On-disk layout of an archive. Integers are in host byte order, which the
+/// version field checks on open.
+///     header   8 bytes   magic "ERUARCV1"
+///              4 bytes   version (1)
+///              4 bytes   bytes per gate
+///              32 bytes  SHA-256 of the parameters gates were made with
+///              8 bytes   index offset, 0 until the writer has finished
+///              8 bytes   number of columns
+///     columns  one after another, each starting on a 4 KiB boundary:
+///              rows records of bits gates, every gate bytes per gate long
+///     index    per column: offset, rows, bits, name length (8 bytes each)
+///              followed by the name
+/// Records have a fixed stride, so any of them is found by arithmetic and
+/// read straight out of the mapping into an EruBits.
+struct EruArchiveColumn {
+    std::string name;
+    uint64_t offset;
+    uint64_t rows;
+    uint64_t bits;
+};
+
+/// THERE BE DRAGONS!
+namespace _EruHazmat {
+    /// SHA-256 of the env's parameter description.
+    EruData archive_fingerprint(const EruData &params);
+
+    /// Read-only mapping of a finished archive. Processes mapping the same
+    /// file share its pages through the page cache.
+    class ArchiveMap {
+    private:
+        int _fd;
+        const char *_data;
+        size_t _length;
+        size_t _gate_size;
+        EruData _fingerprint;
+        std::vector<EruArchiveColumn> _columns;
+        void _parse();
+    public:
+        ArchiveMap(const std::string &path);
+        ArchiveMap(const ArchiveMap &other) = delete;
+        ~ArchiveMap();
+        size_t gate_size() const;
+        const EruData& fingerprint() const;
+        const std::vector<EruArchiveColumn>& columns() const;
+        /// First byte of record row of column col.
+        const char* record(size_t col, size_t row) const;
+        /// Tell the kernel that count records from row are read next, in
+        /// order, so it can read ahead of them.
+        void advise(size_t col, size_t row, size_t count) const;
+    };
+
+    /// Streaming writer of an archive, column after column.
+    class ArchiveSink {
+    private:
+        std::ofstream _out;
+        size_t _gate_size;
+        EruData _fingerprint;
+        std::vector<EruArchiveColumn> _columns;
+        uint64_t _pos;
+        bool _open;  // a column is being written
+        bool _finished;
+        void _header(uint64_t index_offset);
+    public:
+        ArchiveSink(const std::string &path, size_t gate_size,
+            const EruData &fingerprint);
+        ArchiveSink(const ArchiveSink &other) = delete;
+        /// Leaves an archive that was not finished with a zero index
+        /// offset, so readers reject it.
+        ~ArchiveSink();
+        void begin_column(const std::string &name, size_t bits);
+        /// Append whole records of the open column.
+        void write(const char *data, size_t length);
+        void end_column();
+        /// Write the index, which makes the archive readable.
+        void finish();
+    };
+}
+
+/// Reads records of an archive into a context whose parameters match those
+/// the archive was written with. Loading a record copies its gates out of
+/// the mapping, nothing is parsed or decoded.
+template <typename _T>
+class EruArchiveReader {
+private:
+    EruContext<_T> *_ctx;
+    _EruHazmat::ArchiveMap _map;
+    void _check_range(size_t col, size_t first, size_t count) {
+        if (col >= _map.columns().size())
+            throw std::runtime_error("column index out of range");
+        if (first > _map.columns()[col].rows ||
+                count > _map.columns()[col].rows - first)
+            throw std::runtime_error("record index out of range");
+    }
+    void _check_bits(size_t col, size_t bits) {
+        if (_map.columns()[col].bits != bits)
+            throw std::runtime_error("record width mismatch");
+    }
+public:
+    EruArchiveReader(EruContext<_T> *ctx, const std::string &path) :
+            _ctx(ctx), _map(path) {
+        auto env = _ctx->_env();
+        if (_map.gate_size() != env->bsize() || _map.fingerprint() !=
+                _EruHazmat::archive_fingerprint(env->bparams()))
+            throw std::runtime_error("archive parameters do not match");
+    }
+    size_t columns() {
+        return _map.columns().size();
+    }
+    const EruArchiveColumn& column(size_t col) {
+        _check_range(col, 0, 0);
+        return _map.columns()[col];
+    }
+    /// Index of the column called name.
+    size_t find(const std::string &name) {
+        for (size_t i = 0; i < columns(); i++)
+            if (_map.columns()[i].name == name)
+                return i;
+        throw std::runtime_error("no such column");
+    }
+    /// Copy count consecutive records starting at row into r, which holds
+    /// count * bits gates.
+    void load(size_t col, size_t row, size_t count, _T *r) {
+        _check_range(col, row, count);
+        auto env = _ctx->_env();
+        size_t gate = _map.gate_size(), bits = _map.columns()[col].bits;
+        const char *p = _map.record(col, row);
+        for (size_t i = 0; i < count * bits; i++)
+            env->bload(r + i, p + i * gate);
+    }
+    /// Record row as an encrypted type of the column's width.
+    template <typename _Elem>
+    _Elem get(size_t col, size_t row) {
+        _check_range(col, row, 1);
+        _check_bits(col, _Elem::_width());
+        EruBits<_T> res = _ctx->allocate(_Elem::_width());
+        load(col, row, 1, res.ptr());
+        return _Elem(_ctx, res);
+    }
+    /// count records starting at row as a table column, e.g. one chunk of
+    /// a scan. The kernel is told to read ahead.
+    template <size_t _Size>
+    EruColumn<_T, _Size> get_column(size_t col, size_t row, size_t count) {
+        _check_range(col, row, count);
+        _check_bits(col, _Size);
+        _map.advise(col, row, count);
+        EruColumn<_T, _Size> res(_ctx, count);
+        load(col, row, count, res._ptr());
+        return res;
+    }
+};
+
+/// Writes an archive for the context's parameters, one column at a time.
+/// Records are appended as they come, so datasets never have to fit in
+/// memory. Nothing is readable until finish() is called.
+template <typename _T>
+class EruArchiveWriter {
+private:
+    EruContext<_T> *_ctx;
+    _EruHazmat::ArchiveSink _sink;
+    size_t _bits;
+    std::vector<char> _buffer;
+public:
+    EruArchiveWriter(EruContext<_T> *ctx, const std::string &path) :
+        _ctx(ctx), _sink(path, ctx->_env()->bsize(),
+        _EruHazmat::archive_fingerprint(ctx->_env()->bparams())), _bits(0) {}
+    /// Start a column of records of bits gates each.
+    void begin_column(const std::string &name, size_t bits) {
+        _sink.begin_column(name, bits);
+        _bits = bits;
+    }
+    /// Append count records from r, count * bits gates. They are staged
+    /// in a buffer of about 4 MiB at a time.
+    void append(const _T *r, size_t count) {
+        auto env = _ctx->_env();
+        size_t record = _bits * env->bsize();
+        size_t chunk = record > 0 ? (((size_t)4 << 20) + record - 1) /
+            record : count;
+        for (size_t first = 0; first < count; first += chunk) {
+            size_t n = std::min(chunk, count - first) * _bits;
+            const _T *p = r + first * _bits;
+            _buffer.resize(n * env->bsize());
+            for (size_t i = 0; i < n; i++)
+                env->bstore(p + i, _buffer.data() + i * env->bsize());
+            _sink.write(_buffer.data(), _buffer.size());
+        }
+    }
+    /// Append an encrypted value of the column's width.
+    template <typename _Elem>
+    void append(_Elem &value) {
+        if (_Elem::_width() != _bits)
+            throw std::runtime_error("record width mismatch");
+        append(value._ptr(), 1);
+    }
+    /// Append every row of a table column.
+    template <size_t _Size>
+    void append(EruColumn<_T, _Size> &column) {
+        if (_Size != _bits)
+            throw std::runtime_error("record width mismatch");
+        append(column._ptr(), column.size());
+    }
+    void end_column() {
+        _sink.end_column();
+    }
+    void finish() {
+        _sink.finish();
+    }
+};
+
+#endif  // _LIBERU_ARCHIVE_H
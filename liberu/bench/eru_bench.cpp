@@ -0,0 +1,697 @@
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "liberu.h"
+#include "services.h"
+
+using namespace std;
+
+#ifndef ERU_BENCH_REVISION
+#define ERU_BENCH_REVISION "unknown"
+#endif
+
+
+/// Statistics of one benchmark, all timings are per single operation.
+struct BenchResult {
+    string backend;
+    string name;
+    size_t bits;
+    size_t iters;
+    size_t batch;
+    size_t bytes;
+    double mean_us, median_us, min_us, max_us, stddev_us;
+};
+
+/// Runs benchmarks and collects machine-readable results. Every benchmark
+/// is first calibrated (which doubles as a warmup round) so that each
+/// timed sample takes at least `min_sample_us`, then timed `iters` times.
+class BenchRunner {
+private:
+    typedef chrono::steady_clock _Clock;
+    vector<BenchResult> _results;
+    mt19937_64 _rng;
+    double _elapsed_us(function<void()> &fn, size_t batch) {
+        auto begin = _Clock::now();
+        for (size_t i = 0; i < batch; i++)
+            fn();
+        auto end = _Clock::now();
+        return chrono::duration<double, micro>(end - begin).count();
+    }
+public:
+    size_t iters = 3;
+    size_t max_bits = 64;
+    double min_sample_us = 10000.0;
+    string filter = "";
+    string backend = "all";
+    BenchRunner() : _rng(0x6572752d62656e63ull) {}
+    /// Deterministic pseudo-random operands, so that runs are reproducible.
+    int64_t rand_i64(size_t bits) {
+        uint64_t v = _rng();
+        if (bits < 64)
+            v &= ((uint64_t)1 << (bits - 1)) - 1;
+        return (int64_t)v;
+    }
+    bool enabled(const string &backend, const string &name) {
+        if (this->backend != "all" && this->backend != backend)
+            return false;
+        return name.compare(0, filter.length(), filter) == 0;
+    }
+    /// Time fn() and record its statistics.
+    /// @param bits: Operand width, 0 if not applicable.
+    /// @param bytes: Payload processed by one call, 0 if not applicable.
+    void run(const string &backend, const string &name, size_t bits,
+            size_t bytes, function<void()> fn) {
+        if (!enabled(backend, name))
+            return;
+        cerr << "  " << backend << " " << name;
+        if (bits > 0)
+            cerr << " (" << bits << " bits)";
+        cerr << endl;
+        size_t batch = 1;
+        while (_elapsed_us(fn, batch) < min_sample_us && batch < (1 << 24))
+            batch *= 2;
+        vector<double> samples;
+        for (size_t i = 0; i < iters; i++)
+            samples.push_back(_elapsed_us(fn, batch) / batch);
+        sort(samples.begin(), samples.end());
+        BenchResult res;
+        res.backend = backend;
+        res.name = name;
+        res.bits = bits;
+        res.iters = iters;
+        res.batch = batch;
+        res.bytes = bytes;
+        res.mean_us = 0.0;
+        for (auto s : samples)
+            res.mean_us += s / samples.size();
+        res.median_us = samples[samples.size() / 2];
+        res.min_us = samples.front();
+        res.max_us = samples.back();
+        res.stddev_us = 0.0;
+        for (auto s : samples)
+            res.stddev_us += (s - res.mean_us) * (s - res.mean_us);
+        res.stddev_us = sqrt(res.stddev_us / samples.size());
+        _results.push_back(res);
+    }
+    void emit_json(ostream &out) {
+        out << "{\n  \"suite\": \"liberu\",\n"
+            << "  \"revision\": \"" << ERU_BENCH_REVISION << "\",\n"
+            << "  \"iters\": " << iters << ",\n"
+            << "  \"results\": [";
+        for (size_t i = 0; i < _results.size(); i++) {
+            auto &r = _results[i];
+            out << (i ? ",\n" : "\n") << "    {"
+                << "\"backend\": \"" << r.backend << "\", "
+                << "\"name\": \"" << r.name << "\", "
+                << "\"bits\": " << r.bits << ", "
+                << "\"iters\": " << r.iters << ", "
+                << "\"batch\": " << r.batch << ", "
+                << "\"bytes\": " << r.bytes << ", "
+                << "\"mean_us\": " << r.mean_us << ", "
+                << "\"median_us\": " << r.median_us << ", "
+                << "\"min_us\": " << r.min_us << ", "
+                << "\"max_us\": " << r.max_us << ", "
+                << "\"stddev_us\": " << r.stddev_us << ", "
+                << "\"mb_per_s\": " << _throughput(r) << "}";
+        }
+        out << "\n  ]\n}\n";
+    }
+    void emit_csv(ostream &out) {
+        out << "revision,backend,name,bits,iters,batch,bytes,mean_us,"
+            << "median_us,min_us,max_us,stddev_us,mb_per_s\n";
+        for (auto &r : _results)
+            out << ERU_BENCH_REVISION << "," << r.backend << "," << r.name
+                << "," << r.bits << "," << r.iters << "," << r.batch << ","
+                << r.bytes << "," << r.mean_us << "," << r.median_us << ","
+                << r.min_us << "," << r.max_us << "," << r.stddev_us << ","
+                << _throughput(r) << "\n";
+    }
+private:
+    static double _throughput(const BenchResult &r) {
+        if (r.bytes == 0 || r.median_us <= 0.0)
+            return 0.0;
+        return r.bytes / r.median_us;  // bytes per us == MB per s
+    }
+};
+
+/// Single-gate latency of every EruEnv primitive.
+template <typename _T>
+void bench_gates(BenchRunner &runner, EruContext<_T> *ctx,
+        const string &backend) {
+    auto env = ctx->_env();
+    auto x_ = ctx->allocate(4);
+    auto x = x_.ptr();
+    env->encrypt(x + 1, true);
+    env->encrypt(x + 2, false);
+    env->encrypt(x + 3, true);
+    #define bench_gate(name, expr) runner.run(backend, "gate/" name, 1, 0,    \
+        [&]() { expr; })
+    bench_gate("lval", env->lval(x, true));
+    bench_gate("ldup", env->ldup(x, x + 1));
+    bench_gate("lnot", env->lnot(x, x + 1));
+    bench_gate("land", env->land(x, x + 1, x + 2));
+    bench_gate("lor", env->lor(x, x + 1, x + 2));
+    bench_gate("lnand", env->lnand(x, x + 1, x + 2));
+    bench_gate("lnor", env->lnor(x, x + 1, x + 2));
+    bench_gate("lxor", env->lxor(x, x + 1, x + 2));
+    bench_gate("lxnor", env->lxnor(x, x + 1, x + 2));
+    bench_gate("landyn", env->landyn(x, x + 1, x + 2));
+    bench_gate("landny", env->landny(x, x + 1, x + 2));
+    bench_gate("loryn", env->loryn(x, x + 1, x + 2));
+    bench_gate("lorny", env->lorny(x, x + 1, x + 2));
+    bench_gate("lifelse", env->lifelse(x, x + 1, x + 2, x + 3));
+    bench_gate("encrypt", env->encrypt(x, true));
+    bench_gate("decrypt", env->decrypt(x + 1));
+    #undef bench_gate
+    ctx->free(x_);
+}
+
+/// EruBool operators.
+template <typename _T>
+void bench_bool(BenchRunner &runner, EruContext<_T> *ctx,
+        const string &backend) {
+    EruBool<_T> a(ctx), b(ctx);
+    a.encrypt(true);
+    b.encrypt(false);
+    #define bench_bool_op(name, expr) runner.run(backend, "bool/" name, 1, 0, \
+        [&]() { EruBool<_T> c = expr; })
+    bench_bool_op("not", !a);
+    bench_bool_op("and", a && b);
+    bench_bool_op("or", a || b);
+    bench_bool_op("xor", a ^ b);
+    bench_bool_op("eq", a == b);
+    bench_bool_op("ne", a != b);
+    #undef bench_bool_op
+}
+
+/// EruIntGeneral arithmetic at a given width.
+template <typename _T, size_t _Size>
+void bench_int(BenchRunner &runner, EruContext<_T> *ctx,
+        const string &backend) {
+    if (_Size > runner.max_bits)
+        return;
+    typedef EruIntGeneral<_T, _Size> _Int;
+    _Int a(ctx), b(ctx);
+    a.encrypt(runner.rand_i64(_Size));
+    b.encrypt(runner.rand_i64(_Size));
+    #define bench_int_op(name, expr) runner.run(backend, "int/" name, _Size,  \
+        0, [&]() { _Int c = expr; })
+    bench_int_op("add", a + b);
+    bench_int_op("sub", a - b);
+    bench_int_op("mul", a * b);
+    bench_int_op("div", a / b);
+    bench_int_op("div_const", a / 10);
+    bench_int_op("neg", -a);
+    bench_int_op("shl", a << 3);
+    bench_int_op("shr", a >> 3);
+    EruInt8(_T) k(ctx);
+    k.encrypt(runner.rand_i64(8) & (_Size - 1));
+    bench_int_op("shl_var", a << k);
+    bench_int_op("rotl_var", a.rotl(k));
+    #undef bench_int_op
+}
+
+/// EruFloatGeneral arithmetic under both rounding modes.
+template <typename _T, size_t _ExpSize, size_t _DigSize>
+void bench_float(BenchRunner &runner, EruContext<_T> *ctx,
+        const string &backend) {
+    const size_t bits = 1 + _ExpSize + _DigSize;
+    if (bits > runner.max_bits)
+        return;
+    typedef EruFloatGeneral<_T, _ExpSize, _DigSize> _Float;
+    _Float a(ctx), b(ctx);
+    a.encrypt(runner.rand_i64(16) / 64.0);
+    b.encrypt(runner.rand_i64(16) / 64.0);
+    #define bench_float_op(name, expr) runner.run(backend, "float/" name,     \
+        bits, 0, [&]() { auto c = expr; })
+    bench_float_op("add", a + b);
+    bench_float_op("add_trunc", a.add(b, ERU_ROUND_TRUNCATE));
+    bench_float_op("sub", a - b);
+    bench_float_op("mul", a * b);
+    bench_float_op("mul_trunc", a.mul(b, ERU_ROUND_TRUNCATE));
+    bench_float_op("lt", a < b);
+    #undef bench_float_op
+}
+
+/// EruFixedGeneral arithmetic, to hold against the float cases.
+template <typename _T, size_t _IntBits, size_t _FracBits,
+    EruOverflow _Overflow>
+void bench_fixed(BenchRunner &runner, EruContext<_T> *ctx,
+        const string &backend, const string &suffix) {
+    const size_t bits = _IntBits + _FracBits;
+    if (bits > runner.max_bits)
+        return;
+    typedef EruFixedGeneral<_T, _IntBits, _FracBits, _Overflow> _Fixed;
+    _Fixed a(ctx), b(ctx);
+    a.encrypt(runner.rand_i64(16) / 64.0);
+    b.encrypt(runner.rand_i64(16) / 64.0);
+    #define bench_fixed_op(name, expr) runner.run(backend,                    \
+        "fixed/" name + suffix, bits, 0, [&]() { auto c = expr; })
+    bench_fixed_op("add", a + b);
+    bench_fixed_op("mul", a * b);
+    bench_fixed_op("lt", a < b);
+    #undef bench_fixed_op
+}
+
+/// EruBigInt arithmetic at a runtime width.
+template <typename _T>
+void bench_bigint(BenchRunner &runner, EruContext<_T> *ctx,
+        const string &backend, size_t bits) {
+    if (bits > runner.max_bits)
+        return;
+    EruBigInt<_T> a(ctx, bits), b(ctx, bits);
+    a.encrypt(runner.rand_i64(64));
+    b.encrypt(runner.rand_i64(64));
+    runner.run(backend, "bigint/add", bits, 0, [&]() {
+        EruBigInt<_T> c = a + b; });
+    runner.run(backend, "bigint/mul_wide", bits, 0, [&]() {
+        EruBigInt<_T> c = a.mul_wide(b); });
+}
+
+/// EruArray lookups and stores at an encrypted index.
+template <typename _T>
+void bench_array(BenchRunner &runner, EruContext<_T> *ctx,
+        const string &backend, size_t length) {
+    EruArray<_T, EruInt32(_T)> arr(ctx, length);
+    EruInt32(_T) v(ctx);
+    for (size_t i = 0; i < length; i++) {
+        v.encrypt(runner.rand_i64(32));
+        arr.set(i, v);
+    }
+    EruInt16(_T) idx(ctx);
+    idx.encrypt(runner.rand_i64(16) % length);
+    string suffix = "_" + to_string(length);
+    runner.run(backend, "array/read" + suffix, 32, 0, [&]() {
+        EruInt32(_T) c = arr.read(idx); });
+    runner.run(backend, "array/write" + suffix, 32, 0, [&]() {
+        arr.write(idx, v); });
+}
+
+/// eru_sort over a batch of 16-bit keys, with and without payloads.
+template <typename _T>
+void bench_sort(BenchRunner &runner, EruContext<_T> *ctx,
+        const string &backend, size_t count) {
+    vector<EruInt16(_T)> keys;
+    vector<EruInt16(_T)> payloads;
+    for (size_t i = 0; i < count; i++) {
+        keys.emplace_back(ctx);
+        keys.back().encrypt(runner.rand_i64(16));
+        payloads.emplace_back(ctx);
+        payloads.back().encrypt(i);
+    }
+    string suffix = "_" + to_string(count);
+    runner.run(backend, "sort/keys" + suffix, 16, 0, [&]() {
+        eru_sort(ctx, keys, false); });
+    runner.run(backend, "sort/payload" + suffix, 16, 0, [&]() {
+        eru_sort(ctx, keys, payloads, false); });
+}
+
+/// EruColumn filters and aggregates over a table of 16-bit values.
+template <typename _T>
+void bench_table(BenchRunner &runner, EruContext<_T> *ctx,
+        const string &backend, size_t rows) {
+    EruColumn<_T, 16> values(ctx, rows), keys(ctx, rows);
+    vector<int64_t> v, k;
+    for (size_t i = 0; i < rows; i++) {
+        v.push_back(runner.rand_i64(16));
+        k.push_back(runner.rand_i64(16) % 4);
+    }
+    values.encrypt(v);
+    keys.encrypt(k);
+    EruInt16(_T) t(ctx);
+    t.encrypt(runner.rand_i64(16));
+    auto mask = values < t;
+    string suffix = "_" + to_string(rows);
+    runner.run(backend, "table/filter" + suffix, 16, 0, [&]() {
+        auto m = values < t; });
+    runner.run(backend, "table/sum" + suffix, 16, 0, [&]() {
+        EruInt16(_T) c = values.sum(mask); });
+    runner.run(backend, "table/count" + suffix, 16, 0, [&]() {
+        EruInt16(_T) c = mask.template count<16>(); });
+    runner.run(backend, "table/max" + suffix, 16, 0, [&]() {
+        EruInt16(_T) c = values.max(mask); });
+    runner.run(backend, "table/group_sum" + suffix, 16, 0, [&]() {
+        auto c = keys.group_sum(4, values, &mask); });
+}
+
+/// Integer multiply recorded as a gate graph, optimized, then replayed.
+/// The optimizer's bootstrap counts go to the log.
+template <typename _T, size_t _Size>
+void bench_graph(BenchRunner &runner, EruContext<_T> *ctx,
+        const string &backend) {
+    if (_Size > runner.max_bits)
+        return;
+    typedef EruIntGeneral<_T, _Size> _Int;
+    _Int a(ctx), b(ctx), c(ctx);
+    a.encrypt(runner.rand_i64(_Size));
+    b.encrypt(runner.rand_i64(_Size));
+    EruCircuit circuit;
+    runner.run(backend, "graph/record_mul", _Size, 0, [&]() {
+        EruRecorder<_T> rec(ctx);
+        rec.input(a);
+        rec.input(b);
+        _Int r = a * b;
+        rec.output(r);
+        circuit = rec.finish();
+    });
+    EruCircuit optimized = circuit;
+    auto stats = optimized.optimize();
+    EruSchedule schedule = optimized.schedule();
+    if (runner.enabled(backend, "graph/"))
+        cerr << "    mul" << _Size << " bootstraps "
+             << stats.bootstraps_before << " -> " << stats.bootstraps_after
+             << ", " << schedule.slots << " slots for "
+             << optimized.gates() << " gates in " << schedule.steps.size() - 1
+             << " steps" << endl;
+    runner.run(backend, "graph/optimize_mul", _Size, 0, [&]() {
+        EruCircuit tmp = circuit;
+        tmp.optimize();
+    });
+    runner.run(backend, "graph/run_mul", _Size, 0, [&]() {
+        circuit.run(ctx, {a._ptr(), b._ptr()}, {c._ptr()}); });
+    runner.run(backend, "graph/run_mul_optimized", _Size, 0, [&]() {
+        optimized.run(ctx, {a._ptr(), b._ptr()}, {c._ptr()}); });
+    runner.run(backend, "graph/schedule_mul", _Size, 0, [&]() {
+        optimized.schedule(); });
+    EruData saved = optimized.save();
+    runner.run(backend, "graph/save_mul", _Size, saved.length(), [&]() {
+        optimized.save(); });
+    runner.run(backend, "graph/load_mul", _Size, saved.length(), [&]() {
+        EruCircuit::load(saved); });
+    runner.run(backend, "graph/run_mul_scheduled", _Size, 0, [&]() {
+        optimized.run(ctx, {a._ptr(), b._ptr()}, {c._ptr()}, schedule); });
+}
+
+/// Running total of 16 values, recomputed in full and after one changed.
+template <typename _T>
+void bench_incremental(BenchRunner &runner, EruContext<_T> *ctx,
+        const string &backend) {
+    typedef EruIntGeneral<_T, 32> _Int;
+    vector<_Int> vals;
+    for (size_t i = 0; i < 16; i++) {
+        vals.emplace_back(ctx);
+        vals.back().encrypt(runner.rand_i64(32));
+    }
+    _Int total(ctx);
+    EruRecorder<_T> rec(ctx);
+    for (auto &v : vals)
+        rec.input(v);
+    _Int sum = vals[0] + vals[1];
+    for (size_t i = 2; i < vals.size(); i++)
+        sum += vals[i];
+    rec.output(sum);
+    EruCircuit circuit = rec.finish();
+    circuit.optimize();
+    EruIncremental<_T> inc(ctx, circuit);
+    for (size_t i = 0; i < vals.size(); i++)
+        inc.set(i, vals[i]._ptr());
+    runner.run(backend, "incremental/sum16_full", 32, 0, [&]() {
+        for (size_t i = 0; i < vals.size(); i++)
+            inc.set(i, vals[i]._ptr());
+        inc.evaluate({total._ptr()});
+    });
+    runner.run(backend, "incremental/sum16_one_changed", 32, 0, [&]() {
+        inc.set(8, vals[8]._ptr());
+        inc.evaluate({total._ptr()});
+    });
+}
+
+/// Bristol Fashion netlist of an n-bit ripple-carry adder, sum bits in
+/// the last wires as the format wants.
+static string bristol_adder(size_t n) {
+    ostringstream gates;
+    size_t w = 2 * n, count = 0, carry = 0;
+    vector<size_t> sum(n);
+    auto gate = [&](const char *type, size_t x, size_t y) {
+        gates << "2 1 " << x << " " << y << " " << w << " " << type << "\n";
+        count++;
+        return w++;
+    };
+    for (size_t i = 0; i < n; i++) {
+        size_t x = gate("XOR", i, n + i);
+        if (i == 0) {
+            sum[i] = x;
+            carry = gate("AND", i, n + i);
+            continue;
+        }
+        sum[i] = gate("XOR", x, carry);
+        // carry = (a ^ b) & c ^ a & b
+        size_t t = gate("AND", x, carry);
+        carry = gate("XOR", t, gate("AND", i, n + i));
+    }
+    for (size_t i = 0; i < n; i++) {
+        gates << "1 1 " << sum[i] << " " << w++ << " EQW\n";
+        count++;
+    }
+    ostringstream res;
+    res << count << " " << w << "\n2 " << n << " " << n << "\n1 " << n
+        << "\n\n" << gates.str();
+    return res.str();
+}
+
+/// Netlist import, and replay by levels against the default schedule.
+template <typename _T>
+void bench_netlist(BenchRunner &runner, EruContext<_T> *ctx,
+        const string &backend) {
+    string text = bristol_adder(32);
+    EruCircuit circuit;
+    runner.run(backend, "netlist/read_bristol_add32", 32, text.length(),
+        [&]() {
+            istringstream in(text);
+            circuit = eru_read_bristol(in);
+        });
+    circuit.optimize();
+    EruSchedule levels = circuit.levels(), schedule = circuit.schedule();
+    EruIntGeneral<_T, 32> a(ctx), b(ctx), c(ctx);
+    a.encrypt(runner.rand_i64(32));
+    b.encrypt(runner.rand_i64(32));
+    runner.run(backend, "netlist/run_add32_levels", 32, 0, [&]() {
+        circuit.run(ctx, {a._ptr(), b._ptr()}, {c._ptr()}, levels); });
+    runner.run(backend, "netlist/run_add32_schedule", 32, 0, [&]() {
+        circuit.run(ctx, {a._ptr(), b._ptr()}, {c._ptr()}, schedule); });
+}
+
+/// Batch encryption and decryption of 32-bit integers.
+template <typename _T>
+void bench_batch(BenchRunner &runner, EruContext<_T> *ctx,
+        const string &backend, size_t count) {
+    vector<int64_t> values, out(count);
+    for (size_t i = 0; i < count; i++)
+        values.push_back(runner.rand_i64(32));
+    EruBits<_T> bits = ctx->encrypt_many(values, 32);
+    string suffix = "_" + to_string(count);
+    runner.run(backend, "batch/encrypt" + suffix, 32, 0, [&]() {
+        ctx->_encrypt_many(bits.ptr(), values.data(), count, 32); });
+    runner.run(backend, "batch/decrypt" + suffix, 32, 0, [&]() {
+        ctx->decrypt_many(bits, out.data(), count, 32); });
+    ctx->free(bits);
+}
+
+/// bexport / bimport and the underlying binobjlist codec.
+template <typename _T>
+void bench_serialize(BenchRunner &runner, EruContext<_T> *ctx,
+        const string &backend) {
+    auto env = ctx->_env();
+    EruInt64(_T) a(ctx), b(ctx);
+    a.encrypt(runner.rand_i64(64));
+    EruData data = a.bexport();
+    runner.run(backend, "serialize/bexport", 64, data.length(),
+        [&]() { a.bexport(); });
+    runner.run(backend, "serialize/bimport", 64, data.length(),
+        [&]() { b.bimport(data); });
+    vector<EruData> objs;
+    for (size_t i = 0; i < 64; i++)
+        objs.push_back(env->bexport(a._ptr() + i));
+    runner.run(backend, "serialize/binobjlist_encode", 64, data.length(),
+        [&]() { _EruHazmat::binobjlist_encode(objs); });
+    runner.run(backend, "serialize/binobjlist_decode", 64, data.length(),
+        [&]() { _EruHazmat::binobjlist_decode(data); });
+}
+
+/// Allocator reuse (warm pool) and creation (cold pool) costs.
+template <typename _T>
+void bench_alloc(BenchRunner &runner, EruContext<_T> *ctx,
+        const string &backend) {
+    void *params = ctx->_session() ? ctx->_session()->params() : nullptr;
+    auto churn = [](EruAllocator<_T> *alloc) {
+        vector<EruBits<_T>> held;
+        for (size_t i = 0; i < 256; i++)
+            held.push_back(alloc->allocate((i % 8 + 1) * 8));
+        for (auto &bits : held)
+            alloc->free(bits);
+    };
+    runner.run(backend, "alloc/churn_warm", 0, 0,
+        [&]() { churn(ctx->_allocator()); });
+    runner.run(backend, "alloc/churn_cold", 0, 0, [&]() {
+        EruAllocator<_T> alloc(params);
+        churn(&alloc);
+    });
+}
+
+template <typename _T>
+void bench_backend(BenchRunner &runner, EruContext<_T> *ctx,
+        const string &backend) {
+    bench_gates<_T>(runner, ctx, backend);
+    bench_bool<_T>(runner, ctx, backend);
+    bench_int<_T, 8>(runner, ctx, backend);
+    bench_int<_T, 16>(runner, ctx, backend);
+    bench_int<_T, 32>(runner, ctx, backend);
+    bench_int<_T, 64>(runner, ctx, backend);
+    bench_int<_T, 128>(runner, ctx, backend);
+    bench_float<_T, 5, 10>(runner, ctx, backend);
+    bench_float<_T, 8, 23>(runner, ctx, backend);
+    bench_float<_T, 11, 52>(runner, ctx, backend);
+    bench_array<_T>(runner, ctx, backend, 16);
+    bench_array<_T>(runner, ctx, backend, 256);
+    bench_sort<_T>(runner, ctx, backend, 16);
+    bench_sort<_T>(runner, ctx, backend, 64);
+    bench_table<_T>(runner, ctx, backend, 64);
+    for (size_t bits = 64; bits <= 1024; bits *= 4)
+        bench_bigint<_T>(runner, ctx, backend, bits);
+    bench_fixed<_T, 8, 8, ERU_OVERFLOW_WRAP>(runner, ctx, backend, "");
+    bench_fixed<_T, 16, 16, ERU_OVERFLOW_WRAP>(runner, ctx, backend, "");
+    bench_fixed<_T, 16, 16, ERU_OVERFLOW_SATURATE>(runner, ctx, backend,
+        "_sat");
+    bench_graph<_T, 16>(runner, ctx, backend);
+    bench_graph<_T, 32>(runner, ctx, backend);
+    bench_incremental<_T>(runner, ctx, backend);
+    bench_netlist<_T>(runner, ctx, backend);
+    bench_batch<_T>(runner, ctx, backend, 1024);
+    bench_serialize<_T>(runner, ctx, backend);
+    bench_alloc<_T>(runner, ctx, backend);
+}
+
+/// Key import and the end-to-end service, which only exist in FHE mode.
+void bench_fhe_only(BenchRunner &runner, EruContext<EruGate> *ctx) {
+    EruData secret_key = ctx->get_secret_key();
+    EruData cloud_key = ctx->get_cloud_key();
+    EruData cloud_image = ctx->get_cloud_key_image();
+    runner.run("fhe", "key/cloud_import", 0, cloud_key.length(),
+        [&]() { EruKey::from_cloud(cloud_key); });
+    runner.run("fhe", "key/cloud_image_import", 0, cloud_image.length(),
+        [&]() { EruKey::from_cloud(cloud_image); });
+    runner.run("fhe", "key/secret_import", 0, secret_key.length(),
+        [&]() { EruKey::from_secret(secret_key); });
+    EruSession keygen(128);  // keeps ctx's key for the services below
+    runner.run("fhe", "key/generate", 0, secret_key.length(),
+        [&]() { keygen.generate_key(); });
+    for (string op : {"add", "mul"}) {
+        EruInt64(EruGate) a(ctx), b(ctx);
+        a.encrypt(runner.rand_i64(32));
+        b.encrypt(runner.rand_i64(32));
+        vector<EruData> req = {op, cloud_key, a.bexport(), b.bexport()};
+        EruData input = _EruHazmat::binobjlist_encode(req);
+        runner.run("fhe", "service/" + op, 64, input.length(), [&]() {
+            char *out = nullptr;
+            provide_service((char*)input.c_str(), input.length(), &out);
+            delete[] out;
+        });
+    }
+}
+
+/// Bootstrapped gate latency under every parameter preset, and the import
+/// of its cloud key, whose payload is the key size.
+void bench_params(BenchRunner &runner) {
+    for (auto &preset : EruParams::presets()) {
+        string name = "params/" + preset + "/";
+        if (!runner.enabled("fhe", name + "land") &&
+                !runner.enabled("fhe", name + "cloud_import"))
+            continue;
+        EruContext<EruGate> ctx(preset);
+        ctx.gen_secret_key();
+        EruData cloud_key = ctx.get_cloud_key();
+        auto env = ctx._env();
+        auto x_ = ctx.allocate(3);
+        auto x = x_.ptr();
+        env->encrypt(x + 1, true);
+        env->encrypt(x + 2, false);
+        runner.run("fhe", name + "land", 1, 0,
+            [&]() { env->land(x, x + 1, x + 2); });
+        runner.run("fhe", name + "cloud_import", 0, cloud_key.length(),
+            [&]() { EruKey::from_cloud(cloud_key); });
+        ctx.free(x_);
+    }
+}
+
+void usage(const char *prog) {
+    cerr << "usage: " << prog << " [options]\n"
+         << "  --backend plain|fhe|all   backends to run (default all)\n"
+         << "  --filter PREFIX           only run benchmarks named PREFIX*\n"
+         << "  --iters N                 timed samples per benchmark (3)\n"
+         << "  --max-bits N              widest operands to benchmark (64),\n"
+         << "                            128-bit integers and wider bigints\n"
+         << "                            need --max-bits 128 or more\n"
+         << "  --min-sample-us N         calibrated sample length (10000)\n"
+         << "  --format json|csv         output format (json)\n"
+         << "  --output FILE             write results to FILE (stdout)\n";
+}
+
+int main(int argc, char **argv) {
+    BenchRunner runner;
+    string format = "json", output = "";
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (i + 1 >= argc) {
+            usage(argv[0]);
+            return arg == "--help" ? 0 : 1;
+        }
+        string val = argv[++i];
+        if (arg == "--backend")
+            runner.backend = val;
+        else if (arg == "--filter")
+            runner.filter = val;
+        else if (arg == "--iters")
+            runner.iters = max(1, stoi(val));
+        else if (arg == "--max-bits")
+            runner.max_bits = stoul(val);
+        else if (arg == "--min-sample-us")
+            runner.min_sample_us = stod(val);
+        else if (arg == "--format")
+            format = val;
+        else if (arg == "--output")
+            output = val;
+        else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (format != "json" && format != "csv") {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (runner.backend == "all" || runner.backend == "plain") {
+        cerr << "benchmarking plain backend" << endl;
+        EruContext<bool> ctx(128);
+        bench_backend<bool>(runner, &ctx, "plain");
+    }
+    if (runner.backend == "all" || runner.backend == "fhe") {
+        cerr << "benchmarking fhe backend" << endl;
+        EruContext<EruGate> ctx(128);
+        // fixed seed for reproducible keys, never do this in production
+        uint32_t seed[] = {0x65727521, 0x62656e63, 0x68000000};
+        ctx._session()->set_seed(seed, 3);
+        ctx._session()->generate_key(false);
+        bench_backend<EruGate>(runner, &ctx, "fhe");
+        bench_fhe_only(runner, &ctx);
+        bench_params(runner);
+    }
+
+    ofstream file;
+    if (output.length() > 0)
+        file.open(output);
+    ostream &out = output.length() > 0 ? file : cout;
+    if (format == "json")
+        runner.emit_json(out);
+    else
+        runner.emit_csv(out);
+    return 0;
+}
@@ -0,0 +1,149 @@
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+#include "liberu.h"
+#include "server.h"
+
+using namespace std;
+
+
+/// What one client connection observed.
+struct LoadgenStats {
+    vector<double> latencies_ms;  // of successful requests
+    map<int, size_t> statuses;
+    size_t wrong = 0;
+};
+
+void usage(const char *prog) {
+    cerr << "usage: " << prog << " [options]\n"
+         << "  --socket PATH             daemon socket (/tmp/eru.sock)\n"
+         << "  --connections N           concurrent clients (4)\n"
+         << "  --requests N              requests per client (4)\n"
+         << "  --op add|mul              service operation (add)\n"
+         << "  --verify 0|1              decrypt and check results (1)\n";
+}
+
+double percentile(vector<double> &sorted, double p) {
+    if (sorted.empty())
+        return 0.0;
+    size_t idx = (size_t)(p * (sorted.size() - 1) + 0.5);
+    return sorted[idx];
+}
+
+int main(int argc, char **argv) {
+    string socket_path = "/tmp/eru.sock", op = "add";
+    size_t connections = 4, requests = 4;
+    bool verify = true;
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (i + 1 >= argc) {
+            usage(argv[0]);
+            return arg == "--help" ? 0 : 1;
+        }
+        string val = argv[++i];
+        if (arg == "--socket")
+            socket_path = val;
+        else if (arg == "--connections")
+            connections = stoul(val);
+        else if (arg == "--requests")
+            requests = stoul(val);
+        else if (arg == "--op")
+            op = val;
+        else if (arg == "--verify")
+            verify = val != "0";
+        else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    cerr << "preparing request" << endl;
+    EruContext<EruGate> ctx(128);
+    ctx.gen_secret_key();
+    int64_t x = 1234567, y = 7654321;
+    int64_t expected = op == "mul" ? x * y : x + y;
+    EruInt64(EruGate) a(&ctx), b(&ctx);
+    a.encrypt(x);
+    b.encrypt(y);
+    vector<EruData> req = {op, ctx.get_cloud_key(), a.bexport(), b.bexport()};
+    EruData input = _EruHazmat::binobjlist_encode(req);
+
+    cerr << "sending " << connections << " x " << requests << " requests"
+         << endl;
+    vector<LoadgenStats> stats(connections);
+    vector<thread> clients;
+    mutex verify_lock;  // ctx and its allocator are not thread-safe
+    auto begin = chrono::steady_clock::now();
+    for (size_t c = 0; c < connections; c++) {
+        clients.push_back(thread([&, c] {
+            int fd = _EruHazmat::unix_connect(socket_path);
+            if (fd < 0) {
+                stats[c].statuses[-1] += requests;
+                return;
+            }
+            for (size_t r = 0; r < requests; r++) {
+                auto t0 = chrono::steady_clock::now();
+                uint8_t status;
+                EruData output;
+                if (!_EruHazmat::frame_write(fd, ERU_FRAME_OK, input) ||
+                        !_EruHazmat::frame_read(fd, status, output,
+                            (uint64_t)1 << 32)) {
+                    stats[c].statuses[-1] += requests - r;
+                    break;
+                }
+                auto t1 = chrono::steady_clock::now();
+                stats[c].statuses[status] += 1;
+                if (status != ERU_FRAME_OK)
+                    continue;
+                stats[c].latencies_ms.push_back(
+                    chrono::duration<double, milli>(t1 - t0).count());
+                if (verify) {
+                    lock_guard<mutex> guard(verify_lock);
+                    EruInt64(EruGate) res(&ctx);
+                    res.bimport(_EruHazmat::binobjlist_decode(output)[0]);
+                    if (res.decrypt() != expected)
+                        stats[c].wrong += 1;
+                }
+            }
+            close(fd);
+        }));
+    }
+    for (auto &client : clients)
+        client.join();
+    double elapsed_s = chrono::duration<double>(
+        chrono::steady_clock::now() - begin).count();
+
+    LoadgenStats total;
+    for (auto &s : stats) {
+        total.latencies_ms.insert(total.latencies_ms.end(),
+            s.latencies_ms.begin(), s.latencies_ms.end());
+        for (auto &pr : s.statuses)
+            total.statuses[pr.first] += pr.second;
+        total.wrong += s.wrong;
+    }
+    auto &lat = total.latencies_ms;
+    sort(lat.begin(), lat.end());
+    cout << "{\n  \"op\": \"" << op << "\",\n"
+         << "  \"connections\": " << connections << ",\n"
+         << "  \"requests\": " << connections * requests << ",\n"
+         << "  \"ok\": " << total.statuses[ERU_FRAME_OK] << ",\n"
+         << "  \"busy\": " << total.statuses[ERU_FRAME_BUSY] << ",\n"
+         << "  \"timeout\": " << total.statuses[ERU_FRAME_TIMEOUT] << ",\n"
+         << "  \"error\": " << total.statuses[ERU_FRAME_ERROR] << ",\n"
+         << "  \"io_failed\": " << total.statuses[-1] << ",\n"
+         << "  \"wrong\": " << total.wrong << ",\n"
+         << "  \"elapsed_s\": " << elapsed_s << ",\n"
+         << "  \"throughput_rps\": " << lat.size() / elapsed_s << ",\n"
+         << "  \"latency_ms\": {\"p50\": " << percentile(lat, 0.50)
+         << ", \"p90\": " << percentile(lat, 0.90)
+         << ", \"p99\": " << percentile(lat, 0.99)
+         << ", \"max\": " << percentile(lat, 1.0) << "}\n}\n";
+    return total.wrong == 0 ? 0 : 2;
+}
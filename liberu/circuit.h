@@ -0,0 +1,439 @@
+
+// circuit.h: gate-level building blocks shared by the encrypted types
+// MIT License
+//
+// Copyright (c) 2021 Geoffrey Tang
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+
+#ifndef _LIBERU_CIRCUIT_H
+#define _LIBERU_CIRCUIT_H
+
+#include <functional>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "context.h"
+#include "pool.h"
+
+
+/// THERE BE DRAGONS!
+/// Circuits below work on raw bit arrays (index 0 is the least significant
+/// bit) and allocate their scratch space from the given context. Gates in
+/// the same layer don't depend on each other, so each layer is evaluated
+/// with gate_for.
+namespace _EruHazmat {
+    /// Run fn(0) .. fn(n - 1), concurrently when gates are bootstrapped.
+    /// Plaintext gates are too cheap to be worth the threads.
+    template <typename _T>
+    void gate_for(size_t n, const std::function<void(size_t)> &fn) {
+        if (std::is_same<_T, bool>::value || n <= 1) {
+            for (size_t i = 0; i < n; i++)
+                fn(i);
+            return;
+        }
+        parallel_for(n, fn);
+    }
+
+    /// Number of bits needed to hold values 0 .. n.
+    constexpr size_t bit_width(size_t n) {
+        return n == 0 ? 0 : 1 + bit_width(n >> 1);
+    }
+
+    /// r = a[0] || ... || a[n - 1], as a tree of depth log(n).
+    template <typename _T>
+    void or_reduce(EruContext<_T> *ctx, _T *r, const _T *a, size_t n) {
+        auto env = ctx->_env();
+        if (n == 0) {
+            env->lval(r, false);
+            return;
+        }
+        EruBits<_T> tmp = ctx->allocate(n);
+        auto t = tmp.ptr();
+        for (size_t i = 0; i < n; i++)
+            env->ldup(t + i, a + i);
+        for (size_t len = n; len > 1; len = (len + 1) / 2) {
+            gate_for<_T>(len / 2, [&](size_t i) {
+                env->lor(t + i, t + 2 * i, t + 2 * i + 1);
+            });
+            if (len % 2 == 1)
+                env->ldup(t + len / 2, t + len - 1);
+        }
+        env->ldup(r, t);
+        ctx->free(tmp);
+    }
+
+    /// r = a < b, both unsigned n-bit numbers.
+    template <typename _T>
+    void less_unsigned(EruContext<_T> *ctx, _T *r, const _T *a, const _T *b,
+            size_t n) {
+        auto env = ctx->_env();
+        if (n == 0) {
+            env->lval(r, false);
+            return;
+        }
+        EruBits<_T> tmp = ctx->allocate(1);
+        auto t = tmp.ptr();
+        // borrow out of a - b, see EruIntGeneral::_less
+        env->landny(r, a, b);
+        for (size_t i = 1; i < n; i++) {
+            env->lxnor(t, a + i, b + i);
+            env->lifelse(r, t, r, b + i);
+        }
+        ctx->free(tmp);
+    }
+
+    /// r[c] = a_c < b_c for the m pairs (a_c, b_c) of n-bit values, all
+    /// compared in the same layers. With fewer pairs than cores each is
+    /// split into a tree of depth log(n), merging (lt, eq) of two halves
+    /// as lt = eq_hi ? lt_lo : lt_hi, eq = eq_hi && eq_lo. With more, the
+    /// cores are already busy and the borrow ripple of less_unsigned does
+    /// the same in half the gates.
+    template <typename _T>
+    void less_many(EruContext<_T> *ctx, _T *r,
+            const std::vector<std::pair<const _T*, const _T*>> &pairs,
+            size_t n, bool is_signed) {
+        auto env = ctx->_env();
+        size_t m = pairs.size();
+        if (m == 0)
+            return;
+        if (n == 0) {
+            for (size_t c = 0; c < m; c++)
+                env->lval(r + c, false);
+            return;
+        }
+        // the sign bit compares the other way round
+        auto leaf = [&](_T *lt, size_t c, size_t i) {
+            auto a = pairs[c].first + i, b = pairs[c].second + i;
+            if (is_signed && i + 1 == n)
+                env->landyn(lt, a, b);
+            else
+                env->landny(lt, a, b);
+        };
+        bool ripple = std::is_same<_T, bool>::value ||
+            m >= std::thread::hardware_concurrency();
+        if (ripple) {
+            EruBits<_T> tmp = ctx->allocate(m);
+            auto t = tmp.ptr();
+            gate_for<_T>(m, [&](size_t c) { leaf(r + c, c, 0); });
+            for (size_t i = 1; i < n; i++)
+                gate_for<_T>(m, [&](size_t c) {
+                    auto a = pairs[c].first + i, b = pairs[c].second + i;
+                    env->lxnor(t + c, a, b);
+                    env->lifelse(r + c, t + c, r + c,
+                        is_signed && i + 1 == n ? a : b);
+                });
+            ctx->free(tmp);
+            return;
+        }
+        // (lt, eq) of every span, double buffered: n slots per pair
+        EruBits<_T> buf = ctx->allocate(4 * m * n);
+        _T *lt = buf.ptr(), *eq = lt + m * n;
+        _T *nlt = eq + m * n, *neq = nlt + m * n;
+        gate_for<_T>(m * n, [&](size_t k) {
+            size_t c = k / n, i = k % n;
+            leaf(lt + k, c, i);
+            env->lxnor(eq + k, pairs[c].first + i, pairs[c].second + i);
+        });
+        for (size_t w = n; w > 1; w = (w + 1) / 2) {
+            size_t h = (w + 1) / 2;
+            gate_for<_T>(m * h, [&](size_t k) {
+                size_t c = k / h, i = k % h;
+                size_t lo = c * n + 2 * i, hi = lo + 1, o = c * n + i;
+                if (2 * i + 1 == w) {
+                    env->ldup(nlt + o, lt + lo);
+                    env->ldup(neq + o, eq + lo);
+                    return;
+                }
+                env->lifelse(nlt + o, eq + hi, lt + lo, lt + hi);
+                if (h > 1)
+                    env->land(neq + o, eq + hi, eq + lo);
+            });
+            std::swap(lt, nlt);
+            std::swap(eq, neq);
+        }
+        for (size_t c = 0; c < m; c++)
+            env->ldup(r + c, lt + c * n);
+        ctx->free(buf);
+    }
+
+    /// r = a + b (+ carry_in) over n bits, with carries from a Sklansky
+    /// parallel-prefix tree: log(n) layers of two gates per merged bit
+    /// instead of a ripple through all n. r may alias a or b.
+    /// @param carry_in: nullable.
+    /// @param carry_out: nullable, receives the carry out of bit n - 1.
+    template <typename _T>
+    void prefix_add(EruContext<_T> *ctx, _T *r, const _T *a, const _T *b,
+            size_t n, const _T *carry_in = nullptr,
+            _T *carry_out = nullptr) {
+        auto env = ctx->_env();
+        if (n == 0) {
+            if (carry_out != nullptr) {
+                if (carry_in != nullptr)
+                    env->ldup(carry_out, carry_in);
+                else
+                    env->lval(carry_out, false);
+            }
+            return;
+        }
+        // g: generate, p: propagate; a group never does both, so merging
+        // with the group below is g = p ? g_below : g and p = p && p_below
+        EruBits<_T> buf = ctx->allocate(3 * n);
+        auto g = buf.ptr(), p = g + n, x = p + n;
+        gate_for<_T>(2 * n, [&](size_t i) {
+            if (i < n)
+                env->land(g + i, a + i, b + i);
+            else
+                env->lxor(x + (i - n), a + (i - n), b + (i - n));
+        });
+        for (size_t i = 0; i < n; i++)
+            env->ldup(p + i, x + i);
+        if (carry_in != nullptr)
+            env->lifelse(g, p, carry_in, g);
+        for (size_t half = 1; half < n; half *= 2) {
+            // in each block of 2 * half, the upper half merges with the
+            // top of the lower half
+            std::vector<size_t> nodes;
+            for (size_t i = 0; i < n; i++)
+                if (i & half)
+                    nodes.push_back(i);
+            gate_for<_T>(nodes.size(), [&](size_t k) {
+                size_t i = nodes[k], j = (i & ~(2 * half - 1)) + half - 1;
+                env->lifelse(g + i, p + i, g + j, g + i);
+                env->land(p + i, p + i, p + j);
+            });
+        }
+        // sum bits use the carry into each position
+        if (carry_out != nullptr)
+            env->ldup(carry_out, g + n - 1);
+        gate_for<_T>(n, [&](size_t i) {
+            if (i > 0)
+                env->lxor(r + i, x + i, g + i - 1);
+            else if (carry_in != nullptr)
+                env->lxor(r, x, carry_in);
+            else
+                env->ldup(r, x);
+        });
+        ctx->free(buf);
+    }
+
+    /// r = sum of all bits in columns, modulo 2^n, where the bits of
+    /// columns[i] weigh 2^i. Full adders turn three bits of a column into
+    /// one of it and one of the next (3:2 carry-save compression), every
+    /// full adder of a layer at once, until no column holds more than two;
+    /// then a single prefix adder sums the last two rows. Adding m words
+    /// this way takes log1.5(m) layers and one carry propagation, rather
+    /// than m - 1 of them.
+    template <typename _T>
+    void column_sum(EruContext<_T> *ctx, _T *r,
+            std::vector<std::vector<const _T*>> columns, size_t n) {
+        auto env = ctx->_env();
+        if (n == 0)
+            return;
+        columns.resize(n);
+        std::vector<EruBits<_T>> layers;
+        while (true) {
+            // full adder k takes bits 3j .. 3j + 2 of column i
+            std::vector<std::pair<size_t, size_t>> adders;
+            for (size_t i = 0; i < n; i++)
+                for (size_t j = 0; j + 3 <= columns[i].size(); j += 3)
+                    adders.push_back(std::make_pair(i, j));
+            if (adders.empty())
+                break;
+            size_t m = adders.size();
+            layers.push_back(ctx->allocate(2 * m));
+            _T *sum = layers.back().ptr(), *carry = sum + m;
+            gate_for<_T>(m, [&](size_t k) {
+                auto &col = columns[adders[k].first];
+                size_t j = adders[k].second;
+                env->lxor(sum + k, col[j], col[j + 1]);
+                env->lifelse(carry + k, sum + k, col[j + 2], col[j]);
+                env->lxor(sum + k, sum + k, col[j + 2]);
+            });
+            std::vector<std::vector<const _T*>> next(n);
+            for (size_t i = 0; i < n; i++)
+                for (size_t j = columns[i].size() / 3 * 3;
+                        j < columns[i].size(); j++)
+                    next[i].push_back(columns[i][j]);
+            for (size_t k = 0; k < m; k++) {
+                size_t i = adders[k].first;
+                next[i].push_back(sum + k);
+                if (i + 1 < n)
+                    next[i + 1].push_back(carry + k);
+            }
+            columns.swap(next);
+        }
+        EruBits<_T> rows = ctx->allocate(2 * n);
+        _T *a = rows.ptr(), *b = a + n;
+        for (size_t i = 0; i < n; i++) {
+            if (columns[i].size() > 0)
+                env->ldup(a + i, columns[i][0]);
+            else
+                env->lval(a + i, false);
+            if (columns[i].size() > 1)
+                env->ldup(b + i, columns[i][1]);
+            else
+                env->lval(b + i, false);
+        }
+        prefix_add<_T>(ctx, r, a, b, n);
+        ctx->free(rows);
+        for (auto &layer : layers)
+            ctx->free(layer);
+    }
+
+    /// r = a shifted by the unsigned m-bit amount. Takes one layer of n
+    /// multiplexers per amount bit below log2(n) instead of a shift per
+    /// possible amount; the amount bits above only decide together whether
+    /// everything is shifted out, which is one more layer. r may alias a.
+    /// @param left: shift towards the most significant bit.
+    /// @param sticky: on right shifts, OR every bit shifted out into r[0].
+    /// @param fill: bit shifted in, nullptr for zeros.
+    template <typename _T>
+    void barrel_shift(EruContext<_T> *ctx, _T *r, const _T *a, size_t n,
+            const _T *amount, size_t m, bool left, bool sticky = false,
+            const _T *fill = nullptr) {
+        auto env = ctx->_env();
+        size_t stages = 0;
+        while (stages < m && ((size_t)1 << stages) < n)
+            stages++;
+        EruBits<_T> buf = ctx->allocate(2 * n + 2);
+        _T *cur = buf.ptr(), *nxt = buf.ptr() + n, *lost = buf.ptr() + 2 * n;
+        _T *over = lost + 1;
+        sticky = sticky && !left;
+        for (size_t i = 0; i < n; i++)
+            env->ldup(cur + i, a + i);
+        // one stage: bits i take src(i) if sel, otherwise stay; src(i) out
+        // of range takes the fill
+        auto stage = [&](const _T *sel, size_t s) {
+            if (sticky)
+                or_reduce(ctx, lost, cur, s < n ? s + 1 : n);
+            gate_for<_T>(n, [&](size_t i) {
+                if (sticky && i == 0)
+                    env->lifelse(nxt, sel, lost, cur);
+                else if (left ? i >= s : i + s < n)
+                    env->lifelse(nxt + i, sel, cur + (left ? i - s : i + s),
+                        cur + i);
+                else if (fill != nullptr)
+                    env->lifelse(nxt + i, sel, fill, cur + i);
+                else
+                    env->landny(nxt + i, sel, cur + i);
+            });
+            std::swap(cur, nxt);
+        };
+        for (size_t k = 0; k < stages; k++)
+            stage(amount + k, (size_t)1 << k);
+        if (stages < m) {
+            or_reduce(ctx, over, amount + stages, m - stages);
+            stage(over, n);
+        }
+        for (size_t i = 0; i < n; i++)
+            env->ldup(r + i, cur + i);
+        ctx->free(buf);
+    }
+
+    /// r = a rotated by the unsigned m-bit amount, one layer of n
+    /// multiplexers per amount bit. Bit k rotates by 2^k mod n, so amounts
+    /// wrap modulo n for any n, and bits whose rotation is a multiple of n
+    /// cost nothing. r may alias a.
+    /// @param left: rotate towards the most significant bit.
+    template <typename _T>
+    void barrel_rotate(EruContext<_T> *ctx, _T *r, const _T *a, size_t n,
+            const _T *amount, size_t m, bool left) {
+        auto env = ctx->_env();
+        EruBits<_T> buf = ctx->allocate(2 * n);
+        _T *cur = buf.ptr(), *nxt = buf.ptr() + n;
+        for (size_t i = 0; i < n; i++)
+            env->ldup(cur + i, a + i);
+        size_t s = 1 % n;
+        for (size_t k = 0; k < m; k++, s = (2 * s) % n) {
+            if (s == 0)
+                continue;
+            size_t by = left ? n - s : s;  // as a right rotation
+            gate_for<_T>(n, [&](size_t i) {
+                env->lifelse(nxt + i, amount + k, cur + (i + by) % n,
+                    cur + i);
+            });
+            std::swap(cur, nxt);
+        }
+        for (size_t i = 0; i < n; i++)
+            env->ldup(r + i, cur + i);
+        ctx->free(buf);
+    }
+
+    /// r = number of leading (most significant) zeros in a, written to
+    /// bit_width(n) bits. Pairs of halves are merged in a tree of depth
+    /// log(n): the count of the upper half, or 2^k plus the count of the
+    /// lower half when the upper one is all zeros.
+    template <typename _T>
+    void count_leading_zeros(EruContext<_T> *ctx, _T *r, const _T *a,
+            size_t n) {
+        auto env = ctx->_env();
+        size_t width = bit_width(n), levels = 0;
+        while (((size_t)1 << levels) < n)
+            levels++;
+        size_t padded = (size_t)1 << levels;
+        // each node: [zero, count bits...], levels + 1 bits per node
+        size_t node = levels + 1;
+        EruBits<_T> cur_buf = ctx->allocate(padded * node);
+        EruBits<_T> nxt_buf = ctx->allocate(padded * node);
+        _T *cur = cur_buf.ptr(), *nxt = nxt_buf.ptr();
+        // leaves from the top down; padding below a[0] counts as ones so it
+        // never adds to the count
+        for (size_t i = 0; i < padded; i++) {
+            if (i < n)
+                env->lnot(cur + i * node, a + (n - 1 - i));
+            else
+                env->lval(cur + i * node, false);
+        }
+        for (size_t k = 0; k < levels; k++) {
+            size_t count = padded >> (k + 1);
+            gate_for<_T>(count * (k + 2), [&](size_t j) {
+                size_t i = j / (k + 2), b = j % (k + 2);
+                _T *hi = cur + 2 * i * node, *lo = hi + node;
+                _T *out = nxt + i * node;
+                if (b == 0)  // both halves empty
+                    env->land(out, hi, lo);
+                else if (b == k + 1)  // upper half empty adds 2^k
+                    env->ldup(out + b, hi);
+                else
+                    env->lifelse(out + b, hi, lo + b, hi + b);
+            });
+            std::swap(cur, nxt);
+        }
+        // all zeros (only reachable without padding) counts n, otherwise
+        // it's the tree's count
+        EruBits<_T> total = ctx->allocate(width);
+        auto t = total.ptr();
+        for (size_t i = 0; i < width; i++)
+            env->lval(t + i, (n >> i) & 1);
+        for (size_t i = 0; i < width; i++) {
+            if (i < levels)
+                env->lifelse(r + i, cur, t + i, cur + 1 + i);
+            else
+                env->land(r + i, cur, t + i);
+        }
+        ctx->free(total);
+        ctx->free(nxt_buf);
+        ctx->free(cur_buf);
+    }
+}
+
+#endif  // _LIBERU_CIRCUIT_H
@@ -25,10 +25,21 @@
 #include "context.h"
 
 template <>
-EruContext<EruGate>::EruContext(int min_lambda) {
-    __session = std::unique_ptr<EruSession>(new EruSession(min_lambda));
+EruContext<EruGate>::EruContext(const EruParams &preset) {
+    __session = std::unique_ptr<EruSession>(new EruSession(preset));
     __allocator = std::unique_ptr<EruAllocator<EruGate>>(
         new EruAllocator<EruGate>(__session.get()->params())
     );
     __env = nullptr;
 }
+
+template <>
+EruContext<EruGate>::EruContext(int min_lambda) :
+    EruContext(EruParams::preset(min_lambda)) {}
+
+template <>
+EruContext<EruGate>::EruContext(EruKey key) :
+        EruContext(key.params_raw() != nullptr ?
+            EruParams::from_tfhe(key.params_raw()) : EruParams::preset(128)) {
+    __session.get()->set_key(key);
+}
@@ -25,6 +25,9 @@
 #ifndef _LIBERU_CONTEXT_H
 #define _LIBERU_CONTEXT_H
 
+#include <algorithm>
+#include <vector>
+
 #include "crypto.h"
 #include "alloc.h"
 
@@ -35,8 +38,25 @@ private:
     std::unique_ptr<EruSession> __session;
     std::unique_ptr<EruAllocator<_T>> __allocator;
     std::unique_ptr<EruEnv<_T>> __env;  // when __session is unavailable
+    EruEnv<_T> *__redirect = nullptr;  // takes all gates, see EruRecorder
+    /// Plaintext bits converted per encrypt_many / decrypt_many step.
+    static constexpr size_t _batch_bits = 1 << 20;
 public:
     EruContext(int min_lambda) {
+        _init_plain();
+    }
+    /// Context under a parameter preset, see EruParams.
+    EruContext(const EruParams &preset) {
+        _init_plain();
+    }
+    EruContext(const std::string &preset) :
+        EruContext(EruParams::preset(preset)) {}
+    EruContext(const char *preset) : EruContext(std::string(preset)) {}
+    /// Context under the parameters of key, with key set.
+    EruContext(EruKey key) {
+        _init_plain();
+    }
+    void _init_plain() {
         __session = nullptr;
         __allocator = std::unique_ptr<EruAllocator<_T>>(new EruAllocator<_T>(
             nullptr));
@@ -50,24 +70,78 @@ public:
     EruAllocator<_T>* _allocator() {
         return __allocator.get();
     }
+    /// Send all gates to env instead, nullptr to stop. Not thread-safe.
+    /// @return: the previous redirection.
+    EruEnv<_T>* _redirect(EruEnv<_T> *env) {
+        std::swap(env, __redirect);
+        return env;
+    }
     EruEnv<_T>* _env() {
+        if (__redirect != nullptr)
+            return __redirect;
         if (__session != nullptr)
             return (EruEnv<_T>*)__session.get()->env();
         return __env.get();
     }
+    /// Encrypt count integers of `bits` bits each, two's complement, into
+    /// ptr, value i at bits [i * bits, (i + 1) * bits).
+    void _encrypt_many(_T *ptr, const int64_t *values, size_t count,
+            size_t bits) {
+        auto env = _env();
+        // convert in blocks to bound the plaintext buffer on large batches
+        size_t block = std::max<size_t>(1, _batch_bits / std::max<size_t>(
+            1, bits));
+        std::unique_ptr<bool[]> buf(new bool[std::min(block, count) * bits]);
+        for (size_t lo = 0; lo < count; lo += block) {
+            size_t n = std::min(block, count - lo);
+            for (size_t v = 0; v < n; v++) {
+                uint64_t x = (uint64_t)values[lo + v];
+                for (size_t i = 0; i < bits; i++)
+                    buf[v * bits + i] = i < 64 ? (x >> i) & 1 : x >> 63;
+            }
+            env->encrypt_many(ptr + lo * bits, buf.get(), n * bits);
+        }
+    }
+    /// Decrypt count integers laid out as above, sign-extended if
+    /// is_signed. Bits beyond 64 are ignored.
+    void _decrypt_many(int64_t *values, const _T *ptr, size_t count,
+            size_t bits, bool is_signed) {
+        auto env = _env();
+        size_t block = std::max<size_t>(1, _batch_bits / std::max<size_t>(
+            1, bits));
+        std::unique_ptr<bool[]> buf(new bool[std::min(block, count) * bits]);
+        for (size_t lo = 0; lo < count; lo += block) {
+            size_t n = std::min(block, count - lo);
+            env->decrypt_many(ptr + lo * bits, buf.get(), n * bits);
+            for (size_t v = 0; v < n; v++) {
+                uint64_t x = 0;
+                for (size_t i = 0; i < bits && i < 64; i++)
+                    if (buf[v * bits + i])
+                        x |= (uint64_t)1 << i;
+                if (is_signed && bits > 0 && bits < 64 &&
+                        buf[v * bits + bits - 1])
+                    x |= ~(uint64_t)0 << bits;
+                values[lo + v] = (int64_t)x;
+            }
+        }
+    }
     // Key management
     void gen_secret_key() {
         if (__session != nullptr)
             __session.get()->generate_key();
     }
-    void set_secret_key(EruData key) {
+    void set_secret_key(EruDataView key) {
         if (__session != nullptr)
             __session.get()->set_key(EruKey::from_secret(key));
     }
-    void set_cloud_key(EruData key) {
+    void set_cloud_key(EruDataView key) {
         if (__session != nullptr)
             __session.get()->set_key(EruKey::from_cloud(key));
     }
+    void set_cloud_key_fd(int fd) {
+        if (__session != nullptr)
+            __session.get()->set_key(EruKey::from_cloud_fd(fd));
+    }
     EruData get_secret_key() {
         if (__session != nullptr)
             return __session.get()->get_key().secret();
@@ -78,6 +152,12 @@ public:
             return __session.get()->get_key().cloud();
         return "";
     }
+    /// Cloud key in the image format, which servers import on all cores.
+    EruData get_cloud_key_image() {
+        if (__session != nullptr)
+            return __session.get()->get_key().cloud_image();
+        return "";
+    }
     // Memory management
     EruBits<_T> allocate(size_t size) {
         return __allocator.get()->allocate(size);
@@ -85,9 +165,51 @@ public:
     void free(EruBits<_T> ptr) {
         __allocator.get()->free(ptr);
     }
+    /// Keep at most budget bytes of ciphertexts in memory, see
+    /// EruAllocator::set_spill.
+    void set_memory_budget(size_t budget, const std::string &dir = "") {
+        __allocator.get()->set_spill(budget, dir);
+    }
+    /// Paging hints for spilled bits, no-ops otherwise.
+    void prefetch(EruBits<_T> ptr) {
+        __allocator.get()->prefetch(ptr);
+    }
+    void evict(EruBits<_T> ptr) {
+        __allocator.get()->evict(ptr);
+    }
+    /// Batch encryption of count integers of `bits` bits each, spread
+    /// across cores. Value i occupies bits [i * bits, (i + 1) * bits) of
+    /// the result, which the caller frees.
+    EruBits<_T> encrypt_many(const int64_t *values, size_t count,
+            size_t bits) {
+        EruBits<_T> res = allocate(count * bits);
+        _encrypt_many(res.ptr(), values, count, bits);
+        return res;
+    }
+    EruBits<_T> encrypt_many(const std::vector<int64_t> &values,
+            size_t bits) {
+        return encrypt_many(values.data(), values.size(), bits);
+    }
+    /// Batch decryption of integers laid out as by encrypt_many.
+    void decrypt_many(EruBits<_T> data, int64_t *values, size_t count,
+            size_t bits, bool is_signed = true) {
+        if (count * bits > data._size())
+            throw std::runtime_error("batch exceeds ciphertext");
+        _decrypt_many(values, data.ptr(), count, bits, is_signed);
+    }
+    std::vector<int64_t> decrypt_many(EruBits<_T> data, size_t bits,
+            bool is_signed = true) {
+        std::vector<int64_t> res(bits == 0 ? 0 : data._size() / bits);
+        _decrypt_many(res.data(), data.ptr(), res.size(), bits, is_signed);
+        return res;
+    }
 };
 
 template <>
 EruContext<EruGate>::EruContext(int min_lambda);
+template <>
+EruContext<EruGate>::EruContext(const EruParams &preset);
+template <>
+EruContext<EruGate>::EruContext(EruKey key);
 
 #endif  // _LIBERU_CONTEXT_H
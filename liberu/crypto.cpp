@@ -22,16 +22,173 @@
 // FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
 // IN THE SOFTWARE.
 
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <initializer_list>
+#include <map>
+#include <new>
+#include <openssl/evp.h>
 #include <openssl/rand.h>
+#include <openssl/sha.h>
 #include <sstream>
 #include <tfhe/tfhe_io.h>
+#include <vector>
 
 #include "crypto.h"
+#include "pool.h"
 #include "utils.h"
 
 using namespace _EruHazmat;
 
 
+/// Compact ciphertexts are the binobjlist
+///     [marker, seed, bodies, variance, parameter tag]
+/// where the masks of all bits are expanded from the seed, so only the LWE
+/// body of each bit (4 bytes, little-endian) goes over the wire instead of
+/// n + 1 coefficients. The plain env stores one byte per bit as bodies, and
+/// no tag.
+static const char seeded_marker[] = "eru/seeded/1";
+static const size_t seeded_seed_size = 16;
+
+static EruData seeded_encode(const EruData &seed, const EruData &bodies,
+        double variance, const EruData &tag) {
+    std::vector<EruData> objs = {seeded_marker, seed, bodies,
+        EruData((const char*)&variance, sizeof(double))};
+    if (!tag.empty())
+        objs.push_back(tag);
+    return binobjlist_encode(objs);
+}
+
+/// Split a compact ciphertext of n bodies of the given size.
+/// @return false if a is not one.
+static bool seeded_decode(EruDataView a, size_t n, size_t body_size,
+        const EruData &tag, EruDataView &seed, EruDataView &bodies,
+        double &variance) {
+    auto split = binobjlist_view(a);
+    if (split.size() < 4 || split.size() > 5 ||
+            split[0].str() != seeded_marker)
+        return false;
+    if (split[2].length != n * body_size ||
+            split[3].length != sizeof(double))
+        throw std::runtime_error("truncated ciphertext");
+    check_params_tag(split, 4, tag);
+    seed = split[1];
+    bodies = split[2];
+    memcpy(&variance, split[3].data, sizeof(double));
+    return true;
+}
+
+/// Mask of bit i: n uniform coefficients from AES-128-CTR keyed with seed,
+/// counter starting at i << 64.
+static void seeded_mask(EruDataView seed, uint64_t i, Torus32 *a, size_t n) {
+    if (seed.length != seeded_seed_size)
+        throw std::runtime_error("bad ciphertext seed");
+    unsigned char iv[16] = {0};
+    for (int k = 0; k < 8; k++)
+        iv[k] = (unsigned char)(i >> (8 * (7 - k)));
+    std::vector<unsigned char> stream(n * 4, 0);
+    int length = 0;
+    EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+    bool ok = ctx != nullptr && EVP_EncryptInit_ex(ctx, EVP_aes_128_ctr(),
+        nullptr, (const unsigned char*)seed.data, iv) == 1 &&
+        EVP_EncryptUpdate(ctx, stream.data(), &length, stream.data(),
+        stream.size()) == 1;
+    EVP_CIPHER_CTX_free(ctx);
+    if (!ok)
+        throw std::runtime_error("cannot expand ciphertext seed");
+    for (size_t j = 0; j < n; j++)
+        a[j] = (Torus32)((uint32_t)stream[4 * j] |
+            (uint32_t)stream[4 * j + 1] << 8 |
+            (uint32_t)stream[4 * j + 2] << 16 |
+            (uint32_t)stream[4 * j + 3] << 24);
+}
+
+/// Samples encrypted by one batch task. Each task draws its own stream, so
+/// threads never share generator state.
+static const size_t batch_chunk = 1024;
+
+/// AES-256-CTR keystream under a fresh random key, a private generator for
+/// the masks and noise of one batch task. TFHE's own generator is a single
+/// global Mersenne twister, neither secure nor safe to share across threads.
+class lwe_stream {
+private:
+    EVP_CIPHER_CTX *_ctx;
+    unsigned char _buf[4096];
+    size_t _pos;
+    void _refill() {
+        static const unsigned char zero[sizeof(_buf)] = {0};
+        int length = 0;
+        if (EVP_EncryptUpdate(_ctx, _buf, &length, zero, sizeof(_buf)) != 1)
+            throw std::runtime_error("cannot draw random stream");
+        _pos = 0;
+    }
+public:
+    lwe_stream() : _ctx(EVP_CIPHER_CTX_new()), _pos(sizeof(_buf)) {
+        unsigned char key[32], iv[16] = {0};
+        if (_ctx == nullptr || RAND_bytes(key, sizeof(key)) != 1 ||
+                EVP_EncryptInit_ex(_ctx, EVP_aes_256_ctr(), nullptr, key,
+                iv) != 1) {
+            EVP_CIPHER_CTX_free(_ctx);
+            throw std::runtime_error("cannot generate secure seed");
+        }
+    }
+    lwe_stream(const lwe_stream &other) = delete;
+    ~lwe_stream() {
+        EVP_CIPHER_CTX_free(_ctx);
+    }
+    uint32_t next32() {
+        if (_pos + 4 > sizeof(_buf))
+            _refill();
+        uint32_t x;
+        memcpy(&x, _buf + _pos, 4);
+        _pos += 4;
+        return x;
+    }
+    /// Uniform in (0, 1].
+    double uniform() {
+        uint64_t x = (uint64_t)next32() << 21 ^ next32() >> 11;
+        return (double)(x + 1) / 9007199254740992.0;
+    }
+    /// Standard normal, Box-Muller.
+    double normal() {
+        return std::sqrt(-2.0 * std::log(uniform())) *
+            std::cos(6.283185307179586 * uniform());
+    }
+};
+
+/// Noise e as a torus element, i.e. e mod 1 scaled by 2^32.
+static Torus32 torus_from_double(double e) {
+    e -= std::floor(e);
+    return (Torus32)(uint32_t)(uint64_t)(e * 4294967296.0);
+}
+
+/// r = (a, <a, s> + mu + e) with a uniform mask drawn from stream and the
+/// given noise e.
+static void lwe_encrypt_noise(EruGate *r, Torus32 mu, double e, double alpha,
+        const LweKey *key, lwe_stream &stream) {
+    uint32_t b = (uint32_t)mu + (uint32_t)torus_from_double(e);
+    for (int j = 0; j < key->params->n; j++) {
+        r->a[j] = (Torus32)stream.next32();
+        b += (uint32_t)r->a[j] * (uint32_t)key->key[j];
+    }
+    r->b = (Torus32)b;
+    r->current_variance = alpha * alpha;
+}
+
+/// r = (a, <a, s> + mu + e), e ~ N(0, alpha^2) on the torus, as
+/// bootsSymEncrypt does but drawing from stream.
+static void lwe_encrypt(EruGate *r, bool m, const LweKey *key,
+        lwe_stream &stream) {
+    double alpha = key->params->alpha_min;
+    lwe_encrypt_noise(r, modSwitchToTorus32(m ? 1 : -1, 8),
+        stream.normal() * alpha, alpha, key, stream);
+}
+
 class _TFheGateBootstrappingParameterSetDeleter {
 public:
     void operator() (TFheGateBootstrappingParameterSet *ptr) {
@@ -53,6 +210,173 @@ public:
     }
 };
 
+// Parameter presets
+
+static const char params_tag_prefix[] = "eru/params/";
+
+/// Presets by name and the TFHE parameter sets built so far by tag. Sets
+/// live as long as the process, sessions and keys merely share them.
+static std::mutex params_lock;
+static std::map<std::string, EruParams> params_registry;
+static std::map<EruData, std::shared_ptr<TFheGateBootstrappingParameterSet>>
+    params_sets;
+
+static EruParams params_values(const TFheGateBootstrappingParameterSet *p) {
+    auto tlwe = p->tgsw_params->tlwe_params;
+    EruParams res;
+    res.name = "custom";
+    res.lwe_n = p->in_out_params->n;
+    res.lwe_stdev = p->in_out_params->alpha_min;
+    res.tlwe_N = tlwe->N;
+    res.tlwe_k = tlwe->k;
+    res.tlwe_stdev = tlwe->alpha_min;
+    res.max_stdev = p->in_out_params->alpha_max;
+    res.bk_l = p->tgsw_params->l;
+    res.bk_Bgbit = p->tgsw_params->Bgbit;
+    res.ks_t = p->ks_t;
+    res.ks_basebit = p->ks_basebit;
+    return res;
+}
+
+/// Decompositions must fit the 32-bit torus, TFHE doesn't check.
+static void params_check(const EruParams &p) {
+    if (p.lwe_n <= 0 || p.tlwe_N <= 0 || p.tlwe_k <= 0 || p.bk_l <= 0 ||
+            p.bk_Bgbit <= 0 || p.ks_t <= 0 || p.ks_basebit <= 0 ||
+            p.bk_l * p.bk_Bgbit > 32 || p.ks_t * p.ks_basebit > 32)
+        throw std::runtime_error("invalid parameters");
+}
+
+/// Fill the registry with the built-in presets. Holds params_lock.
+static void params_init() {
+    if (!params_registry.empty())
+        return;
+    // TFHE's own defaults, taken as they are so that keys made before
+    // presets existed keep matching them
+    auto tfhe = std::shared_ptr<TFheGateBootstrappingParameterSet>(
+        new_default_gate_bootstrapping_parameters(128),
+        _TFheGateBootstrappingParameterSetDeleter());
+    EruParams d128 = params_values(tfhe.get());
+    d128.name = "default_128";
+    params_sets[d128.tag()] = tfhe;
+    // the default of TFHE 1.0, estimated at about 80 bits
+    EruParams d80 = d128;
+    d80.name = "default_80";
+    d80.lwe_n = 500;
+    d80.lwe_stdev = 2.44e-5;
+    d80.tlwe_stdev = 7.18e-9;
+    d80.bk_l = 2;
+    d80.bk_Bgbit = 10;
+    EruParams f128 = d128;
+    f128.name = "fast_128";
+    f128.ks_t = 5;
+    f128.ks_basebit = 3;
+    for (auto &p : {d128, d80, f128})
+        params_registry[p.name] = p;
+}
+
+EruParams EruParams::preset(const std::string &name) {
+    std::lock_guard<std::mutex> guard(params_lock);
+    params_init();
+    auto it = params_registry.find(name);
+    if (it == params_registry.end())
+        throw std::runtime_error("unknown parameter preset: " + name);
+    return it->second;
+}
+
+EruParams EruParams::preset(int min_lambda) {
+    // like TFHE, whose only default parameters are those for 128 bits
+    if (min_lambda > 128)
+        throw std::runtime_error("no parameters for more than 128 bits");
+    return preset("default_128");
+}
+
+void EruParams::register_preset(const EruParams &params) {
+    if (params.name.empty() || params.name == "custom")
+        throw std::runtime_error("invalid preset name");
+    params_check(params);
+    std::lock_guard<std::mutex> guard(params_lock);
+    params_init();
+    params_registry[params.name] = params;
+}
+
+std::vector<std::string> EruParams::presets() {
+    std::lock_guard<std::mutex> guard(params_lock);
+    params_init();
+    std::vector<std::string> res;
+    for (auto &it : params_registry)
+        res.push_back(it.first);
+    return res;
+}
+
+EruParams EruParams::from_tfhe(const TFheGateBootstrappingParameterSet *p) {
+    EruParams res = params_values(p);
+    std::lock_guard<std::mutex> guard(params_lock);
+    params_init();
+    for (auto &it : params_registry)
+        if (res.name == "custom" && it.second == res)
+            res.name = it.first;
+    return res;
+}
+
+std::shared_ptr<TFheGateBootstrappingParameterSet> EruParams::tfhe() const {
+    params_check(*this);
+    EruData key = tag();
+    std::lock_guard<std::mutex> guard(params_lock);
+    params_init();
+    auto &set = params_sets[key];
+    if (set == nullptr) {
+        // released by the deleter together with the set
+        auto in_out = new_LweParams(lwe_n, lwe_stdev, max_stdev);
+        auto accum = new_TLweParams(tlwe_N, tlwe_k, tlwe_stdev, max_stdev);
+        auto bk = new_TGswParams(bk_l, bk_Bgbit, accum);
+        set = std::shared_ptr<TFheGateBootstrappingParameterSet>(
+            new_TFheGateBootstrappingParameterSet(ks_t, ks_basebit, in_out,
+                bk),
+            _TFheGateBootstrappingParameterSetDeleter());
+    }
+    return set;
+}
+
+EruData EruParams::tag() const {
+    char desc[256];
+    int len = snprintf(desc, sizeof(desc), "%d %a %d %d %a %a %d %d %d %d",
+        lwe_n, lwe_stdev, tlwe_N, tlwe_k, tlwe_stdev, max_stdev, bk_l,
+        bk_Bgbit, ks_t, ks_basebit);
+    unsigned char md[SHA256_DIGEST_LENGTH];
+    SHA256((const unsigned char*)desc, len, md);
+    static const char hex[] = "0123456789abcdef";
+    EruData res = params_tag_prefix;
+    for (int i = 0; i < 8; i++) {
+        res += hex[md[i] >> 4];
+        res += hex[md[i] & 15];
+    }
+    return res;
+}
+
+bool EruParams::operator == (const EruParams &other) const {
+    return lwe_n == other.lwe_n && lwe_stdev == other.lwe_stdev &&
+        tlwe_N == other.tlwe_N && tlwe_k == other.tlwe_k &&
+        tlwe_stdev == other.tlwe_stdev && max_stdev == other.max_stdev &&
+        bk_l == other.bk_l && bk_Bgbit == other.bk_Bgbit &&
+        ks_t == other.ks_t && ks_basebit == other.ks_basebit;
+}
+
+bool EruParams::operator != (const EruParams &other) const {
+    return !(*this == other);
+}
+
+void _EruHazmat::check_params_tag(const std::vector<EruDataView> &split,
+        size_t n, const EruData &tag) {
+    if (tag.empty() || split.size() <= n)
+        return;
+    size_t prefix = sizeof(params_tag_prefix) - 1;
+    auto &got = split[n];
+    if (got.length < prefix || memcmp(got.data, params_tag_prefix, prefix))
+        return;
+    if (got.str() != tag)
+        throw std::runtime_error("ciphertext under other parameters");
+}
+
 // Key manager
 
 EruKey::EruKey() : _secret(nullptr), _cloud(nullptr) {}
@@ -74,9 +398,9 @@ EruKey EruKey::from_cloud_raw(
     return EruKey(nullptr, key);
 }
 
-EruKey EruKey::from_secret(EruData key) {
-    std::stringstream stream;
-    stream.write(key.c_str(), key.length());
+EruKey EruKey::from_secret(EruDataView key) {
+    membuf buffer(key);
+    std::istream stream(&buffer);
     return EruKey::from_secret_raw(
         std::shared_ptr<TFheGateBootstrappingSecretKeySet>(
             new_tfheGateBootstrappingSecretKeySet_fromStream(stream),
@@ -85,17 +409,339 @@ EruKey EruKey::from_secret(EruData key) {
     );
 }
 
-EruKey EruKey::from_cloud(EruData key) {
-    std::stringstream stream;
-    stream.write(key.c_str(), key.length());
+/// A cloud key image is the binobjlist
+///     [marker, parameters, bootstrapping key rows, key switching rows]
+/// of raw TGSW and LWE samples in host byte order. Unlike TFHE's stream
+/// format, every row sits at a known offset, so rows are decoded and
+/// FFT-converted on all cores at once.
+static const char key_image_marker[] = "eru/cloud-image/1";
+/// Key switching samples decoded or copied by one task.
+static const size_t key_image_chunk = 1024;
+
+static thread_local EruKeyImportStats key_import_stats;
+
+static double elapsed_ms(std::chrono::steady_clock::time_point since) {
+    return std::chrono::duration<double, std::milli>(
+        std::chrono::steady_clock::now() - since).count();
+}
+
+/// Bytes of one bootstrapping key row, a TGSW sample, and of one key
+/// switching sample.
+static size_t key_image_bk_row(const TFheGateBootstrappingParameterSet *p) {
+    auto tlwe = p->tgsw_params->tlwe_params;
+    return p->tgsw_params->kpl * ((tlwe->k + 1) * tlwe->N * sizeof(Torus32) +
+        sizeof(double));
+}
+
+static size_t key_image_ks_row(const TFheGateBootstrappingParameterSet *p) {
+    return (p->in_out_params->n + 1) * sizeof(Torus32) + sizeof(double);
+}
+
+/// Copy bootstrapping key row i to or from the image.
+static void key_image_bk(TGswSample *row, const TGswParams *params,
+        char *image, bool store) {
+    int32_t k = params->tlwe_params->k, N = params->tlwe_params->N;
+    for (int32_t j = 0; j < params->kpl; j++) {
+        TLweSample &sample = row->all_sample[j];
+        for (int32_t q = 0; q <= k; q++) {
+            char *coefs = (char*)sample.a[q].coefsT;
+            if (store)
+                memcpy(image, coefs, N * sizeof(Torus32));
+            else
+                memcpy(coefs, image, N * sizeof(Torus32));
+            image += N * sizeof(Torus32);
+        }
+        if (store)
+            memcpy(image, &sample.current_variance, sizeof(double));
+        else
+            memcpy(&sample.current_variance, image, sizeof(double));
+        image += sizeof(double);
+    }
+}
+
+/// Copy key switching samples [first, last) to or from the image.
+static void key_image_ks(LweKeySwitchKey *ks, size_t first, size_t last,
+        char *image, bool store) {
+    size_t n = ks->out_params->n;
+    for (size_t i = first; i < last; i++) {
+        LweSample &sample = ks->ks0_raw[i];
+        if (store) {
+            memcpy(image, sample.a, n * sizeof(Torus32));
+            memcpy(image + n * sizeof(Torus32), &sample.b, sizeof(Torus32));
+            memcpy(image + (n + 1) * sizeof(Torus32),
+                &sample.current_variance, sizeof(double));
+        } else {
+            memcpy(sample.a, image, n * sizeof(Torus32));
+            memcpy(&sample.b, image + n * sizeof(Torus32), sizeof(Torus32));
+            memcpy(&sample.current_variance,
+                image + (n + 1) * sizeof(Torus32), sizeof(double));
+        }
+        image += (n + 1) * sizeof(Torus32) + sizeof(double);
+    }
+}
+
+static size_t key_image_ks_count(const LweKeySwitchKey *ks) {
+    return (size_t)ks->n * ks->t * ks->base;
+}
+
+/// FFT form of a bootstrapping key, one TGSW row per task, along with the
+/// copy of the key switching key it owns. Parallel counterpart of
+/// new_LweBootstrappingKeyFFT.
+static LweBootstrappingKeyFFT* key_to_fft(const LweBootstrappingKey *bk) {
+    size_t n = bk->in_out_params->n;
+    size_t ks_count = key_image_ks_count(bk->ks);
+    size_t ks_chunks = (ks_count + key_image_chunk - 1) / key_image_chunk;
+    auto bk_fft = new_TGswSampleFFT_array(n, bk->bk_params);
+    auto ks = new_LweKeySwitchKey(bk->ks->n, bk->ks->t, bk->ks->basebit,
+        bk->ks->out_params);
+    parallel_for(n + ks_chunks, [&](size_t i) {
+        if (i < n) {
+            tGswToFFTConvert(&bk_fft[i], &bk->bk[i], bk->bk_params);
+            return;
+        }
+        size_t first = (i - n) * key_image_chunk;
+        size_t last = std::min(ks_count, first + key_image_chunk);
+        for (size_t j = first; j < last; j++)
+            lweCopy(&ks->ks0_raw[j], &bk->ks->ks0_raw[j], ks->out_params);
+    });
+    // malloc'd like TFHE's own, delete_LweBootstrappingKeyFFT free()s it
+    void *mem = malloc(sizeof(LweBootstrappingKeyFFT));
+    if (mem == nullptr)
+        throw std::bad_alloc();
+    return new (mem) LweBootstrappingKeyFFT(bk->in_out_params, bk->bk_params,
+        bk->accum_params, bk->extract_params, bk_fft, ks);
+}
+
+/// Product of the factors, or SIZE_MAX once it passes limit. Images come
+/// from clients, so their dimensions may be anything.
+static size_t key_image_product(std::initializer_list<size_t> factors,
+        size_t limit) {
+    size_t res = 1;
+    for (size_t f : factors) {
+        if (f != 0 && res > limit / f)
+            return SIZE_MAX;
+        res *= f;
+    }
+    return res;
+}
+
+/// Whether the parts of an image have the sizes its parameters call for.
+/// Checked before anything is allocated for the key.
+static bool key_image_sizes_match(const TFheGateBootstrappingParameterSet *p,
+        const std::vector<EruDataView> &split) {
+    auto tlwe = p->tgsw_params->tlwe_params;
+    size_t limit = std::max(split[2].length, split[3].length);
+    size_t poly = key_image_product({(size_t)tlwe->k + 1, (size_t)tlwe->N,
+        sizeof(Torus32)}, limit);
+    if (poly > limit)
+        return false;
+    size_t bk = key_image_product({(size_t)p->in_out_params->n,
+        (size_t)p->tgsw_params->kpl, poly + sizeof(double)}, limit);
+    // one key switching sample per extracted coefficient, level and digit
+    size_t ks = key_image_product({(size_t)tlwe->N, (size_t)tlwe->k,
+        (size_t)p->ks_t, (size_t)1 << p->ks_basebit, key_image_ks_row(p)},
+        limit);
+    return split[2].length == bk && split[3].length == ks;
+}
+
+/// Decode a cloud key image. The bootstrapping key rows and the key
+/// switching chunks are copied in parallel, then converted to the FFT
+/// domain in parallel.
+static TFheGateBootstrappingCloudKeySet* key_image_decode(EruDataView key,
+        EruKeyImportStats &stats) {
+    auto start = std::chrono::steady_clock::now();
+    auto split = binobjlist_view(key);
+    if (split.size() != 4)
+        throw std::runtime_error("truncated cloud key");
+    membuf buffer(split[1]);
+    std::istream stream(&buffer);
+    auto params = new_tfheGateBootstrappingParameterSet_fromStream(stream);
+    try {
+        params_check(params_values(params));
+        if (!key_image_sizes_match(params, split))
+            throw std::runtime_error("truncated cloud key");
+    } catch (...) {
+        delete_gate_bootstrapping_parameters(params);
+        throw;
+    }
+    size_t n = params->in_out_params->n;
+    size_t bk_row = key_image_bk_row(params);
+    size_t ks_row = key_image_ks_row(params);
+    auto bk = new_LweBootstrappingKey(params->ks_t, params->ks_basebit,
+        params->in_out_params, params->tgsw_params);
+    size_t ks_count = key_image_ks_count(bk->ks);
+    size_t ks_chunks = (ks_count + key_image_chunk - 1) / key_image_chunk;
+    // decode: task i < n is bootstrapping key row i, the rest are chunks
+    // of key switching samples
+    parallel_for(n + ks_chunks, [&](size_t i) {
+        if (i < n) {
+            key_image_bk(&bk->bk[i], bk->bk_params,
+                const_cast<char*>(split[2].data) + i * bk_row, false);
+            return;
+        }
+        size_t first = (i - n) * key_image_chunk;
+        size_t last = std::min(ks_count, first + key_image_chunk);
+        key_image_ks(bk->ks, first, last,
+            const_cast<char*>(split[3].data) + first * ks_row, false);
+    });
+    stats.decode_ms = elapsed_ms(start);
+    auto fft_start = std::chrono::steady_clock::now();
+    auto fft = key_to_fft(bk);
+    stats.fft_ms = elapsed_ms(fft_start);
+    stats.threads = std::min<size_t>(n + ks_chunks,
+        std::max(1u, std::thread::hardware_concurrency()));
+    return new TFheGateBootstrappingCloudKeySet(params, bk, fft);
+}
+
+/// Encrypt the integer mu under the TGSW key, as tGswSymEncryptInt does:
+/// every row is a fresh TLWE encryption of zero, then block q, level j
+/// gets mu / Bg^(j + 1) added to its q-th polynomial.
+static void tgsw_encrypt(TGswSample *r, int32_t mu, double alpha,
+        const TGswKey *key, lwe_stream &stream) {
+    auto params = key->params;
+    int32_t k = params->tlwe_params->k, N = params->tlwe_params->N;
+    int32_t l = params->l;
+    for (int32_t j = 0; j < params->kpl; j++) {
+        TLweSample &row = r->all_sample[j];
+        for (int32_t c = 0; c < N; c++)
+            row.b->coefsT[c] = torus_from_double(stream.normal() * alpha);
+        for (int32_t q = 0; q < k; q++) {
+            for (int32_t c = 0; c < N; c++)
+                row.a[q].coefsT[c] = (Torus32)stream.next32();
+            torusPolynomialAddMulR(row.b, &key->tlwe_key.key[q], &row.a[q]);
+        }
+        row.current_variance = alpha * alpha;
+    }
+    for (int32_t q = 0; q <= k; q++)
+        for (int32_t j = 0; j < l; j++) {
+            uint32_t h = (uint32_t)1 << (32 - (j + 1) * params->Bgbit);
+            Torus32 &coef = r->all_sample[q * l + j].a[q].coefsT[0];
+            coef = (Torus32)((uint32_t)coef + (uint32_t)mu * h);
+        }
+}
+
+/// Generate a keyset like new_random_gate_bootstrapping_secret_keyset,
+/// but with every TGSW row of the bootstrapping key and every chunk of
+/// the key switching key encrypted by its own task, each drawing from an
+/// independent stream.
+static TFheGateBootstrappingSecretKeySet* keyset_generate(
+        const TFheGateBootstrappingParameterSet *params) {
+    auto tlwe = params->tgsw_params->tlwe_params;
+    auto lwe_key = new_LweKey(params->in_out_params);
+    auto tgsw_key = new_TGswKey(params->tgsw_params);
+    {
+        lwe_stream stream;
+        for (int32_t i = 0; i < params->in_out_params->n; i++)
+            lwe_key->key[i] = stream.next32() & 1;
+        for (int32_t q = 0; q < tlwe->k; q++)
+            for (int32_t c = 0; c < tlwe->N; c++)
+                tgsw_key->tlwe_key.key[q].coefs[c] = stream.next32() & 1;
+    }
+    auto bk = new_LweBootstrappingKey(params->ks_t, params->ks_basebit,
+        params->in_out_params, params->tgsw_params);
+    auto extracted = new_LweKey(bk->extract_params);
+    tLweExtractKey(extracted, &tgsw_key->tlwe_key);
+    size_t n = params->in_out_params->n;
+    auto ks = bk->ks;
+    size_t ks_count = key_image_ks_count(ks);
+    size_t ks_chunks = (ks_count + key_image_chunk - 1) / key_image_chunk;
+    double bk_alpha = tlwe->alpha_min;
+    double ks_alpha = params->in_out_params->alpha_min;
+    // key switching noise is recentred to zero mean over the whole key;
+    // sample h = 0 of every digit is a noiseless zero that is never used
+    std::vector<double> noise(ks_count, 0.0);
+    parallel_for(ks_chunks, [&](size_t c) {
+        lwe_stream stream;
+        size_t last = std::min(ks_count, (c + 1) * key_image_chunk);
+        for (size_t i = c * key_image_chunk; i < last; i++)
+            if (i % ks->base != 0)
+                noise[i] = stream.normal() * ks_alpha;
+    });
+    double mean = 0.0;
+    for (double e : noise)
+        mean += e;
+    mean /= (double)(ks_count - ks_count / ks->base);
+    parallel_for(n + ks_chunks, [&](size_t i) {
+        lwe_stream stream;
+        if (i < n) {
+            tgsw_encrypt(&bk->bk[i], lwe_key->key[i], bk_alpha, tgsw_key,
+                stream);
+            return;
+        }
+        size_t first = (i - n) * key_image_chunk;
+        size_t last = std::min(ks_count, first + key_image_chunk);
+        for (size_t idx = first; idx < last; idx++) {
+            EruGate &sample = ks->ks0_raw[idx];
+            size_t h = idx % ks->base, digit = idx / ks->base;
+            size_t j = digit % ks->t, bit = digit / ks->t;
+            if (h == 0) {
+                std::fill(sample.a, sample.a + ks->out_params->n, 0);
+                sample.b = 0;
+                sample.current_variance = 0.0;
+                continue;
+            }
+            uint32_t mu = (uint32_t)extracted->key[bit] * (uint32_t)h *
+                ((uint32_t)1 << (32 - (j + 1) * ks->basebit));
+            lwe_encrypt_noise(&sample, (Torus32)mu, noise[idx] - mean,
+                ks_alpha, lwe_key, stream);
+        }
+    });
+    delete_LweKey(extracted);
+    return new TFheGateBootstrappingSecretKeySet(params, bk, key_to_fft(bk),
+        lwe_key, tgsw_key);
+}
+
+EruKey EruKey::generate(
+        std::shared_ptr<TFheGateBootstrappingParameterSet> params) {
+    auto key = keyset_generate(params.get());
+    return EruKey::from_secret_raw(
+        std::shared_ptr<TFheGateBootstrappingSecretKeySet>(key,
+            [params](TFheGateBootstrappingSecretKeySet *ptr) {
+                delete_gate_bootstrapping_secret_keyset(ptr);
+            })
+    );
+}
+
+EruKey EruKey::from_cloud(EruDataView key) {
+    auto start = std::chrono::steady_clock::now();
+    EruKeyImportStats stats;
+    stats.bytes = key.length;
+    TFheGateBootstrappingCloudKeySet *cloud;
+    // images start with their encoded marker, TFHE's format never does
+    EruData prefix = binobjlist_encode({key_image_marker});
+    if (key.length >= prefix.length() &&
+            memcmp(key.data, prefix.data(), prefix.length()) == 0) {
+        cloud = key_image_decode(key, stats);
+    } else {
+        // TFHE's stream format decodes and converts on this thread
+        membuf buffer(key);
+        std::istream stream(&buffer);
+        cloud = new_tfheGateBootstrappingCloudKeySet_fromStream(stream);
+        stats.threads = 1;
+        stats.decode_ms = elapsed_ms(start);
+    }
+    stats.total_ms = elapsed_ms(start);
+    key_import_stats = stats;
     return EruKey::from_cloud_raw(
-        std::shared_ptr<TFheGateBootstrappingCloudKeySet>(
-            new_tfheGateBootstrappingCloudKeySet_fromStream(stream),
-            _TFheGateBootstrappingCloudKeySetDeleter()
-        )
+        std::shared_ptr<TFheGateBootstrappingCloudKeySet>(cloud,
+            _TFheGateBootstrappingCloudKeySetDeleter())
     );
 }
 
+EruKey EruKey::from_cloud_fd(int fd) {
+    FileView file(fd);
+    return from_cloud(file.view());
+}
+
+EruKeyImportStats EruKey::last_import() {
+    return key_import_stats;
+}
+
+const TFheGateBootstrappingParameterSet* EruKey::params_raw() {
+    auto cloud = cloud_raw();
+    return cloud == nullptr ? nullptr : cloud->params;
+}
+
 const TFheGateBootstrappingSecretKeySet* EruKey::secret_raw() {
     return _secret.get();
 }
@@ -118,6 +764,100 @@ EruData EruKey::cloud() {
     return dump_sstream(stream);
 }
 
+EruData EruKey::cloud_image() {
+    auto cloud = cloud_raw();
+    if (cloud == nullptr || cloud->bk == nullptr)
+        throw std::runtime_error("no cloud key to export");
+    auto bk = cloud->bk;
+    std::stringstream stream;
+    export_tfheGateBootstrappingParameterSet_toStream(stream, cloud->params);
+    size_t n = cloud->params->in_out_params->n;
+    size_t bk_row = key_image_bk_row(cloud->params);
+    size_t ks_row = key_image_ks_row(cloud->params);
+    size_t ks_count = key_image_ks_count(bk->ks);
+    EruData bk_rows(n * bk_row, '\0'), ks_rows(ks_count * ks_row, '\0');
+    for (size_t i = 0; i < n; i++)
+        key_image_bk(&bk->bk[i], bk->bk_params, &bk_rows[i * bk_row], true);
+    key_image_ks(bk->ks, 0, ks_count, &ks_rows[0], true);
+    return binobjlist_encode({key_image_marker, dump_sstream(stream),
+        bk_rows, ks_rows});
+}
+
+// Key pool
+
+static std::mutex key_pool_lock;
+static std::shared_ptr<EruKeyPool> key_pool_default;
+
+EruKeyPool::EruKeyPool(const EruParams &preset, size_t capacity) :
+        _preset(preset), _capacity(capacity), _stopping(false) {
+    _params = _preset.tfhe();
+    _worker = std::thread(&EruKeyPool::_refill, this);
+}
+
+EruKeyPool::EruKeyPool(int min_lambda, size_t capacity) :
+    EruKeyPool(EruParams::preset(min_lambda), capacity) {}
+
+EruKeyPool::~EruKeyPool() {
+    {
+        std::lock_guard<std::mutex> guard(_lock);
+        _stopping = true;
+    }
+    _cv_refill.notify_all();
+    _worker.join();
+}
+
+void EruKeyPool::_refill() {
+    std::unique_lock<std::mutex> guard(_lock);
+    while (true) {
+        _cv_refill.wait(guard, [this] {
+            return _stopping || _ready.size() < _capacity;
+        });
+        if (_stopping)
+            return;
+        guard.unlock();
+        EruKey key;
+        try {
+            key = EruKey::generate(_params);
+        } catch (...) {
+            return;  // take() generates, and reports, on the caller's side
+        }
+        guard.lock();
+        _ready.push_back(key);
+    }
+}
+
+EruKey EruKeyPool::take() {
+    {
+        std::lock_guard<std::mutex> guard(_lock);
+        if (!_ready.empty()) {
+            EruKey key = _ready.front();
+            _ready.pop_front();
+            _cv_refill.notify_all();
+            return key;
+        }
+    }
+    return EruKey::generate(_params);
+}
+
+size_t EruKeyPool::ready() {
+    std::lock_guard<std::mutex> guard(_lock);
+    return _ready.size();
+}
+
+const EruParams& EruKeyPool::preset() {
+    return _preset;
+}
+
+void EruKeyPool::set_default(std::shared_ptr<EruKeyPool> pool) {
+    std::lock_guard<std::mutex> guard(key_pool_lock);
+    key_pool_default = pool;
+}
+
+std::shared_ptr<EruKeyPool> EruKeyPool::get_default() {
+    std::lock_guard<std::mutex> guard(key_pool_lock);
+    return key_pool_default;
+}
+
 // Raw environment
 
 bool* EruEnvPlain::malloc(size_t size) {
@@ -193,20 +933,62 @@ bool EruEnvPlain::decrypt(const bool *a) {
     return *a;
 }
 
+void EruEnvPlain::encrypt_many(bool *r, const bool *a, size_t n) {
+    memcpy(r, a, n * sizeof(bool));
+}
+
+void EruEnvPlain::decrypt_many(const bool *a, bool *r, size_t n) {
+    memcpy(r, a, n * sizeof(bool));
+}
+
 EruData EruEnvPlain::bexport(bool *a) {
     EruData s;
     s += *a == true ? '1' : '0';
     return s;
 }
 
-void EruEnvPlain::bimport(bool *r, const EruData &a) {
-    if (a.length() > 0)
-        *r = a[0] == '1';
+void EruEnvPlain::bimport(bool *r, EruDataView a) {
+    if (a.length > 0)
+        *r = a.data[0] == '1';
+}
+
+size_t EruEnvPlain::bsize() {
+    return 1;
+}
+
+void EruEnvPlain::bstore(const bool *a, char *out) {
+    *out = *a ? 1 : 0;
+}
+
+void EruEnvPlain::bload(bool *r, const char *in) {
+    *r = *in != 0;
+}
+
+EruData EruEnvPlain::bparams() {
+    return "plain";
+}
+
+EruData EruEnvPlain::bexport_seeded(bool *r, size_t n) {
+    EruData bodies;
+    for (size_t i = 0; i < n; i++)
+        bodies += r[i] ? '1' : '0';
+    return seeded_encode("", bodies, 0.0, "");
+}
+
+bool EruEnvPlain::bimport_seeded(bool *r, size_t n, EruDataView a) {
+    EruDataView seed, bodies;
+    double variance;
+    if (!seeded_decode(a, n, 1, "", seed, bodies, variance))
+        return false;
+    for (size_t i = 0; i < n; i++)
+        r[i] = bodies.data[i] == '1';
+    return true;
 }
 
 // Encrypted FHE environment
 
 TFheGateBootstrappingCloudKeySet* EruEnvFhe::_key() {
+    job_tick();  // every gate passes through here
     if (_session == nullptr)
         return nullptr;
     return const_cast<TFheGateBootstrappingCloudKeySet*>(
@@ -287,13 +1069,44 @@ void EruEnvFhe::lifelse(EruGate *r, const EruGate *a, const EruGate *b,
 }
 
 void EruEnvFhe::encrypt(EruGate *r, const bool a) {
-    bootsSymEncrypt(r, a, _session->get_key().secret_raw());
+    // a stream of its own rather than TFHE's generator, which nothing
+    // seeds once keys come from the pool
+    EruKey key = _session->get_key();
+    if (key.secret_raw() == nullptr)
+        throw std::runtime_error("encryption needs the secret key");
+    lwe_stream stream;
+    lwe_encrypt(r, a, key.secret_raw()->lwe_key, stream);
 }
 
 bool EruEnvFhe::decrypt(const EruGate *a) {
     return bootsSymDecrypt(a, _session->get_key().secret_raw()) != 0;
 }
 
+void EruEnvFhe::encrypt_many(EruGate *r, const bool *a, size_t n) {
+    EruKey key = _session->get_key();
+    if (key.secret_raw() == nullptr)
+        throw std::runtime_error("encryption needs the secret key");
+    auto lwe_key = key.secret_raw()->lwe_key;
+    parallel_for((n + batch_chunk - 1) / batch_chunk, [&](size_t c) {
+        lwe_stream stream;
+        size_t end = std::min(n, (c + 1) * batch_chunk);
+        for (size_t i = c * batch_chunk; i < end; i++)
+            lwe_encrypt(r + i, a[i], lwe_key, stream);
+    });
+}
+
+void EruEnvFhe::decrypt_many(const EruGate *a, bool *r, size_t n) {
+    EruKey key = _session->get_key();
+    auto secret = key.secret_raw();
+    if (secret == nullptr)
+        throw std::runtime_error("decryption needs the secret key");
+    parallel_for((n + batch_chunk - 1) / batch_chunk, [&](size_t c) {
+        size_t end = std::min(n, (c + 1) * batch_chunk);
+        for (size_t i = c * batch_chunk; i < end; i++)
+            r[i] = bootsSymDecrypt(a + i, secret) != 0;
+    });
+}
+
 EruData EruEnvFhe::bexport(EruGate *a) {
     auto params = _session->params();
     std::stringstream stream;
@@ -301,30 +1114,111 @@ EruData EruEnvFhe::bexport(EruGate *a) {
     return dump_sstream(stream);
 }
 
-void EruEnvFhe::bimport(EruGate *r, const EruData &a) {
+void EruEnvFhe::bimport(EruGate *r, EruDataView a) {
     auto params = _session->params();
-    std::stringstream stream;
-    stream.write(a.c_str(), a.length());
+    membuf buffer(a);
+    std::istream stream(&buffer);
     import_gate_bootstrapping_ciphertext_fromStream(stream, r, params);
 }
 
+// Raw gates are the LWE mask, the body and the variance, back to back in
+// host byte order. Unlike bexport, the size only depends on the parameters.
+
+size_t EruEnvFhe::bsize() {
+    size_t n = _session->params()->in_out_params->n;
+    return n * sizeof(Torus32) + sizeof(Torus32) + sizeof(double);
+}
+
+void EruEnvFhe::bstore(const EruGate *a, char *out) {
+    size_t n = _session->params()->in_out_params->n;
+    memcpy(out, a->a, n * sizeof(Torus32));
+    out += n * sizeof(Torus32);
+    memcpy(out, &a->b, sizeof(Torus32));
+    memcpy(out + sizeof(Torus32), &a->current_variance, sizeof(double));
+}
+
+void EruEnvFhe::bload(EruGate *r, const char *in) {
+    size_t n = _session->params()->in_out_params->n;
+    memcpy(r->a, in, n * sizeof(Torus32));
+    in += n * sizeof(Torus32);
+    memcpy(&r->b, in, sizeof(Torus32));
+    memcpy(&r->current_variance, in + sizeof(Torus32), sizeof(double));
+}
+
+// A fresh sample is (a, <a, s> + m + e) with uniform a. Replacing a by a
+// mask expanded from a seed and recomputing the body with the secret key
+// keeps the phase m + e, and thus the noise, exactly as it was.
+
+EruData EruEnvFhe::bexport_seeded(EruGate *r, size_t n) {
+    auto key = _session->get_key().secret_raw();
+    if (key == nullptr)
+        throw std::runtime_error("compact export needs the secret key");
+    auto lwe_key = key->lwe_key;
+    size_t dim = _session->params()->in_out_params->n;
+    unsigned char raw_seed[seeded_seed_size];
+    if (RAND_bytes(raw_seed, seeded_seed_size) != 1)
+        throw std::runtime_error("cannot generate secure seed");
+    EruData seed((const char*)raw_seed, seeded_seed_size);
+    EruData bodies(n * 4, '\0');
+    double variance = 0.0;
+    for (size_t i = 0; i < n; i++) {
+        uint32_t body = (uint32_t)lwePhase(r + i, lwe_key);
+        seeded_mask(seed, i, r[i].a, dim);
+        for (size_t j = 0; j < dim; j++)
+            body += (uint32_t)r[i].a[j] * (uint32_t)lwe_key->key[j];
+        r[i].b = (Torus32)body;
+        for (int k = 0; k < 4; k++)
+            bodies[4 * i + k] = (char)(body >> (8 * k));
+        variance = std::max(variance, r[i].current_variance);
+    }
+    return seeded_encode(seed, bodies, variance, btag());
+}
+
+bool EruEnvFhe::bimport_seeded(EruGate *r, size_t n, EruDataView a) {
+    EruDataView seed, bodies;
+    double variance;
+    if (!seeded_decode(a, n, 4, btag(), seed, bodies, variance))
+        return false;
+    size_t dim = _session->params()->in_out_params->n;
+    for (size_t i = 0; i < n; i++) {
+        seeded_mask(seed, i, r[i].a, dim);
+        auto b = (const unsigned char*)bodies.data + 4 * i;
+        r[i].b = (Torus32)((uint32_t)b[0] | (uint32_t)b[1] << 8 |
+            (uint32_t)b[2] << 16 | (uint32_t)b[3] << 24);
+        r[i].current_variance = variance;
+    }
+    return true;
+}
+
+EruData EruEnvFhe::bparams() {
+    std::stringstream stream;
+    export_tfheGateBootstrappingParameterSet_toStream(stream,
+        _session->params());
+    return dump_sstream(stream);
+}
+
+EruData EruEnvFhe::btag() {
+    return _session->tag();
+}
+
 // Session manager
 
-EruSession::EruSession(int min_lambda) : _min_lambda(min_lambda) {
-    _params = std::shared_ptr<TFheGateBootstrappingParameterSet>(
-        new_default_gate_bootstrapping_parameters(_min_lambda),
-        _TFheGateBootstrappingParameterSetDeleter()
-    );
+EruSession::EruSession(int min_lambda) :
+    EruSession(EruParams::preset(min_lambda)) {}
+
+EruSession::EruSession(const EruParams &preset) : _preset(preset) {
+    _tag = _preset.tag();
+    _params = _preset.tfhe();
     _env = std::shared_ptr<EruEnvFhe>(new EruEnvFhe(this));
 }
 
 EruSession::EruSession(const EruSession &other) :
-    _min_lambda(other._min_lambda), _params(other._params),
+    _preset(other._preset), _tag(other._tag), _params(other._params),
     _key(other._key), _env(other._env) {}
 
 void EruSession::set_seed() {
-    // This function is cryptographically secure
-    int size = _min_lambda * 2 / 32 + 1;
+    // This function is cryptographically secure, 2 * 128 bits
+    int size = 128 * 2 / 32 + 1;
     auto buffer = std::unique_ptr<uint32_t>(new uint32_t[size]);
     if (RAND_bytes((unsigned char*)buffer.get(), size * 4) != 1)
         throw std::runtime_error("cannot generate secure seed");
@@ -336,8 +1230,14 @@ void EruSession::set_seed(uint32_t values[], size_t size) {
 }
 
 void EruSession::generate_key(bool seed) {
-    if (seed)
-        set_seed();
+    if (seed) {
+        auto pool = EruKeyPool::get_default();
+        if (pool != nullptr && pool->preset() == _preset)
+            _key = pool->take();
+        else
+            _key = EruKey::generate(_params);
+        return;
+    }
     TFheGateBootstrappingSecretKeySet *key;
     key = new_random_gate_bootstrapping_secret_keyset(_params.get());
     auto ptr = std::shared_ptr<TFheGateBootstrappingSecretKeySet>(key,
@@ -346,6 +1246,9 @@ void EruSession::generate_key(bool seed) {
 }
 
 void EruSession::set_key(EruKey key) {
+    auto params = key.params_raw();
+    if (params != nullptr && EruParams::from_tfhe(params) != _preset)
+        throw std::runtime_error("key is under other parameters");
     _key = key;
 }
 
@@ -357,6 +1260,14 @@ TFheGateBootstrappingParameterSet* EruSession::params() {
     return _params.get();
 }
 
+const EruParams& EruSession::preset() {
+    return _preset;
+}
+
+const EruData& EruSession::tag() {
+    return _tag;
+}
+
 EruEnvFhe* EruSession::env() {
     return _env.get();
 }
@@ -26,7 +26,13 @@
 #define _LIBERU_CRYPTO_H
 
 #include <tfhe/tfhe.h>
+#include <condition_variable>
+#include <deque>
 #include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
 
 #include "utils.h"
 
@@ -38,6 +44,68 @@ class EruEnvPlain;
 class EruEnvFhe;
 class EruSession;
 
+/// Where the time of a cloud key import went.
+struct EruKeyImportStats {
+    size_t bytes = 0;  // serialized key size
+    size_t threads = 0;  // threads that decoded and converted it
+    double decode_ms = 0;  // parsing, FFT included for TFHE's format
+    double fft_ms = 0;  // FFT conversion of the bootstrapping key
+    double total_ms = 0;
+};
+
+/// TFHE gate bootstrapping parameters, picked by preset name when a session
+/// is created. Keys carry their parameters and multi-bit ciphertexts carry
+/// tag(), so that material from other parameters is refused instead of
+/// decrypting to garbage.
+///
+/// Presets:
+///     "default_128": TFHE's defaults for 128 bits of security.
+///     "default_80": the defaults of TFHE 1.0, estimated at about 80 bits,
+///         with a smaller LWE dimension and a two-level bootstrapping key.
+///         Fastest gates.
+///     "fast_128": default_128 with a base-8, 5-level key switch instead of
+///         base-4, 8 levels. Same dimensions and noise, so the same
+///         security; 3/8 fewer additions per key switch, at 15 instead of
+///         16 bits of precision and a key switching key 25% larger.
+struct EruParams {
+    std::string name;
+    int32_t lwe_n;  // LWE dimension of ciphertexts
+    double lwe_stdev;  // and the noise of fresh ones and the key switch
+    int32_t tlwe_N;  // ring dimension of the bootstrapping accumulator
+    int32_t tlwe_k;  // and its number of mask polynomials
+    double tlwe_stdev;  // noise of the bootstrapping key
+    double max_stdev;
+    int32_t bk_l;  // bootstrapping key decomposition levels
+    int32_t bk_Bgbit;  // and log2 of their base
+    int32_t ks_t;  // key switching decomposition levels
+    int32_t ks_basebit;  // and log2 of their base
+    /// Named preset, throws on unknown names.
+    static EruParams preset(const std::string &name);
+    /// Preset of TFHE's default parameters for min_lambda.
+    static EruParams preset(int min_lambda);
+    /// Add or replace a preset under params.name.
+    static void register_preset(const EruParams &params);
+    static std::vector<std::string> presets();
+    /// Parameters of a TFHE parameter set, named after the preset they
+    /// match or "custom".
+    static EruParams from_tfhe(const TFheGateBootstrappingParameterSet *p);
+    /// TFHE parameter set, shared by everything using equal parameters.
+    std::shared_ptr<TFheGateBootstrappingParameterSet> tfhe() const;
+    /// "eru/params/" and a digest of the values, the name excluded.
+    EruData tag() const;
+    bool operator == (const EruParams &other) const;
+    bool operator != (const EruParams &other) const;
+};
+
+/// THERE BE DRAGONS!
+namespace _EruHazmat {
+    /// Throw if split holds a parameter tag after its first n objects that
+    /// differs from tag. Exports without one, or made by the plain backend
+    /// (empty tag), pass.
+    void check_params_tag(const std::vector<EruDataView> &split, size_t n,
+        const EruData &tag);
+}
+
 class EruKey {
 protected:
     std::shared_ptr<TFheGateBootstrappingSecretKeySet> _secret;
@@ -52,13 +120,56 @@ public:
         std::shared_ptr<TFheGateBootstrappingSecretKeySet> key);
     static EruKey from_cloud_raw(
         std::shared_ptr<TFheGateBootstrappingCloudKeySet> key);
-    static EruKey from_secret(EruData key);
-    static EruKey from_cloud(EruData key);
+    static EruKey from_secret(EruDataView key);
+    // New keyset under params, generated on all cores from independent
+    // secure random streams. The key keeps params alive.
+    static EruKey generate(
+        std::shared_ptr<TFheGateBootstrappingParameterSet> params);
+    // Cloud keys are either TFHE's stream format or an image exported by
+    // cloud_image(), which imports on all cores. Both are read in place.
+    static EruKey from_cloud(EruDataView key);
+    static EruKey from_cloud_fd(int fd);
+    // Timings of the last cloud key import on this thread
+    static EruKeyImportStats last_import();
     // data retrievers
+    const TFheGateBootstrappingParameterSet* params_raw();
     const TFheGateBootstrappingSecretKeySet* secret_raw();
     const TFheGateBootstrappingCloudKeySet* cloud_raw();
     EruData secret();
     EruData cloud();
+    EruData cloud_image();
+};
+
+/// Keysets generated ahead of time by a background thread, so that bursts
+/// of new sessions take a ready keyset instead of waiting seconds for one.
+/// Each keyset is handed out once.
+class EruKeyPool {
+private:
+    EruParams _preset;
+    size_t _capacity;
+    std::shared_ptr<TFheGateBootstrappingParameterSet> _params;
+    std::deque<EruKey> _ready;
+    bool _stopping;
+    std::mutex _lock;
+    std::condition_variable _cv_refill;
+    std::thread _worker;
+    void _refill();
+public:
+    /// @param preset: parameters of the keysets.
+    /// @param capacity: keysets kept ready.
+    EruKeyPool(const EruParams &preset, size_t capacity);
+    EruKeyPool(int min_lambda, size_t capacity);
+    EruKeyPool(const EruKeyPool &other) = delete;
+    /// Stops the background thread after the keyset it is working on.
+    ~EruKeyPool();
+    /// A ready keyset, or a freshly generated one if the pool ran dry.
+    EruKey take();
+    /// Number of keysets ready right now.
+    size_t ready();
+    const EruParams& preset();
+    /// Pool that EruSession::generate_key draws from, nullptr for none.
+    static void set_default(std::shared_ptr<EruKeyPool> pool);
+    static std::shared_ptr<EruKeyPool> get_default();
 };
 
 template <typename _T>
@@ -85,8 +196,28 @@ public:
         const _T *if_not_a) {}  // r = a ? if_a : if_not_a
     virtual void encrypt(_T *r, const bool a) {}  // bool -> _T
     virtual bool decrypt(const _T *a) { return false; }  // _T -> bool
+    // Batch encryption and decryption of n bits, spread across cores.
+    virtual void encrypt_many(_T *r, const bool *a, size_t n) {
+        for (size_t i = 0; i < n; i++)
+            encrypt(r + i, a[i]);
+    }
+    virtual void decrypt_many(const _T *a, bool *r, size_t n) {
+        for (size_t i = 0; i < n; i++)
+            r[i] = decrypt(a + i);
+    }
     virtual EruData bexport(_T *a) { return ""; }  // export to EruData
-    virtual void bimport(_T *r, const EruData &a) {}  // import from EruData
+    virtual void bimport(_T *r, EruDataView a) {}  // import from EruData
+    virtual size_t bsize() { return 0; }  // bytes of one raw gate, 0: none
+    virtual void bstore(const _T *a, char *out) {}  // raw export, bsize()
+    virtual void bload(_T *r, const char *in) {}  // raw import, bsize()
+    virtual EruData bparams() { return ""; }  // identifies the parameters
+    virtual EruData btag() { return ""; }  // EruParams::tag(), "": none
+    // Compact export of n fresh ciphertexts, and its import. Returns false
+    // if a is not in the compact format, so callers can fall back.
+    virtual EruData bexport_seeded(_T *r, size_t n) { return ""; }
+    virtual bool bimport_seeded(_T *r, size_t n, EruDataView a) {
+        return false;
+    }
 };
 
 class EruEnvPlain : public EruEnv<bool> {
@@ -109,8 +240,16 @@ public:
     void lifelse(bool *r, const bool *a, const bool *b, const bool *c);
     void encrypt(bool *r, const bool a);
     bool decrypt(const bool *a);
+    void encrypt_many(bool *r, const bool *a, size_t n);
+    void decrypt_many(const bool *a, bool *r, size_t n);
     EruData bexport(bool *a);
-    void bimport(bool *r, const EruData &a);
+    void bimport(bool *r, EruDataView a);
+    size_t bsize();
+    void bstore(const bool *a, char *out);
+    void bload(bool *r, const char *in);
+    EruData bparams();
+    EruData bexport_seeded(bool *r, size_t n);
+    bool bimport_seeded(bool *r, size_t n, EruDataView a);
 };
 
 class EruEnvFhe : public EruEnv<EruGate> {
@@ -139,30 +278,45 @@ public:
     void lifelse(EruGate *r, const EruGate *a, const EruGate *b, const EruGate *c);
     void encrypt(EruGate *r, const bool a);
     bool decrypt(const EruGate *a);
+    void encrypt_many(EruGate *r, const bool *a, size_t n);
+    void decrypt_many(const EruGate *a, bool *r, size_t n);
     EruData bexport(EruGate *a);
-    void bimport(EruGate *r, const EruData &a);
+    void bimport(EruGate *r, EruDataView a);
+    size_t bsize();
+    void bstore(const EruGate *a, char *out);
+    void bload(EruGate *r, const char *in);
+    EruData bparams();
+    EruData btag();
+    EruData bexport_seeded(EruGate *r, size_t n);
+    bool bimport_seeded(EruGate *r, size_t n, EruDataView a);
 };
 
 class EruSession {
 protected:
-    int _min_lambda;
+    EruParams _preset;
+    EruData _tag;
     std::shared_ptr<TFheGateBootstrappingParameterSet> _params;
     EruKey _key;
     std::shared_ptr<EruEnvFhe> _env;
 public:
     EruSession(int min_lambda);
+    EruSession(const EruParams &preset);
     EruSession(const EruSession &other);
     // Reset session seed
     void set_seed();
     void set_seed(uint32_t values[], size_t size);
-    // Generate new keypair
+    // Generate new keypair, taken from the default EruKeyPool if there is
+    // one. With seed = false the keypair comes from TFHE's generator as
+    // seeded by set_seed(values, size), which keeps it reproducible.
     void generate_key(bool seed = true);
-    // Set existing key
+    // Set existing key, which must be under the session's parameters
     void set_key(EruKey key);
     // Get key
     EruKey get_key();
     // Get current parameters
     TFheGateBootstrappingParameterSet* params();
+    const EruParams& preset();
+    const EruData& tag();
     // Get session environment
     EruEnvFhe* env();
 };
@@ -0,0 +1,111 @@
+
+#include <csignal>
+#include <fcntl.h>
+#include <iostream>
+#include <string>
+#include <unistd.h>
+#include <vector>
+#include "liberu.h"
+#include "server.h"
+#include "services.h"
+
+using namespace std;
+
+
+static volatile sig_atomic_t stop_requested = 0;
+
+void on_signal(int sig) {
+    stop_requested = 1;
+}
+
+void usage(const char *prog) {
+    cerr << "usage: " << prog << " [options]\n"
+         << "  --socket PATH             unix socket to listen on\n"
+         << "  --workers N               worker threads, 0 for per-core (0)\n"
+         << "  --queue N                 max queued requests (64)\n"
+         << "  --connections N           max open connections (256)\n"
+         << "  --timeout-ms N            per-request timeout (600000)\n"
+         << "  --max-frame MB            largest request accepted (256)\n"
+         << "  --key-cache N             cloud keys kept warm (16)\n"
+         << "  --memory-budget MB        ciphertext memory per request\n"
+         << "                            before spilling, 0 for none (0)\n"
+         << "  --spill-dir PATH          directory of spill files ($TMPDIR)\n"
+         << "  --circuit-cache N         compiled circuits kept warm (16)\n"
+         << "  --circuit-dir PATH        keep compiled circuits across runs\n"
+         << "  --preload-key PATH        decode a cloud key before serving,\n"
+         << "                            may be repeated\n";
+}
+
+int main(int argc, char **argv) {
+    EruServerConfig config;
+    vector<string> preload_keys;
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (i + 1 >= argc) {
+            usage(argv[0]);
+            return arg == "--help" ? 0 : 1;
+        }
+        string val = argv[++i];
+        if (arg == "--socket")
+            config.socket_path = val;
+        else if (arg == "--workers")
+            config.workers = stoul(val);
+        else if (arg == "--queue")
+            config.max_queue = stoul(val);
+        else if (arg == "--connections")
+            config.max_connections = stoul(val);
+        else if (arg == "--timeout-ms")
+            config.timeout_ms = stoull(val);
+        else if (arg == "--max-frame")
+            config.max_frame = stoull(val) << 20;
+        else if (arg == "--key-cache")
+            config.key_cache = stoul(val);
+        else if (arg == "--memory-budget")
+            config.memory_budget = stoull(val) << 20;
+        else if (arg == "--spill-dir")
+            config.spill_dir = val;
+        else if (arg == "--circuit-cache")
+            config.circuit_cache = stoul(val);
+        else if (arg == "--circuit-dir")
+            config.circuit_dir = val;
+        else if (arg == "--preload-key")
+            preload_keys.push_back(val);
+        else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+    EruServer server(config);
+    for (auto &path : preload_keys) {
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            cerr << "cannot open " << path << endl;
+            return 1;
+        }
+        try {
+            auto stats = svc_preload_key(fd);
+            cerr << "preloaded " << path << ": " << stats.bytes
+                 << " bytes in " << stats.total_ms << " ms (decode "
+                 << stats.decode_ms << ", fft " << stats.fft_ms << ", "
+                 << stats.threads << " threads)" << endl;
+        } catch (exception &e) {
+            cerr << "cannot preload " << path << ": " << e.what() << endl;
+            close(fd);
+            return 1;
+        }
+        close(fd);
+    }
+    server.start();
+    cerr << "listening on " << config.socket_path << endl;
+    while (!stop_requested)
+        usleep(100000);
+    cerr << "stopping" << endl;
+    server.stop();
+    cerr << "served " << server.served() << ", rejected "
+         << server.rejected() << ", timed out " << server.timed_out()
+         << ", failed " << server.failed() << endl;
+    return 0;
+}
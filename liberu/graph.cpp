@@ -0,0 +1,743 @@
+
+// graph.cpp: gate graph construction and optimization passes
+// MIT License
+//
+// Copyright (c) 2021 Geoffrey Tang
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+#include <fstream>
+#include <queue>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+#include <unistd.h>
+#include <unordered_map>
+
+#include "graph.h"
+
+
+/// Two-input gates are optimized as truth tables: bit (a << 1 | b) of the
+/// table is the result for inputs a and b. Fixing, negating or swapping
+/// operands permutes the table, and the 16 tables are exactly the ten
+/// binary gates, both constants, a, b, !a and !b.
+static const uint8_t gate_tables[] = {
+    8,  // AND
+    14,  // OR
+    7,  // NAND
+    1,  // NOR
+    6,  // XOR
+    9,  // XNOR
+    4,  // ANDYN
+    2,  // ANDNY
+    13,  // ORYN
+    11,  // ORNY
+};
+
+static bool gate_is_binary(uint8_t op) {
+    return op >= ERU_GATE_AND && op < ERU_GATE_MUX;
+}
+
+static uint8_t table_of(uint8_t op) {
+    return gate_tables[op - ERU_GATE_AND];
+}
+
+static uint8_t table_flip_a(uint8_t t) {
+    return ((t >> 2) & 3) | ((t & 3) << 2);
+}
+
+static uint8_t table_flip_b(uint8_t t) {
+    return ((t >> 1) & 5) | ((t & 5) << 1);
+}
+
+static uint8_t table_swap(uint8_t t) {
+    return (t & 9) | ((t & 2) << 1) | ((t & 4) >> 1);
+}
+
+/// The table with a fixed to v, as a function of b alone.
+static uint8_t table_fix_a(uint8_t t, bool v) {
+    return ((t >> (2 * v)) & 1 ? 5 : 0) | ((t >> (2 * v + 1)) & 1 ? 10 : 0);
+}
+
+/// The table with b fixed to v, as a function of a alone.
+static uint8_t table_fix_b(uint8_t t, bool v) {
+    return ((t >> v) & 1 ? 3 : 0) | ((t >> (2 + v)) & 1 ? 12 : 0);
+}
+
+/// The table with b equal to a, as a function of a alone.
+static uint8_t table_same(uint8_t t) {
+    return (t & 1 ? 3 : 0) | (t & 8 ? 12 : 0);
+}
+
+size_t _EruHazmat::gate_bootstraps(uint8_t op) {
+    if (op == ERU_GATE_MUX)
+        return 2;
+    return gate_is_binary(op) ? 1 : 0;
+}
+
+uint8_t _EruHazmat::gate_of_table(uint8_t t) {
+    for (uint8_t op = ERU_GATE_AND; op < ERU_GATE_MUX; op++)
+        if (table_of(op) == (t & 15))
+            return op;
+    return ERU_GATE_INPUT;
+}
+
+uint32_t EruCircuit::_add(uint8_t op, uint32_t a, uint32_t b, uint32_t c) {
+    EruGateNode node = {op, a, b, c};
+    _nodes.push_back(node);
+    return _nodes.size() - 1;
+}
+
+uint32_t EruCircuit::_add_input(size_t n) {
+    uint32_t first = _nodes.size();
+    for (size_t i = 0; i < n; i++)
+        _add(ERU_GATE_INPUT, _input_bits + i);
+    _input_bits += n;
+    _inputs.push_back(n);
+    return first;
+}
+
+void EruCircuit::_add_output(const std::vector<uint32_t> &nodes) {
+    _results.insert(_results.end(), nodes.begin(), nodes.end());
+    _outputs.push_back(nodes.size());
+}
+
+const std::vector<EruGateNode>& EruCircuit::nodes() const {
+    return _nodes;
+}
+
+const std::vector<size_t>& EruCircuit::inputs() const {
+    return _inputs;
+}
+
+const std::vector<size_t>& EruCircuit::outputs() const {
+    return _outputs;
+}
+
+const std::vector<uint32_t>& EruCircuit::results() const {
+    return _results;
+}
+
+size_t EruCircuit::gates() const {
+    return _nodes.size() - _input_bits;
+}
+
+size_t EruCircuit::bootstraps() const {
+    size_t res = 0;
+    for (auto &node : _nodes)
+        res += _EruHazmat::gate_bootstraps(node.op);
+    return res;
+}
+
+/// Hash for looking up equal nodes in common subexpression elimination.
+struct _EruGateNodeHash {
+    size_t operator() (const EruGateNode &node) const {
+        uint64_t h = node.op;
+        h = h * 0x9e3779b97f4a7c15ull + node.a;
+        h = h * 0x9e3779b97f4a7c15ull + node.b;
+        h = h * 0x9e3779b97f4a7c15ull + node.c;
+        return (size_t)(h ^ (h >> 29));
+    }
+};
+
+/// Rebuild the node list in one forward sweep. Every node is first
+/// simplified with the enabled passes, on operands that were already
+/// rewritten, and then either replaced by an existing node or appended.
+void EruCircuit::_rewrite(unsigned passes) {
+    std::vector<EruGateNode> res;
+    res.reserve(_nodes.size());
+    std::vector<uint32_t> map(_nodes.size());
+    std::unordered_map<EruGateNode, uint32_t, _EruGateNodeHash> seen;
+    auto emit = [&](uint8_t op, uint32_t a, uint32_t b, uint32_t c) {
+        EruGateNode node = {op, a, b, c};
+        if ((passes & ERU_PASS_CSE) && op != ERU_GATE_INPUT) {
+            auto it = seen.find(node);
+            if (it != seen.end())
+                return it->second;
+        }
+        res.push_back(node);
+        uint32_t id = res.size() - 1;
+        if (passes & ERU_PASS_CSE)
+            seen[node] = id;
+        return id;
+    };
+    auto is_const = [&](uint32_t x) {
+        return (passes & ERU_PASS_CONST) && res[x].op == ERU_GATE_CONST;
+    };
+    auto is_not = [&](uint32_t x) {
+        return (passes & ERU_PASS_NOT) && res[x].op == ERU_GATE_NOT;
+    };
+    auto negate = [&](uint32_t x) {
+        if (is_const(x))
+            return emit(ERU_GATE_CONST, !res[x].a, 0, 0);
+        if (is_not(x))
+            return res[x].a;
+        return emit(ERU_GATE_NOT, x, 0, 0);
+    };
+    // table t of operands x and y
+    auto binary = [&](uint8_t t, uint32_t x, uint32_t y) {
+        if (is_not(x)) {
+            x = res[x].a;
+            t = table_flip_a(t);
+        }
+        if (is_not(y)) {
+            y = res[y].a;
+            t = table_flip_b(t);
+        }
+        if (is_const(x))
+            t = table_fix_a(t, res[x].a);
+        else if (is_const(y))
+            t = table_fix_b(t, res[y].a);
+        else if ((passes & ERU_PASS_CONST) && x == y)
+            t = table_same(t);
+        if ((passes & ERU_PASS_CSE) && x > y) {
+            std::swap(x, y);
+            t = table_swap(t);
+        }
+        switch (t) {
+            case 0: return emit(ERU_GATE_CONST, 0, 0, 0);
+            case 15: return emit(ERU_GATE_CONST, 1, 0, 0);
+            case 12: return x;
+            case 10: return y;
+            case 3: return negate(x);
+            case 5: return negate(y);
+        }
+        uint8_t op = ERU_GATE_AND;
+        while (table_of(op) != t)
+            op++;
+        return emit(op, x, y, 0);
+    };
+    for (size_t i = 0; i < _nodes.size(); i++) {
+        auto node = _nodes[i];
+        uint32_t a = node.a, b = node.b, c = node.c;
+        if (node.op != ERU_GATE_INPUT && node.op != ERU_GATE_CONST) {
+            a = map[a];
+            b = map[b];
+            c = map[c];
+        }
+        switch (node.op) {
+            case ERU_GATE_INPUT:
+            case ERU_GATE_CONST:
+                map[i] = emit(node.op, node.a, 0, 0);
+                break;
+            case ERU_GATE_COPY:
+                map[i] = passes & ERU_PASS_COPY ? a :
+                    emit(ERU_GATE_COPY, a, 0, 0);
+                break;
+            case ERU_GATE_NOT:
+                map[i] = negate(a);
+                break;
+            case ERU_GATE_MUX:
+                if (is_not(a)) {
+                    a = res[a].a;
+                    std::swap(b, c);
+                }
+                if (is_const(a))
+                    map[i] = res[a].a ? b : c;
+                else if ((passes & ERU_PASS_CONST) && b == c)
+                    map[i] = b;
+                else if (is_const(b))  // a || c, !a && c
+                    map[i] = binary(res[b].a ? 14 : 2, a, c);
+                else if (is_const(c))  // !a || b, a && b
+                    map[i] = binary(res[c].a ? 11 : 8, a, b);
+                else if ((passes & ERU_PASS_CONST) && (a == b || a == c))
+                    map[i] = binary(a == b ? 14 : 8, a, a == b ? c : b);
+                else
+                    map[i] = emit(ERU_GATE_MUX, a, b, c);
+                break;
+            default:
+                if (!gate_is_binary(node.op))
+                    throw std::runtime_error("invalid gate");
+                map[i] = binary(table_of(node.op), a, b);
+        }
+    }
+    for (auto &r : _results)
+        r = map[r];
+    _nodes.swap(res);
+}
+
+/// Drop nodes that no output depends on. Inputs stay, they are numbered.
+void EruCircuit::_sweep() {
+    std::vector<bool> live(_nodes.size(), false);
+    for (auto r : _results)
+        live[r] = true;
+    for (size_t i = _nodes.size(); i-- > 0; ) {
+        auto &node = _nodes[i];
+        if (node.op == ERU_GATE_INPUT)
+            live[i] = true;
+        if (!live[i] || node.op == ERU_GATE_INPUT ||
+                node.op == ERU_GATE_CONST)
+            continue;
+        live[node.a] = true;
+        if (node.op >= ERU_GATE_AND)
+            live[node.b] = true;
+        if (node.op == ERU_GATE_MUX)
+            live[node.c] = true;
+    }
+    std::vector<uint32_t> map(_nodes.size());
+    size_t n = 0;
+    for (size_t i = 0; i < _nodes.size(); i++) {
+        if (!live[i])
+            continue;
+        auto node = _nodes[i];
+        if (node.op != ERU_GATE_INPUT && node.op != ERU_GATE_CONST) {
+            node.a = map[node.a];
+            node.b = map[node.b];
+            node.c = map[node.c];
+        }
+        map[i] = n;
+        _nodes[n++] = node;
+    }
+    _nodes.resize(n);
+    for (auto &r : _results)
+        r = map[r];
+}
+
+EruCircuitStats EruCircuit::optimize(unsigned passes) {
+    EruCircuitStats stats;
+    stats.gates_before = gates();
+    stats.bootstraps_before = bootstraps();
+    // each sweep enables more of the others, stop once nothing changes
+    for (int round = 0; round < 64; round++) {
+        auto before = _nodes;
+        if (passes & ~ERU_PASS_DEAD)
+            _rewrite(passes);
+        if (passes & ERU_PASS_DEAD)
+            _sweep();
+        if (_nodes == before)
+            break;
+    }
+    stats.gates_after = gates();
+    stats.bootstraps_after = bootstraps();
+    return stats;
+}
+
+/// Operands of node x into ops, repeats included, returns their number.
+static int gate_operands(const EruGateNode &node, uint32_t *ops) {
+    if (node.op == ERU_GATE_INPUT || node.op == ERU_GATE_CONST)
+        return 0;
+    ops[0] = node.a;
+    ops[1] = node.b;
+    ops[2] = node.c;
+    if (node.op < ERU_GATE_AND)
+        return 1;
+    return node.op == ERU_GATE_MUX ? 3 : 2;
+}
+
+/// A ready gate waiting in the scheduler's queue.
+struct _EruReadyGate {
+    int frees;  // operands whose last read this is
+    uint64_t stamp;  // readied later, goes first
+    uint32_t node;
+    bool operator < (const _EruReadyGate &other) const {
+        if (frees != other.frees)
+            return frees < other.frees;
+        return stamp < other.stamp;
+    }
+};
+
+EruSchedule EruCircuit::schedule(size_t width, size_t max_live) const {
+    if (width == 0)
+        width = std::max<size_t>(1, std::thread::hardware_concurrency());
+    if (max_live == 0)
+        max_live = 8 * width;
+    size_t n = _nodes.size();
+    EruSchedule res;
+    res.slot.assign(n, 0);
+    // reads left of every value, outputs are read at the very end
+    std::vector<uint32_t> uses(n, 0), waiting(n, 0);
+    std::vector<size_t> first(n + 1, 0);
+    uint32_t ops[3];
+    for (size_t x = 0; x < n; x++)
+        for (int i = 0, k = gate_operands(_nodes[x], ops); i < k; i++)
+            first[ops[i] + 1]++;
+    for (size_t x = 0; x < n; x++)
+        first[x + 1] += first[x];
+    std::vector<uint32_t> users(first[n]);
+    for (size_t x = 0; x < n; x++)
+        for (int i = 0, k = gate_operands(_nodes[x], ops); i < k; i++) {
+            uint32_t o = ops[i];
+            users[first[o] + uses[o]++] = x;
+            if (_nodes[o].op != ERU_GATE_INPUT)
+                waiting[x]++;
+        }
+    for (auto r : _results)
+        uses[r]++;
+    auto frees = [&](uint32_t x) {
+        uint32_t o[3];
+        int k = gate_operands(_nodes[x], o), f = 0;
+        for (int i = 0; i < k; i++) {
+            if (_nodes[o[i]].op == ERU_GATE_INPUT ||
+                    std::find(o, o + i, o[i]) != o + i)
+                continue;
+            if (uses[o[i]] == (uint32_t)std::count(o, o + k, o[i]))
+                f++;
+        }
+        return f;
+    };
+    std::priority_queue<_EruReadyGate> ready;
+    uint64_t stamp = 0;
+    auto push = [&](uint32_t x) {
+        _EruReadyGate gate = {frees(x), stamp++, x};
+        ready.push(gate);
+    };
+    std::vector<bool> done(n, false);
+    // backwards, so that the first gates recorded come out first
+    for (size_t x = n; x-- > 0; ) {
+        if (_nodes[x].op == ERU_GATE_INPUT)
+            done[x] = true;
+        else if (waiting[x] == 0)
+            push(x);
+    }
+    std::vector<uint32_t> free_slots, batch;
+    res.steps.push_back(0);
+    while (!ready.empty()) {
+        batch.clear();
+        size_t live = res.slots - free_slots.size();
+        while (batch.size() < width && !ready.empty()) {
+            auto gate = ready.top();
+            if (done[gate.node]) {
+                ready.pop();
+                continue;
+            }
+            int f = frees(gate.node);
+            if (f != gate.frees) {  // stale, operands lost readers since
+                ready.pop();
+                gate.frees = f;
+                ready.push(gate);
+                continue;
+            }
+            // gates freeing nothing only add live values, and all those
+            // left in the queue are such gates
+            if (f == 0 && live >= max_live && !batch.empty())
+                break;
+            ready.pop();
+            live += 1 - std::min(f, 1);
+            done[gate.node] = true;
+            batch.push_back(gate.node);
+        }
+        // slots freed by this step are still read during it, so they are
+        // only handed out again from the next one
+        for (auto x : batch) {
+            if (free_slots.empty()) {
+                res.slot[x] = res.slots++;
+            } else {
+                res.slot[x] = free_slots.back();
+                free_slots.pop_back();
+            }
+            res.order.push_back(x);
+        }
+        for (auto x : batch) {
+            for (int i = 0, k = gate_operands(_nodes[x], ops); i < k; i++) {
+                uint32_t o = ops[i];
+                if (_nodes[o].op == ERU_GATE_INPUT)
+                    continue;
+                if (--uses[o] == 0) {
+                    free_slots.push_back(res.slot[o]);
+                    continue;
+                }
+                // a last reader may be waiting with an outdated priority
+                if (uses[o] <= 3)
+                    for (size_t u = first[o]; u < first[o + 1]; u++)
+                        if (!done[users[u]] && waiting[users[u]] == 0)
+                            push(users[u]);
+            }
+            if (uses[x] == 0)
+                free_slots.push_back(res.slot[x]);
+        }
+        for (auto x : batch)
+            for (size_t u = first[x]; u < first[x + 1]; u++)
+                if (--waiting[users[u]] == 0)
+                    push(users[u]);
+        res.steps.push_back(res.order.size());
+    }
+    return res;
+}
+
+EruSchedule EruCircuit::levels() const {
+    size_t n = _nodes.size();
+    EruSchedule res;
+    res.slot.assign(n, 0);
+    // level of every node and the last level reading it, inputs are 0
+    std::vector<uint32_t> level(n, 0), last(n, 0);
+    std::vector<bool> pinned(n, false);
+    uint32_t ops[3], depth = 0;
+    for (size_t x = 0; x < n; x++) {
+        if (_nodes[x].op == ERU_GATE_INPUT)
+            continue;
+        uint32_t l = 0;
+        for (int i = 0, k = gate_operands(_nodes[x], ops); i < k; i++)
+            l = std::max(l, level[ops[i]]);
+        level[x] = l + 1;
+        depth = std::max(depth, l + 1);
+        for (int i = 0, k = gate_operands(_nodes[x], ops); i < k; i++)
+            last[ops[i]] = std::max(last[ops[i]], l + 1);
+    }
+    for (auto r : _results)
+        pinned[r] = true;
+    // counting sort by level, node order kept within one
+    std::vector<size_t> first(depth + 2, 0);
+    for (size_t x = 0; x < n; x++)
+        if (_nodes[x].op != ERU_GATE_INPUT)
+            first[level[x] + 1]++;
+    for (size_t l = 0; l <= depth; l++)
+        first[l + 1] += first[l];
+    res.order.resize(first[depth + 1]);
+    std::vector<size_t> fill(first.begin(), first.end() - 1);
+    for (size_t x = 0; x < n; x++)
+        if (_nodes[x].op != ERU_GATE_INPUT)
+            res.order[fill[level[x]]++] = x;
+    // values die after the level of their last reader, at once if unread
+    std::vector<std::vector<uint32_t>> dies(depth + 1);
+    for (auto x : res.order)
+        if (!pinned[x])
+            dies[std::max(last[x], level[x])].push_back(x);
+    std::vector<uint32_t> free_slots;
+    res.steps.push_back(0);
+    for (uint32_t l = 1; l <= depth; l++) {
+        for (size_t i = first[l]; i < first[l + 1]; i++) {
+            uint32_t x = res.order[i];
+            if (free_slots.empty()) {
+                res.slot[x] = res.slots++;
+            } else {
+                res.slot[x] = free_slots.back();
+                free_slots.pop_back();
+            }
+        }
+        for (auto x : dies[l])
+            free_slots.push_back(res.slot[x]);
+        res.steps.push_back(first[l + 1]);
+    }
+    return res;
+}
+
+/// save() := binobjlist [magic, inputs, outputs, results, nodes], each
+/// list of u32 little-endian, nodes as <op: u8> <a> <b> <c>.
+static const char *circuit_magic = "eru/circuit/1";
+
+static void put_u32(EruData &out, uint32_t x) {
+    for (int i = 0; i < 4; i++)
+        out.push_back((char)((x >> (8 * i)) & 0xff));
+}
+
+static uint32_t get_u32(const char *in) {
+    uint32_t x = 0;
+    for (int i = 0; i < 4; i++)
+        x |= ((uint32_t)in[i] & 0xff) << (8 * i);
+    return x;
+}
+
+template <typename _V>
+static EruData put_u32s(const std::vector<_V> &values) {
+    EruData out;
+    out.reserve(4 * values.size());
+    for (auto x : values)
+        put_u32(out, x);
+    return out;
+}
+
+static std::vector<uint32_t> get_u32s(EruDataView data) {
+    if (data.length % 4 != 0)
+        throw std::runtime_error("malformed circuit");
+    std::vector<uint32_t> res(data.length / 4);
+    for (size_t i = 0; i < res.size(); i++)
+        res[i] = get_u32(data.data + 4 * i);
+    return res;
+}
+
+EruData EruCircuit::save() const {
+    EruData nodes;
+    nodes.reserve(13 * _nodes.size());
+    uint32_t ops[3] = {0, 0, 0};
+    for (auto &node : _nodes) {
+        // operands the op doesn't read may be stale, save them as 0
+        int k = gate_operands(node, ops);
+        nodes.push_back((char)node.op);
+        put_u32(nodes, k > 0 || node.op <= ERU_GATE_CONST ? node.a : 0);
+        put_u32(nodes, k > 1 ? node.b : 0);
+        put_u32(nodes, k > 2 ? node.c : 0);
+    }
+    return _EruHazmat::binobjlist_encode({circuit_magic, put_u32s(_inputs),
+        put_u32s(_outputs), put_u32s(_results), nodes});
+}
+
+EruCircuit EruCircuit::load(EruDataView data) {
+    auto parts = _EruHazmat::binobjlist_view(data);
+    if (parts.size() != 5 || parts[0].str() != circuit_magic ||
+            parts[4].length % 13 != 0)
+        throw std::runtime_error("malformed circuit");
+    EruCircuit res;
+    for (auto n : get_u32s(parts[1])) {
+        res._inputs.push_back(n);
+        res._input_bits += n;
+    }
+    for (auto n : get_u32s(parts[2]))
+        res._outputs.push_back(n);
+    res._results = get_u32s(parts[3]);
+    size_t n = parts[4].length / 13;
+    res._nodes.resize(n);
+    uint32_t ops[3];
+    for (size_t x = 0; x < n; x++) {
+        const char *p = parts[4].data + 13 * x;
+        EruGateNode &node = res._nodes[x];
+        node = {(uint8_t)*p, get_u32(p + 1), get_u32(p + 5), get_u32(p + 9)};
+        bool ok = node.op <= ERU_GATE_MUX;
+        if (node.op == ERU_GATE_INPUT)
+            ok = node.a < res._input_bits;
+        for (int i = 0, k = gate_operands(node, ops); i < k; i++)
+            ok = ok && ops[i] < x;
+        // unused operands are looked up all the same, keep them in range
+        ok = ok && (node.op <= ERU_GATE_CONST ||
+            std::max(node.a, std::max(node.b, node.c)) < n);
+        if (!ok)
+            throw std::runtime_error("malformed circuit");
+    }
+    size_t out_bits = 0;
+    for (auto w : res._outputs)
+        out_bits += w;
+    if (out_bits != res._results.size())
+        throw std::runtime_error("malformed circuit");
+    for (auto r : res._results)
+        if (r >= n)
+            throw std::runtime_error("malformed circuit");
+    return res;
+}
+
+EruProgram::EruProgram(EruCircuit &&circuit) :
+    circuit(std::move(circuit)), schedule(this->circuit.schedule()) {}
+
+/// Cache files := binobjlist [magic, version, EruCircuit::save()].
+static const char *cache_magic = "eru/circuit-cache/1";
+
+EruCircuitCache::EruCircuitCache(size_t capacity, const std::string &dir,
+        const std::string &version) :
+    _capacity(capacity), _dir(dir), _version(version) {}
+
+void EruCircuitCache::configure(size_t capacity, const std::string &dir,
+        const std::string &version) {
+    std::lock_guard<std::mutex> guard(_lock);
+    _capacity = capacity;
+    _dir = dir;
+    _version = version;
+    while (_lru.size() > _capacity) {
+        _index.erase(_lru.back().first);
+        _lru.pop_back();
+    }
+}
+
+std::string EruCircuitCache::_path(const std::string &name) const {
+    if (_dir.empty())
+        return "";
+    std::string file = name;
+    for (auto &c : file) {
+        if (c == '/')
+            c = '.';
+        else if (!isalnum((unsigned char)c) && c != '-' && c != '_' &&
+                c != '.')
+            throw std::runtime_error("invalid circuit name");
+    }
+    return _dir + "/" + file + ".circuit";
+}
+
+void EruCircuitCache::_insert(const std::string &name,
+        std::shared_ptr<const EruProgram> program) {
+    if (_capacity == 0)
+        return;
+    auto it = _index.find(name);
+    if (it != _index.end())
+        _lru.erase(it->second);
+    _lru.push_front(_Entry(name, program));
+    _index[name] = _lru.begin();
+    if (_lru.size() > _capacity) {
+        _index.erase(_lru.back().first);
+        _lru.pop_back();
+    }
+}
+
+std::shared_ptr<const EruProgram> EruCircuitCache::get(
+        const std::string &name, Builder build) {
+    std::string path, version;
+    {
+        std::lock_guard<std::mutex> guard(_lock);
+        auto it = _index.find(name);
+        if (it != _index.end()) {
+            _lru.splice(_lru.begin(), _lru, it->second);
+            _stats.hits += 1;
+            return it->second->second;
+        }
+        path = _path(name);
+        version = _version;
+    }
+    // load or build outside the lock, a broken or outdated file is built
+    // over
+    std::shared_ptr<const EruProgram> program;
+    bool loaded = false;
+    if (!path.empty()) {
+        std::ifstream file(path, std::ios::binary);
+        if (file) {
+            std::stringstream stream;
+            stream << file.rdbuf();
+            EruData data = _EruHazmat::dump_sstream(stream);
+            try {
+                auto parts = _EruHazmat::binobjlist_view(data);
+                if (parts.size() == 3 && parts[0].str() == cache_magic &&
+                        parts[1].str() == version) {
+                    program = std::make_shared<const EruProgram>(
+                        EruCircuit::load(parts[2]));
+                    loaded = true;
+                }
+            } catch (std::runtime_error &err) {}
+        }
+    }
+    if (!loaded) {
+        EruCircuit circuit = build();
+        circuit.optimize();
+        if (!path.empty()) {
+            // write aside and rename, so that readers never see half a file;
+            // the name is unique to this thread of this process, as others
+            // may share the directory
+            std::string tmp = path + "." + std::to_string(getpid()) + "." +
+                std::to_string(std::hash<std::thread::id>()(
+                std::this_thread::get_id()));
+            std::ofstream file(tmp, std::ios::binary | std::ios::trunc);
+            EruData data = _EruHazmat::binobjlist_encode({cache_magic,
+                version, circuit.save()});
+            file.write(data.c_str(), data.length());
+            file.close();
+            if (!file || std::rename(tmp.c_str(), path.c_str()) != 0)
+                std::remove(tmp.c_str());
+        }
+        program = std::make_shared<const EruProgram>(std::move(circuit));
+    }
+    std::lock_guard<std::mutex> guard(_lock);
+    if (loaded)
+        _stats.loads += 1;
+    else
+        _stats.builds += 1;
+    _insert(name, program);
+    return program;
+}
+
+EruCircuitCacheStats EruCircuitCache::stats() {
+    std::lock_guard<std::mutex> guard(_lock);
+    return _stats;
+}
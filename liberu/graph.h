@@ -0,0 +1,688 @@
+
+// graph.h: gate graphs recorded from computations, and their optimizer
+// MIT License
+//
+// Copyright (c) 2021 Geoffrey Tang
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+
+#ifndef _LIBERU_GRAPH_H
+#define _LIBERU_GRAPH_H
+
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "circuit.h"
+#include "context.h"
+
+
+/// Operation of a gate graph node, one per EruEnv primitive.
+enum EruGateOp {
+    ERU_GATE_INPUT = 0,  // input bit a
+    ERU_GATE_CONST = 1,  // constant a
+    ERU_GATE_COPY = 2,  // a
+    ERU_GATE_NOT = 3,  // !a
+    ERU_GATE_AND = 4,
+    ERU_GATE_OR = 5,
+    ERU_GATE_NAND = 6,
+    ERU_GATE_NOR = 7,
+    ERU_GATE_XOR = 8,
+    ERU_GATE_XNOR = 9,
+    ERU_GATE_ANDYN = 10,  // a && !b
+    ERU_GATE_ANDNY = 11,  // !a && b
+    ERU_GATE_ORYN = 12,  // a || !b
+    ERU_GATE_ORNY = 13,  // !a || b
+    ERU_GATE_MUX = 14,  // a ? b : c
+};
+
+/// Optimization passes of EruCircuit::optimize.
+enum EruCircuitPass {
+    ERU_PASS_CONST = 1,  // constant propagation, also of equal operands
+    ERU_PASS_NOT = 2,  // NOT absorbed by the gates reading it
+    ERU_PASS_CSE = 4,  // common subexpression elimination
+    ERU_PASS_COPY = 8,  // copy elision
+    ERU_PASS_DEAD = 16,  // dead gate elimination
+    ERU_PASS_ALL = 31,
+};
+
+/// One node: op applied to the values of earlier nodes a, b and c.
+struct EruGateNode {
+    uint8_t op;
+    uint32_t a, b, c;
+    bool operator == (const EruGateNode &other) const {
+        return op == other.op && a == other.a && b == other.b &&
+            c == other.c;
+    }
+};
+
+/// Size of a circuit before and after EruCircuit::optimize.
+struct EruCircuitStats {
+    size_t gates_before = 0;
+    size_t gates_after = 0;
+    size_t bootstraps_before = 0;
+    size_t bootstraps_after = 0;
+};
+
+/// Evaluation order of a circuit and the ciphertext slot of every node, see
+/// EruCircuit::schedule. Slots are reused once their value is dead, so a
+/// run needs `slots` ciphertexts however many gates the circuit has.
+struct EruSchedule {
+    std::vector<uint32_t> order;  // non-input nodes in evaluation order
+    std::vector<size_t> steps;  // order[steps[i], steps[i + 1]) run at once
+    std::vector<uint32_t> slot;  // per node, unused for inputs
+    size_t slots = 0;  // peak of live ciphertexts
+};
+
+/// THERE BE DRAGONS!
+namespace _EruHazmat {
+    /// Bootstraps TFHE spends on one node of op.
+    size_t gate_bootstraps(uint8_t op);
+
+    /// The two-input gate whose truth table is t, bit (a << 1 | b) being
+    /// its result on a and b, or ERU_GATE_INPUT if t is a constant or
+    /// depends on one operand only.
+    uint8_t gate_of_table(uint8_t t);
+
+    /// r = op(a, b, c) on env.
+    template <typename _T>
+    void gate_apply(EruEnv<_T> *env, uint8_t op, _T *r, const _T *a,
+            const _T *b, const _T *c) {
+        switch (op) {
+            case ERU_GATE_COPY: env->ldup(r, a); break;
+            case ERU_GATE_NOT: env->lnot(r, a); break;
+            case ERU_GATE_AND: env->land(r, a, b); break;
+            case ERU_GATE_OR: env->lor(r, a, b); break;
+            case ERU_GATE_NAND: env->lnand(r, a, b); break;
+            case ERU_GATE_NOR: env->lnor(r, a, b); break;
+            case ERU_GATE_XOR: env->lxor(r, a, b); break;
+            case ERU_GATE_XNOR: env->lxnor(r, a, b); break;
+            case ERU_GATE_ANDYN: env->landyn(r, a, b); break;
+            case ERU_GATE_ANDNY: env->landny(r, a, b); break;
+            case ERU_GATE_ORYN: env->loryn(r, a, b); break;
+            case ERU_GATE_ORNY: env->lorny(r, a, b); break;
+            case ERU_GATE_MUX: env->lifelse(r, a, b, c); break;
+            default: throw std::runtime_error("invalid gate");
+        }
+    }
+}
+
+/// Gate graph in SSA form: every node is computed once, from nodes before
+/// it, so the node list is in topological order. Inputs and outputs are
+/// groups of bits, in the order they were declared. Record one with
+/// EruRecorder, optimize it, then run it on fresh inputs.
+class EruCircuit {
+private:
+    std::vector<EruGateNode> _nodes;
+    std::vector<size_t> _inputs;  // bits per input group
+    std::vector<size_t> _outputs;  // bits per output group
+    std::vector<uint32_t> _results;  // node of every output bit
+    size_t _input_bits = 0;
+    void _rewrite(unsigned passes);
+    void _sweep();
+public:
+    /// Append a node, returns its id. Operands must already exist.
+    uint32_t _add(uint8_t op, uint32_t a = 0, uint32_t b = 0,
+        uint32_t c = 0);
+    /// Append an input group of n bits, returns the node of its first bit.
+    uint32_t _add_input(size_t n);
+    /// Append an output group made of the given nodes.
+    void _add_output(const std::vector<uint32_t> &nodes);
+    const std::vector<EruGateNode>& nodes() const;
+    const std::vector<size_t>& inputs() const;
+    const std::vector<size_t>& outputs() const;
+    const std::vector<uint32_t>& results() const;
+    /// Nodes that are not inputs.
+    size_t gates() const;
+    /// Bootstraps of one run under TFHE.
+    size_t bootstraps() const;
+    /// Run the passes until the circuit stops changing.
+    EruCircuitStats optimize(unsigned passes = ERU_PASS_ALL);
+    /// Order the gates in steps of up to width independent gates, 0 for
+    /// one per core, and give every value a slot that is reused after its
+    /// last read. Among ready gates, those that end the life of the most
+    /// operands go first, then the most recently readied, which walks the
+    /// graph depth first and keeps few values live. Gates that end no life
+    /// only join a step while fewer than max_live values are live, 0 for
+    /// 8 * width.
+    EruSchedule schedule(size_t width = 0, size_t max_live = 0) const;
+    /// Order the gates by level, every gate one step after the last of its
+    /// operands, so each step is as wide as the circuit allows. Slots are
+    /// reused as in schedule(). Suits wide, shallow netlists, where it
+    /// keeps every core busy with no ordering to work out.
+    EruSchedule levels() const;
+    /// Serialize, and parse what save() wrote. load() checks the graph
+    /// throughout and throws on anything malformed.
+    EruData save() const;
+    static EruCircuit load(EruDataView data);
+    /// Evaluate on ctx, one step of the schedule at a time with gate_for.
+    /// inputs[i] holds the bits of input group i, outputs[i] receives
+    /// output group i. Outputs must not overlap inputs.
+    template <typename _T>
+    void run(EruContext<_T> *ctx, const std::vector<const _T*> &inputs,
+            const std::vector<_T*> &outputs,
+            const EruSchedule &schedule) const {
+        if (inputs.size() != _inputs.size() ||
+                outputs.size() != _outputs.size())
+            throw std::runtime_error("circuit arity mismatch");
+        if (schedule.slot.size() != _nodes.size())
+            throw std::runtime_error("schedule of another circuit");
+        auto env = ctx->_env();
+        // inputs are read in place, other nodes live in their slots
+        std::vector<const _T*> in(_input_bits), at(_nodes.size());
+        for (size_t g = 0, k = 0; g < _inputs.size(); g++)
+            for (size_t i = 0; i < _inputs[g]; i++)
+                in[k++] = inputs[g] + i;
+        EruBits<_T> slots = ctx->allocate(std::max<size_t>(1,
+            schedule.slots));
+        for (size_t x = 0; x < _nodes.size(); x++)
+            at[x] = _nodes[x].op == ERU_GATE_INPUT ? in[_nodes[x].a] :
+                slots.ptr() + schedule.slot[x];
+        for (size_t s = 0; s + 1 < schedule.steps.size(); s++) {
+            size_t lo = schedule.steps[s], hi = schedule.steps[s + 1];
+            _EruHazmat::gate_for<_T>(hi - lo, [&](size_t k) {
+                uint32_t x = schedule.order[lo + k];
+                auto &node = _nodes[x];
+                _T *r = slots.ptr() + schedule.slot[x];
+                if (node.op == ERU_GATE_CONST)
+                    env->lval(r, node.a != 0);
+                else
+                    _EruHazmat::gate_apply(env, node.op, r, at[node.a],
+                        at[node.b], at[node.c]);
+            });
+        }
+        for (size_t g = 0, k = 0; g < _outputs.size(); g++)
+            for (size_t i = 0; i < _outputs[g]; i++)
+                env->ldup(outputs[g] + i, at[_results[k++]]);
+        ctx->free(slots);
+    }
+    template <typename _T>
+    void run(EruContext<_T> *ctx, const std::vector<const _T*> &inputs,
+            const std::vector<_T*> &outputs) const {
+        run(ctx, inputs, outputs, schedule());
+    }
+    /// Same on whole blocks, which must match the group widths. Named
+    /// apart from run(), as braced lists of two pointers would also match
+    /// the iterator-pair constructor of a vector of blocks.
+    template <typename _T>
+    void run_blocks(EruContext<_T> *ctx, std::vector<EruBits<_T>> inputs,
+            std::vector<EruBits<_T>> outputs,
+            const EruSchedule &schedule) const {
+        std::vector<const _T*> in;
+        std::vector<_T*> out;
+        for (size_t g = 0; g < inputs.size(); g++) {
+            if (g < _inputs.size() && inputs[g]._size() != _inputs[g])
+                throw std::runtime_error("circuit input width mismatch");
+            in.push_back(inputs[g].ptr());
+        }
+        for (size_t g = 0; g < outputs.size(); g++) {
+            if (g < _outputs.size() && outputs[g]._size() != _outputs[g])
+                throw std::runtime_error("circuit output width mismatch");
+            out.push_back(outputs[g].ptr());
+        }
+        run(ctx, in, out, schedule);
+    }
+};
+
+/// A circuit compiled for replay: optimized, with its schedule worked out
+/// once for all runs.
+struct EruProgram {
+    EruCircuit circuit;
+    EruSchedule schedule;
+    EruProgram(EruCircuit &&circuit);
+    template <typename _T>
+    void run(EruContext<_T> *ctx, const std::vector<const _T*> &inputs,
+            const std::vector<_T*> &outputs) const {
+        circuit.run(ctx, inputs, outputs, schedule);
+    }
+};
+
+#ifndef ERU_REVISION
+#define ERU_REVISION "unknown"
+#endif
+
+/// Identifies the code that records circuits: the library revision and the
+/// build time of the file expanding it, so that a rebuild cannot replay
+/// circuits recorded by older arithmetic.
+#define ERU_BUILD_STAMP (ERU_REVISION " " __DATE__ " " __TIME__)
+
+/// Hits and misses of an EruCircuitCache since it was made.
+struct EruCircuitCacheStats {
+    size_t hits = 0;  // found in memory
+    size_t loads = 0;  // read from the cache directory
+    size_t builds = 0;  // recorded and optimized from scratch
+};
+
+/// Compiled circuits by name, such as "mul/64". Up to capacity programs
+/// stay in memory, least recently used dropped first, and with a directory
+/// set every compiled circuit is also kept there as <name>.circuit, with
+/// '/' in names turned into '.', for later processes to load instead of
+/// recording it again. Concurrent misses on one name each build it, the
+/// last one wins. Files carry the version of the cache that wrote them,
+/// by default the build stamp of the code creating the cache; those of
+/// another version count as misses and are written over.
+class EruCircuitCache {
+public:
+    typedef std::function<EruCircuit()> Builder;
+private:
+    typedef std::pair<std::string, std::shared_ptr<const EruProgram>> _Entry;
+    size_t _capacity;
+    std::string _dir;
+    std::string _version;
+    std::list<_Entry> _lru;  // most recently used first
+    std::unordered_map<std::string, std::list<_Entry>::iterator> _index;
+    EruCircuitCacheStats _stats;
+    std::mutex _lock;
+    std::string _path(const std::string &name) const;
+    void _insert(const std::string &name,
+        std::shared_ptr<const EruProgram> program);
+public:
+    EruCircuitCache(size_t capacity = 16, const std::string &dir = "",
+        const std::string &version = ERU_BUILD_STAMP);
+    EruCircuitCache(const EruCircuitCache &other) = delete;
+    /// Resize the memory cache and move to another directory, "" for none.
+    void configure(size_t capacity, const std::string &dir = "",
+        const std::string &version = ERU_BUILD_STAMP);
+    /// The program called name, built with build() if neither memory nor
+    /// the directory holds it.
+    std::shared_ptr<const EruProgram> get(const std::string &name,
+        Builder build);
+    EruCircuitCacheStats stats();
+};
+
+/// Work done by the last EruIncremental::evaluate.
+struct EruIncrementalStats {
+    size_t gates = 0;  // gates evaluated, dirty or recomputed
+    size_t bootstraps = 0;
+    size_t levels = 0;  // parallel steps they took
+};
+
+/// Evaluates a circuit over and over as some of its inputs change. Inputs
+/// are copied in with set(), which marks them changed; evaluate() then
+/// recomputes only the gates downstream of changes, reading the other
+/// values from the previous evaluation. Outputs are always kept. Of the
+/// other gates, at most max_retained keep their ciphertext between
+/// evaluations, those with the most bootstraps behind them first; a clean
+/// value that was not kept is recomputed from its inputs when a dirty gate
+/// reads it.
+///
+///     EruIncremental<_T> inc(&ctx, circuit);
+///     inc.set(0, a._ptr()); inc.set(1, b._ptr());
+///     inc.evaluate({c._ptr()});  // everything
+///     inc.set(1, d._ptr());
+///     inc.evaluate({c._ptr()});  // only what depends on input 1
+template <typename _T>
+class EruIncremental {
+private:
+    EruContext<_T> *_ctx;
+    EruCircuit _circuit;
+    std::vector<size_t> _first;  // first input bit of every group
+    std::vector<bool> _given;  // per group, set at least once
+    std::vector<bool> _changed;  // per input bit, since last evaluate
+    std::vector<bool> _kept;  // per node, ciphertext kept in _store
+    std::vector<bool> _valid;  // per node, kept and up to date
+    std::vector<uint32_t> _home;  // per kept node or input, index in _store
+    EruBits<_T> _store;
+    size_t _retained = 0;
+    EruIncrementalStats _stats;
+    /// Bootstraps to compute each node from the inputs, shared operands
+    /// counted once per reader and capped to stay finite.
+    std::vector<uint64_t> _costs() const {
+        auto &nodes = _circuit.nodes();
+        std::vector<uint64_t> cost(nodes.size(), 0);
+        for (size_t x = 0; x < nodes.size(); x++) {
+            auto &node = nodes[x];
+            if (node.op <= ERU_GATE_CONST)
+                continue;
+            uint64_t c = _EruHazmat::gate_bootstraps(node.op) + cost[node.a];
+            if (node.op >= ERU_GATE_AND)
+                c += cost[node.b];
+            if (node.op == ERU_GATE_MUX)
+                c += cost[node.c];
+            cost[x] = std::min<uint64_t>(c, (uint64_t)1 << 48);
+        }
+        return cost;
+    }
+public:
+    EruIncremental(EruContext<_T> *ctx, const EruCircuit &circuit,
+            size_t max_retained = SIZE_MAX) : _ctx(ctx), _circuit(circuit),
+            _given(circuit.inputs().size(), false) {
+        for (size_t g = 0, k = 0; g < _circuit.inputs().size(); g++) {
+            _first.push_back(k);
+            k += _circuit.inputs()[g];
+        }
+        size_t bits = 0;
+        for (auto w : _circuit.inputs())
+            bits += w;
+        _changed.assign(bits, true);
+        retain(max_retained);
+    }
+    EruIncremental(const EruIncremental<_T> &other) = delete;
+    ~EruIncremental() {
+        _ctx->free(_store);
+    }
+    /// Change how many gates besides the outputs keep their ciphertext.
+    /// Values no longer kept are dropped, the rest stay valid.
+    void retain(size_t max_retained) {
+        auto &nodes = _circuit.nodes();
+        size_t n = nodes.size(), bits = _changed.size();
+        std::vector<bool> kept(n, false);
+        for (auto r : _circuit.results())
+            kept[r] = nodes[r].op != ERU_GATE_INPUT;
+        std::vector<uint32_t> order;
+        for (size_t x = 0; x < n; x++)
+            if (nodes[x].op != ERU_GATE_INPUT && !kept[x])
+                order.push_back(x);
+        auto cost = _costs();
+        std::stable_sort(order.begin(), order.end(),
+            [&](uint32_t x, uint32_t y) { return cost[x] > cost[y]; });
+        _retained = std::min(order.size(), max_retained);
+        for (size_t i = 0; i < _retained; i++)
+            kept[order[i]] = true;
+        // inputs come first in the store, then kept nodes in order
+        std::vector<uint32_t> home(n, 0);
+        size_t count = bits;
+        for (size_t x = 0; x < n; x++) {
+            if (nodes[x].op == ERU_GATE_INPUT)
+                home[x] = nodes[x].a;
+            else if (kept[x])
+                home[x] = count++;
+        }
+        EruBits<_T> store = _ctx->allocate(std::max<size_t>(1, count));
+        auto env = _ctx->_env();
+        std::vector<bool> valid(n, false);
+        if (!_home.empty()) {
+            for (size_t i = 0; i < bits; i++)
+                env->ldup(store.ptr() + i, _store.ptr() + i);
+            for (size_t x = 0; x < n; x++)
+                if (kept[x] && _valid[x]) {
+                    env->ldup(store.ptr() + home[x],
+                        _store.ptr() + _home[x]);
+                    valid[x] = true;
+                }
+            _ctx->free(_store);
+        }
+        _store = store;
+        _home.swap(home);
+        _kept.swap(kept);
+        _valid.swap(valid);
+    }
+    /// Gates besides the outputs that keep their ciphertext.
+    size_t retained() const {
+        return _retained;
+    }
+    /// Copy in input group g and mark it changed.
+    void set(size_t g, const _T *bits) {
+        if (g >= _first.size())
+            throw std::runtime_error("no such input");
+        set(g, 0, bits, _circuit.inputs()[g]);
+    }
+    /// Copy in n bits of input group g from bit `offset` on, and mark only
+    /// those changed. Every group must have been set as a whole first.
+    void set(size_t g, size_t offset, const _T *bits, size_t n) {
+        if (g >= _first.size() || offset + n > _circuit.inputs()[g])
+            throw std::runtime_error("no such input");
+        if (n < _circuit.inputs()[g] && !_given[g])
+            throw std::runtime_error("input not set");
+        auto env = _ctx->_env();
+        for (size_t i = 0; i < n; i++) {
+            env->ldup(_store.ptr() + _first[g] + offset + i, bits + i);
+            _changed[_first[g] + offset + i] = true;
+        }
+        _given[g] = true;
+    }
+    /// Bring the outputs up to date with the inputs set so far, and copy
+    /// output group i into outputs[i].
+    void evaluate(const std::vector<_T*> &outputs) {
+        auto &nodes = _circuit.nodes();
+        auto &results = _circuit.results();
+        if (outputs.size() != _circuit.outputs().size())
+            throw std::runtime_error("circuit arity mismatch");
+        for (size_t g = 0; g < _given.size(); g++)
+            if (!_given[g])
+                throw std::runtime_error("input not set");
+        size_t n = nodes.size();
+        // dirty: downstream of a changed input; need: must be computed
+        std::vector<bool> dirty(n, false), need(n, false);
+        for (size_t x = 0; x < n; x++) {
+            auto &node = nodes[x];
+            if (node.op == ERU_GATE_INPUT)
+                dirty[x] = _changed[node.a];
+            else if (node.op != ERU_GATE_CONST)
+                dirty[x] = dirty[node.a] ||
+                    (node.op >= ERU_GATE_AND && dirty[node.b]) ||
+                    (node.op == ERU_GATE_MUX && dirty[node.c]);
+        }
+        auto stale = [&](uint32_t x) {
+            return nodes[x].op != ERU_GATE_INPUT && (dirty[x] || !_valid[x]);
+        };
+        for (auto r : results)
+            need[r] = stale(r);
+        std::vector<uint32_t> level(n, 0), temp(n, 0);
+        size_t temps = 0, levels = 0;
+        for (size_t x = n; x-- > 0; ) {
+            auto &node = nodes[x];
+            if (!need[x] || node.op <= ERU_GATE_CONST)
+                continue;
+            need[node.a] = need[node.a] || stale(node.a);
+            if (node.op >= ERU_GATE_AND)
+                need[node.b] = need[node.b] || stale(node.b);
+            if (node.op == ERU_GATE_MUX)
+                need[node.c] = need[node.c] || stale(node.c);
+        }
+        _stats = EruIncrementalStats();
+        for (size_t x = 0; x < n; x++) {
+            auto &node = nodes[x];
+            if (!need[x])
+                continue;
+            if (!_kept[x])
+                temp[x] = temps++;
+            if (node.op != ERU_GATE_CONST) {
+                uint32_t l = need[node.a] ? level[node.a] : 0;
+                if (node.op >= ERU_GATE_AND && need[node.b])
+                    l = std::max(l, level[node.b]);
+                if (node.op == ERU_GATE_MUX && need[node.c])
+                    l = std::max(l, level[node.c]);
+                level[x] = l + 1;
+            } else {
+                level[x] = 1;
+            }
+            levels = std::max<size_t>(levels, level[x]);
+            _stats.gates += 1;
+            _stats.bootstraps += _EruHazmat::gate_bootstraps(node.op);
+        }
+        _stats.levels = levels;
+        // values not kept live in temp until the outputs are copied out
+        EruBits<_T> tmp = _ctx->allocate(std::max<size_t>(1, temps));
+        auto at = [&](uint32_t x) -> _T* {
+            if (nodes[x].op == ERU_GATE_INPUT || _kept[x])
+                return _store.ptr() + _home[x];
+            return tmp.ptr() + temp[x];
+        };
+        std::vector<std::vector<uint32_t>> steps(levels + 1);
+        for (size_t x = 0; x < n; x++)
+            if (need[x])
+                steps[level[x]].push_back(x);
+        auto env = _ctx->_env();
+        for (auto &step : steps)
+            _EruHazmat::gate_for<_T>(step.size(), [&](size_t k) {
+                uint32_t x = step[k];
+                auto &node = nodes[x];
+                if (node.op == ERU_GATE_CONST)
+                    env->lval(at(x), node.a != 0);
+                else
+                    _EruHazmat::gate_apply(env, node.op, at(x), at(node.a),
+                        at(node.b), at(node.c));
+            });
+        for (size_t x = 0; x < n; x++)
+            if (need[x] && _kept[x])
+                _valid[x] = true;
+        for (size_t g = 0, k = 0; g < outputs.size(); g++)
+            for (size_t i = 0; i < _circuit.outputs()[g]; i++)
+                env->ldup(outputs[g] + i, at(results[k++]));
+        _ctx->free(tmp);
+        std::fill(_changed.begin(), _changed.end(), false);
+    }
+    /// What the last evaluate() did.
+    EruIncrementalStats stats() const {
+        return _stats;
+    }
+};
+
+/// Records the gates of a computation on ctx into an EruCircuit instead of
+/// evaluating them. While alive, every gate on ctx goes to the recorder;
+/// each written bit becomes a new node, and reading a bit that was neither
+/// declared an input nor written throws. Encryption, decryption and
+/// serialization throw as well, since no ciphertexts are computed.
+///
+///     EruRecorder<_T> rec(&ctx);
+///     rec.input(a); rec.input(b);
+///     auto c = a * b;
+///     rec.output(c);
+///     EruCircuit circuit = rec.finish();
+template <typename _T>
+class EruRecorder : public EruEnv<_T> {
+private:
+    EruContext<_T> *_ctx;
+    EruEnv<_T> *_inner;
+    EruEnv<_T> *_previous;  // redirection to restore when done
+    EruCircuit _circuit;
+    std::unordered_map<const _T*, uint32_t> _at;  // bit > current node
+    std::mutex _lock;  // gates arrive from gate_for's threads
+    uint32_t _src(const _T *a) {
+        auto it = _at.find(a);
+        if (it == _at.end())
+            throw std::runtime_error("recorded gate reads an unknown bit");
+        return it->second;
+    }
+    void _gate(uint8_t op, _T *r, const _T *a, const _T *b = nullptr,
+            const _T *c = nullptr) {
+        std::lock_guard<std::mutex> guard(_lock);
+        uint32_t x = _src(a);
+        uint32_t y = b != nullptr ? _src(b) : 0;
+        uint32_t z = c != nullptr ? _src(c) : 0;
+        _at[r] = _circuit._add(op, x, y, z);
+    }
+    static void _refuse() {
+        throw std::runtime_error("no ciphertexts while recording");
+    }
+public:
+    EruRecorder(EruContext<_T> *ctx) : _ctx(ctx), _inner(ctx->_env()) {
+        _previous = _ctx->_redirect(this);
+    }
+    EruRecorder(const EruRecorder<_T> &other) = delete;
+    ~EruRecorder() {
+        if (_ctx != nullptr)
+            _ctx->_redirect(_previous);
+    }
+    /// Declare n bits at ptr the next input group.
+    void input(const _T *ptr, size_t n) {
+        std::lock_guard<std::mutex> guard(_lock);
+        uint32_t first = _circuit._add_input(n);
+        for (size_t i = 0; i < n; i++)
+            _at[ptr + i] = first + i;
+    }
+    template <typename _V>
+    void input(const _V &value) {
+        input(value._ptr(), value._width());
+    }
+    /// Declare the current value of n bits at ptr the next output group.
+    void output(const _T *ptr, size_t n) {
+        std::lock_guard<std::mutex> guard(_lock);
+        std::vector<uint32_t> nodes(n);
+        for (size_t i = 0; i < n; i++)
+            nodes[i] = _src(ptr + i);
+        _circuit._add_output(nodes);
+    }
+    template <typename _V>
+    void output(const _V &value) {
+        output(value._ptr(), value._width());
+    }
+    /// Stop recording and hand out the circuit.
+    EruCircuit finish() {
+        if (_ctx != nullptr)
+            _ctx->_redirect(_previous);
+        _ctx = nullptr;
+        return std::move(_circuit);
+    }
+    _T* malloc(size_t size) { return _inner->malloc(size); }
+    void mfree(_T *ptr, size_t size) { _inner->mfree(ptr, size); }
+    void lval(_T *r, const bool a) {
+        std::lock_guard<std::mutex> guard(_lock);
+        _at[r] = _circuit._add(ERU_GATE_CONST, a);
+    }
+    void ldup(_T *r, const _T *a) { _gate(ERU_GATE_COPY, r, a); }
+    void lnot(_T *r, const _T *a) { _gate(ERU_GATE_NOT, r, a); }
+    void land(_T *r, const _T *a, const _T *b) {
+        _gate(ERU_GATE_AND, r, a, b);
+    }
+    void lor(_T *r, const _T *a, const _T *b) {
+        _gate(ERU_GATE_OR, r, a, b);
+    }
+    void lnand(_T *r, const _T *a, const _T *b) {
+        _gate(ERU_GATE_NAND, r, a, b);
+    }
+    void lnor(_T *r, const _T *a, const _T *b) {
+        _gate(ERU_GATE_NOR, r, a, b);
+    }
+    void lxor(_T *r, const _T *a, const _T *b) {
+        _gate(ERU_GATE_XOR, r, a, b);
+    }
+    void lxnor(_T *r, const _T *a, const _T *b) {
+        _gate(ERU_GATE_XNOR, r, a, b);
+    }
+    void landyn(_T *r, const _T *a, const _T *b) {
+        _gate(ERU_GATE_ANDYN, r, a, b);
+    }
+    void landny(_T *r, const _T *a, const _T *b) {
+        _gate(ERU_GATE_ANDNY, r, a, b);
+    }
+    void loryn(_T *r, const _T *a, const _T *b) {
+        _gate(ERU_GATE_ORYN, r, a, b);
+    }
+    void lorny(_T *r, const _T *a, const _T *b) {
+        _gate(ERU_GATE_ORNY, r, a, b);
+    }
+    void lifelse(_T *r, const _T *a, const _T *if_a, const _T *if_not_a) {
+        _gate(ERU_GATE_MUX, r, a, if_a, if_not_a);
+    }
+    void encrypt(_T *r, const bool a) { _refuse(); }
+    bool decrypt(const _T *a) { _refuse(); return false; }
+    EruData bexport(_T *a) { _refuse(); return ""; }
+    void bimport(_T *r, EruDataView a) { _refuse(); }
+    size_t bsize() { return _inner->bsize(); }
+    void bstore(const _T *a, char *out) { _refuse(); }
+    void bload(_T *r, const char *in) { _refuse(); }
+    EruData bparams() { return _inner->bparams(); }
+    EruData btag() { return _inner->btag(); }
+    EruData bexport_seeded(_T *r, size_t n) { _refuse(); return ""; }
+    bool bimport_seeded(_T *r, size_t n, EruDataView a) {
+        _refuse();
+        return false;
+    }
+};
+
+#endif  // _LIBERU_GRAPH_H
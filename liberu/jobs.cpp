@@ -0,0 +1,242 @@
+
+// jobs.cpp: asynchronous submit / poll interface for service requests
+// MIT License
+//
+// Copyright (c) 2021 Geoffrey Tang
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+
+#include <chrono>
+#include <climits>
+
+#include "jobs.h"
+#include "services.h"
+
+
+// Job handle
+
+EruJob::EruJob(EruData &input, Callback callback) : _state(ERU_JOB_QUEUED),
+        _callback(callback) {
+    _input.swap(input);
+}
+
+void EruJob::_finish(EruJobState expect, EruJobState state,
+        EruData &output) {
+    Callback callback;
+    {
+        std::unique_lock<std::mutex> guard(_lock);
+        if (_state != expect)
+            return;
+        _state = state;
+        _output.swap(output);
+        _input.clear();
+        callback.swap(_callback);  // also breaks reference cycles
+    }
+    _cv.notify_all();
+    if (callback)
+        callback(*this);
+}
+
+EruJobState EruJob::state() {
+    std::unique_lock<std::mutex> guard(_lock);
+    return _state;
+}
+
+bool EruJob::finished() {
+    return state() >= ERU_JOB_DONE;
+}
+
+bool EruJob::wait(int64_t timeout_ms) {
+    std::unique_lock<std::mutex> guard(_lock);
+    auto done = [this] { return _state >= ERU_JOB_DONE; };
+    if (timeout_ms < 0) {
+        _cv.wait(guard, done);
+        return true;
+    }
+    return _cv.wait_for(guard, std::chrono::milliseconds(timeout_ms), done);
+}
+
+void EruJob::cancel() {
+    _monitor.cancel = true;
+    EruData empty;
+    _finish(ERU_JOB_QUEUED, ERU_JOB_CANCELLED, empty);
+}
+
+uint64_t EruJob::progress() {
+    return _monitor.gates;
+}
+
+const EruData& EruJob::result() {
+    std::unique_lock<std::mutex> guard(_lock);
+    if (_state != ERU_JOB_DONE)
+        throw std::runtime_error("job has no result");
+    return _output;
+}
+
+const EruData& EruJob::error() {
+    std::unique_lock<std::mutex> guard(_lock);
+    if (_state != ERU_JOB_FAILED)
+        throw std::runtime_error("job has not failed");
+    return _output;
+}
+
+// Job queue
+
+EruJobQueue::EruJobQueue(size_t workers, size_t max_queue) :
+    EruJobQueue(workers, max_queue, provide_service_s) {}
+
+EruJobQueue::EruJobQueue(size_t workers, size_t max_queue, Handler handler) :
+        _handler(handler) {
+    _pool = std::unique_ptr<EruThreadPool>(new EruThreadPool(
+        workers, max_queue));
+}
+
+EruJobQueue::~EruJobQueue() {
+    _pool.reset();
+}
+
+std::shared_ptr<EruJob> EruJobQueue::submit(EruData input,
+        EruJob::Callback callback) {
+    auto job = std::make_shared<EruJob>(input, callback);
+    submit(job);
+    return job;
+}
+
+void EruJobQueue::submit(std::shared_ptr<EruJob> job) {
+    Handler handler = _handler;
+    bool queued = _pool->try_submit([job, handler] {
+        {
+            std::unique_lock<std::mutex> guard(job->_lock);
+            if (job->_state != ERU_JOB_QUEUED)
+                return;  // cancelled before it started
+            job->_state = ERU_JOB_RUNNING;
+        }
+        job->_cv.notify_all();
+        EruData output;
+        EruJobState state = ERU_JOB_DONE;
+        _EruHazmat::job_monitor = &job->_monitor;
+        try {
+            output = handler(job->_input);
+        } catch (EruCancelled &err) {
+            output.clear();
+            state = ERU_JOB_CANCELLED;
+        } catch (std::exception &err) {
+            output = err.what();
+            state = ERU_JOB_FAILED;
+        } catch (...) {
+            output = "unknown error";
+            state = ERU_JOB_FAILED;
+        }
+        _EruHazmat::job_monitor = nullptr;
+        job->_finish(ERU_JOB_RUNNING, state, output);
+    });
+    if (!queued)
+        throw std::runtime_error("job queue full");
+}
+
+// C interface
+
+/// The C handle is shared by the caller and the pending completion
+/// callback, and is freed when both have let go of it.
+struct eru_job {
+    std::shared_ptr<EruJob> job;
+    std::atomic<int> refs;
+};
+
+static std::mutex eru_jobs_lock;
+static std::unique_ptr<EruJobQueue> eru_jobs;
+
+static void eru_job_unref(eru_job *handle) {
+    if (handle->refs.fetch_sub(1) == 1)
+        delete handle;
+}
+
+int eru_job_init(int workers, int max_queue) {
+    std::unique_lock<std::mutex> guard(eru_jobs_lock);
+    if (eru_jobs != nullptr)
+        return -1;
+    eru_jobs = std::unique_ptr<EruJobQueue>(new EruJobQueue(
+        workers > 0 ? workers : 0, max_queue > 0 ? max_queue : INT_MAX));
+    return 0;
+}
+
+eru_job* eru_job_submit(const char *input, int inlen,
+        eru_job_callback callback, void *user) {
+    EruJobQueue *queue;
+    {
+        std::unique_lock<std::mutex> guard(eru_jobs_lock);
+        if (eru_jobs == nullptr)
+            eru_jobs = std::unique_ptr<EruJobQueue>(new EruJobQueue(
+                0, INT_MAX));
+        queue = eru_jobs.get();
+    }
+    eru_job *handle = new eru_job;
+    handle->refs = 2;  // caller + completion
+    EruJob::Callback on_done = [handle, callback, user] (EruJob &job) {
+        if (callback != nullptr)
+            callback(handle, user);
+        eru_job_unref(handle);
+    };
+    // published before queueing, the callback may run on a worker at once
+    EruData data(input, inlen);
+    handle->job = std::make_shared<EruJob>(data, on_done);
+    try {
+        queue->submit(handle->job);
+    } catch (std::exception &err) {
+        delete handle;
+        return nullptr;
+    }
+    return handle;
+}
+
+int eru_job_poll(eru_job *job) {
+    return job->job->state();
+}
+
+int eru_job_wait(eru_job *job, int timeout_ms) {
+    return job->job->wait(timeout_ms) ? 1 : 0;
+}
+
+void eru_job_cancel(eru_job *job) {
+    job->job->cancel();
+}
+
+uint64_t eru_job_progress(eru_job *job) {
+    return job->job->progress();
+}
+
+int eru_job_result(eru_job *job, const char **out) {
+    switch (job->job->state()) {
+    case ERU_JOB_DONE:
+        *out = job->job->result().c_str();
+        return job->job->result().length();
+    case ERU_JOB_FAILED:
+        *out = job->job->error().c_str();
+        return job->job->error().length();
+    case ERU_JOB_CANCELLED:
+        *out = "";
+        return 0;
+    default:
+        return -1;
+    }
+}
+
+void eru_job_release(eru_job *job) {
+    eru_job_unref(job);
+}
@@ -0,0 +1,138 @@
+
+// jobs.h: asynchronous submit / poll interface for service requests
+// MIT License
+//
+// Copyright (c) 2021 Geoffrey Tang
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+
+#ifndef _LIBERU_JOBS_H
+#define _LIBERU_JOBS_H
+
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+
+#include "pool.h"
+#include "utils.h"
+
+
+enum EruJobState {
+    ERU_JOB_QUEUED = 0,
+    ERU_JOB_RUNNING = 1,
+    ERU_JOB_DONE = 2,
+    ERU_JOB_FAILED = 3,
+    ERU_JOB_CANCELLED = 4,
+};
+
+class EruJob;
+class EruJobQueue;
+
+/// Handle to one submitted request. Shared between the submitter and the
+/// worker computing it, so it stays valid until both have released it.
+class EruJob {
+    friend class EruJobQueue;
+public:
+    typedef std::function<void(EruJob&)> Callback;
+private:
+    std::mutex _lock;
+    std::condition_variable _cv;
+    EruJobState _state;
+    EruData _input;
+    EruData _output;  // result if done, message if failed
+    Callback _callback;
+    _EruHazmat::JobMonitor _monitor;
+    /// Move into a final state and fire the callback, exactly once.
+    /// @param expect: only transition if the job is currently in this state.
+    void _finish(EruJobState expect, EruJobState state, EruData &output);
+public:
+    EruJob(EruData &input, Callback callback);
+    EruJob(const EruJob &other) = delete;
+    EruJobState state();
+    /// True once the job is done, failed or cancelled.
+    bool finished();
+    /// Block until finished.
+    /// @param timeout_ms: maximum time to wait, negative to wait forever.
+    /// @return true if the job has finished.
+    bool wait(int64_t timeout_ms = -1);
+    /// Request cancellation. Queued jobs never start; running jobs stop at
+    /// the next gate boundary.
+    void cancel();
+    /// Number of gates evaluated so far.
+    uint64_t progress();
+    /// Service output. Only valid once state() is ERU_JOB_DONE.
+    const EruData& result();
+    /// Failure message. Only valid once state() is ERU_JOB_FAILED.
+    const EruData& error();
+};
+
+/// Runs service requests on a private worker pool, first come first served.
+class EruJobQueue {
+public:
+    typedef std::function<EruData(EruData&)> Handler;
+private:
+    Handler _handler;
+    std::unique_ptr<EruThreadPool> _pool;
+public:
+    /// @param workers: number of threads, 0 for hardware concurrency.
+    /// @param max_queue: jobs that may wait for a worker at the same time.
+    EruJobQueue(size_t workers, size_t max_queue);
+    EruJobQueue(size_t workers, size_t max_queue, Handler handler);
+    /// Cancels nothing, waits for every submitted job to finish.
+    ~EruJobQueue();
+    /// Queue a request for provide_service_s. The callback, if any, runs on
+    /// the thread that finishes the job, after its state is final.
+    /// @return Job handle. Throws if the queue is full.
+    std::shared_ptr<EruJob> submit(EruData input,
+        EruJob::Callback callback = nullptr);
+    /// Queue a job made beforehand, so that the submitter can publish it
+    /// before its callback may run. Throws if the queue is full.
+    void submit(std::shared_ptr<EruJob> job);
+};
+
+extern "C" {
+    typedef struct eru_job eru_job;
+    typedef void (*eru_job_callback)(eru_job *job, void *user);
+
+    /// Start the shared job queue. Optional, otherwise it is started with
+    /// one worker per core on the first submission.
+    /// @return 0 on success, -1 if already started.
+    int eru_job_init(int workers, int max_queue);
+    /// Submit a provide_service request, input is copied.
+    /// @param callback: called once the job finishes, may be NULL.
+    /// @return Job handle to release with eru_job_release, NULL if full.
+    eru_job* eru_job_submit(const char *input, int inlen,
+        eru_job_callback callback, void *user);
+    /// @return EruJobState of the job.
+    int eru_job_poll(eru_job *job);
+    /// @return 1 if the job finished within timeout_ms (< 0: forever).
+    int eru_job_wait(eru_job *job, int timeout_ms);
+    void eru_job_cancel(eru_job *job);
+    /// @return Number of gates evaluated so far.
+    uint64_t eru_job_progress(eru_job *job);
+    /// Borrow the output (or failure message) of a finished job. The buffer
+    /// belongs to the job and lives until eru_job_release.
+    /// @return Length of *out, -1 if the job has not finished.
+    int eru_job_result(eru_job *job, const char **out);
+    /// Drop the caller's reference. Running jobs are not cancelled.
+    void eru_job_release(eru_job *job);
+}
+
+#endif  // _LIBERU_JOBS_H
@@ -32,5 +32,13 @@
 #include "type_bool.h"
 #include "type_int.h"
 #include "type_float.h"
+#include "type_fixed.h"
+#include "type_bigint.h"
+#include "type_array.h"
+#include "sort.h"
+#include "table.h"
+#include "graph.h"
+#include "netlist.h"
+#include "archive.h"
 
 #endif  // _LIBERU_H
@@ -0,0 +1,372 @@
+
+// netlist.cpp: Bristol Fashion and BLIF readers
+// MIT License
+//
+// Copyright (c) 2021 Geoffrey Tang
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+
+#include <cctype>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "netlist.h"
+
+
+EruCircuit eru_read_bristol(std::istream &in) {
+    auto fail = []() {
+        throw std::runtime_error("malformed bristol netlist");
+    };
+    EruCircuit res;
+    size_t gates = 0, wires = 0, groups = 0;
+    if (!(in >> gates >> wires >> groups))
+        fail();
+    std::vector<uint32_t> wire(wires, UINT32_MAX);
+    std::vector<size_t> widths(groups);
+    size_t bits = 0;
+    for (auto &w : widths)
+        if (!(in >> w))
+            fail();
+    for (auto w : widths) {
+        if (bits + w > wires)
+            fail();
+        uint32_t first = res._add_input(w);
+        for (size_t i = 0; i < w; i++)
+            wire[bits++] = first + i;
+    }
+    if (!(in >> groups))
+        fail();
+    widths.assign(groups, 0);
+    size_t out_bits = 0;
+    for (auto &w : widths) {
+        if (!(in >> w))
+            fail();
+        out_bits += w;
+    }
+    if (out_bits > wires)
+        fail();
+    // wires are assigned once, and only read once assigned
+    auto src = [&](size_t w) {
+        if (w >= wires || wire[w] == UINT32_MAX)
+            fail();
+        return wire[w];
+    };
+    auto dst = [&](size_t w, uint32_t node) {
+        if (w >= wires || wire[w] != UINT32_MAX)
+            fail();
+        wire[w] = node;
+    };
+    std::vector<size_t> ins, outs;
+    std::string type;
+    for (size_t g = 0; g < gates; g++) {
+        size_t n_in = 0, n_out = 0;
+        if (!(in >> n_in >> n_out) || n_in > wires || n_out > wires)
+            fail();
+        ins.resize(n_in);
+        outs.resize(n_out);
+        for (auto &w : ins)
+            if (!(in >> w))
+                fail();
+        for (auto &w : outs)
+            if (!(in >> w))
+                fail();
+        if (!(in >> type))
+            fail();
+        if ((type == "XOR" || type == "AND") && n_in == 2 && n_out == 1) {
+            dst(outs[0], res._add(type == "XOR" ? ERU_GATE_XOR :
+                ERU_GATE_AND, src(ins[0]), src(ins[1])));
+        } else if (type == "INV" && n_in == 1 && n_out == 1) {
+            dst(outs[0], res._add(ERU_GATE_NOT, src(ins[0])));
+        } else if (type == "EQ" && n_in == 1 && n_out == 1 && ins[0] < 2) {
+            dst(outs[0], res._add(ERU_GATE_CONST, ins[0]));
+        } else if (type == "EQW" && n_in == 1 && n_out == 1) {
+            dst(outs[0], res._add(ERU_GATE_COPY, src(ins[0])));
+        } else if (type == "MAND" && n_in == 2 * n_out) {
+            for (size_t i = 0; i < n_out; i++)
+                dst(outs[i], res._add(ERU_GATE_AND, src(ins[i]),
+                    src(ins[n_out + i])));
+        } else {
+            fail();
+        }
+    }
+    // outputs are the last wires, in group order
+    for (size_t g = 0, w = wires - out_bits; g < widths.size(); g++) {
+        std::vector<uint32_t> nodes;
+        for (size_t i = 0; i < widths[g]; i++)
+            nodes.push_back(src(w++));
+        res._add_output(nodes);
+    }
+    return res;
+}
+
+/// One .names of a BLIF model: out = cover(ins).
+struct _EruBlifNames {
+    std::vector<std::string> ins;
+    std::string out;
+    std::vector<std::string> rows;  // input part of every cube
+    char value = 0;  // output part shared by all cubes, 0 if none yet
+};
+
+/// Split signals into groups: name[0], name[1], ... in a row form one.
+static std::vector<std::vector<std::string>> blif_groups(
+        const std::vector<std::string> &names) {
+    auto base = [](const std::string &name) {
+        size_t open = name.rfind('[');
+        if (name.empty() || name.back() != ']' || open == std::string::npos
+                || open + 2 > name.size() - 1)
+            return name;
+        for (size_t i = open + 1; i + 1 < name.size(); i++)
+            if (!isdigit((unsigned char)name[i]))
+                return name;
+        return name.substr(0, open + 1);
+    };
+    std::vector<std::vector<std::string>> res;
+    std::string last;
+    for (auto &name : names) {
+        std::string b = base(name);
+        if (res.empty() || b == name || b != last)
+            res.push_back({});
+        res.back().push_back(name);
+        last = b;
+    }
+    return res;
+}
+
+/// Gate of truth table t over a and b, bit (a << 1 | b).
+static uint32_t blif_table2(EruCircuit &res, uint8_t t, uint32_t a,
+        uint32_t b) {
+    switch (t & 15) {
+        case 0: return res._add(ERU_GATE_CONST, 0);
+        case 15: return res._add(ERU_GATE_CONST, 1);
+        case 12: return a;
+        case 10: return b;
+        case 3: return res._add(ERU_GATE_NOT, a);
+        case 5: return res._add(ERU_GATE_NOT, b);
+    }
+    return res._add(_EruHazmat::gate_of_table(t), a, b);
+}
+
+/// Gates of one cover over the nodes of its inputs.
+static uint32_t blif_cover(EruCircuit &res, const _EruBlifNames &names,
+        const std::vector<uint32_t> &x) {
+    size_t k = x.size();
+    bool on = names.value != '0';
+    if (k <= 3) {
+        // truth table, bit i set if the cover holds with input j = bit
+        // (k - 1 - j) of i, so x[0] is the most significant
+        uint8_t t = 0;
+        for (uint32_t i = 0; i < (1u << k); i++) {
+            bool hit = false;
+            for (auto &row : names.rows) {
+                bool match = true;
+                for (size_t j = 0; j < k && match; j++) {
+                    bool bit = (i >> (k - 1 - j)) & 1;
+                    match = row[j] == '-' || (row[j] == '1') == bit;
+                }
+                hit = hit || match;
+            }
+            if (hit == on)
+                t |= 1 << i;
+        }
+        if (k == 0)
+            return res._add(ERU_GATE_CONST, t & 1);
+        if (k == 1)
+            return blif_table2(res, t & 2 ? (t & 1 ? 15 : 12) :
+                (t & 1 ? 3 : 0), x[0], x[0]);
+        if (k == 2)
+            return blif_table2(res, t, x[0], x[1]);
+        // any input selecting between the other two is a multiplexer
+        for (int s = 0; s < 3; s++) {
+            int p = s == 0 ? 1 : 0, q = s == 2 ? 1 : 2;
+            for (int swap = 0; swap < 2; swap++) {
+                bool mux = true;
+                for (uint32_t i = 0; i < 8 && mux; i++) {
+                    auto bit = [&](int j) { return (i >> (2 - j)) & 1; };
+                    bool want = bit(s) != (swap != 0) ? bit(p) : bit(q);
+                    mux = ((t >> i) & 1) == want;
+                }
+                if (mux)
+                    return res._add(ERU_GATE_MUX, x[s], swap ? x[q] : x[p],
+                        swap ? x[p] : x[q]);
+            }
+        }
+        // otherwise split on the first input
+        uint32_t hi = blif_table2(res, t >> 4, x[1], x[2]);
+        uint32_t lo = blif_table2(res, t & 15, x[1], x[2]);
+        return res._add(ERU_GATE_MUX, x[0], hi, lo);
+    }
+    // sum of products, negated for an off-set cover
+    std::vector<uint32_t> cubes;
+    for (auto &row : names.rows) {
+        uint32_t cube = UINT32_MAX;
+        for (size_t j = 0; j < k; j++) {
+            if (row[j] == '-')
+                continue;
+            bool neg = row[j] == '0';
+            if (cube == UINT32_MAX)
+                cube = neg ? res._add(ERU_GATE_NOT, x[j]) : x[j];
+            else
+                cube = res._add(neg ? ERU_GATE_ANDYN : ERU_GATE_AND, cube,
+                    x[j]);
+        }
+        if (cube == UINT32_MAX)
+            cube = res._add(ERU_GATE_CONST, 1);
+        cubes.push_back(cube);
+    }
+    if (cubes.empty())
+        cubes.push_back(res._add(ERU_GATE_CONST, 0));
+    while (cubes.size() > 1) {  // balanced, for depth
+        std::vector<uint32_t> next;
+        for (size_t i = 0; i + 1 < cubes.size(); i += 2)
+            next.push_back(res._add(ERU_GATE_OR, cubes[i], cubes[i + 1]));
+        if (cubes.size() % 2 != 0)
+            next.push_back(cubes.back());
+        cubes.swap(next);
+    }
+    return on ? cubes[0] : res._add(ERU_GATE_NOT, cubes[0]);
+}
+
+EruCircuit eru_read_blif(std::istream &in) {
+    std::vector<std::string> inputs, outputs;
+    std::vector<_EruBlifNames> defs;
+    std::unordered_map<std::string, size_t> def_of;
+    auto fail = [](const std::string &msg) {
+        throw std::runtime_error("blif: " + msg);
+    };
+    std::string line, cmd;
+    bool in_names = false, models = false;
+    while (std::getline(in, line)) {
+        line = line.substr(0, line.find('#'));
+        while (!line.empty() && line.back() == '\\') {
+            std::string more;
+            line.pop_back();
+            if (!std::getline(in, more))
+                break;
+            line += " " + more.substr(0, more.find('#'));
+        }
+        std::istringstream tokens(line);
+        std::vector<std::string> words;
+        std::string word;
+        while (tokens >> word)
+            words.push_back(word);
+        if (words.empty())
+            continue;
+        if (words[0][0] != '.') {
+            if (!in_names)
+                fail("cube outside of .names");
+            auto &names = defs.back();
+            size_t k = names.ins.size();
+            std::string row = k == 0 ? "" : words[0];
+            std::string value = words.back();
+            if (words.size() != (k == 0 ? 1u : 2u) || row.size() != k ||
+                    row.find_first_not_of("01-") != std::string::npos ||
+                    (value != "0" && value != "1") ||
+                    (names.value != 0 && names.value != value[0]))
+                fail("bad cube for " + names.out);
+            names.value = value[0];
+            names.rows.push_back(row);
+            continue;
+        }
+        in_names = false;
+        cmd = words[0];
+        if (cmd == ".model") {
+            if (models)
+                break;  // only the first model
+            models = true;
+        } else if (cmd == ".inputs") {
+            inputs.insert(inputs.end(), words.begin() + 1, words.end());
+        } else if (cmd == ".outputs") {
+            outputs.insert(outputs.end(), words.begin() + 1, words.end());
+        } else if (cmd == ".names") {
+            if (words.size() < 2)
+                fail(".names without output");
+            _EruBlifNames names;
+            names.ins.assign(words.begin() + 1, words.end() - 1);
+            names.out = words.back();
+            if (!def_of.insert({names.out, defs.size()}).second)
+                fail(names.out + " defined twice");
+            defs.push_back(names);
+            in_names = true;
+        } else if (cmd == ".end") {
+            break;
+        } else if (cmd != ".default_input_arrival" &&
+                cmd != ".default_output_required" && cmd != ".wire_load_slope"
+                && cmd != ".area" && cmd != ".delay") {
+            fail("unsupported " + cmd);
+        }
+    }
+    EruCircuit res;
+    std::unordered_map<std::string, uint32_t> node_of;
+    for (auto &group : blif_groups(inputs)) {
+        uint32_t first = res._add_input(group.size());
+        for (size_t i = 0; i < group.size(); i++)
+            if (!node_of.insert({group[i], first + i}).second ||
+                    def_of.count(group[i]))
+                fail(group[i] + " defined twice");
+    }
+    // covers may come in any order, build them depth first from outputs
+    std::vector<int> state(defs.size(), 0);  // 1: open, 2: built
+    std::vector<size_t> stack;
+    auto resolve = [&](const std::string &name) {
+        if (node_of.count(name))
+            return node_of[name];
+        if (!def_of.count(name))
+            fail("undefined " + name);
+        stack.push_back(def_of[name]);
+        while (!stack.empty()) {
+            size_t d = stack.back();
+            if (state[d] == 2) {
+                stack.pop_back();
+                continue;
+            }
+            state[d] = 1;
+            bool ready = true;
+            for (auto &arg : defs[d].ins) {
+                if (node_of.count(arg))
+                    continue;
+                if (!def_of.count(arg))
+                    fail("undefined " + arg);
+                size_t e = def_of[arg];
+                if (state[e] == 1)
+                    fail("combinational loop through " + arg);
+                stack.push_back(e);
+                ready = false;
+            }
+            if (!ready)
+                continue;
+            std::vector<uint32_t> x;
+            for (auto &arg : defs[d].ins)
+                x.push_back(node_of[arg]);
+            node_of[defs[d].out] = blif_cover(res, defs[d], x);
+            state[d] = 2;
+            stack.pop_back();
+        }
+        return node_of[name];
+    };
+    for (auto &group : blif_groups(outputs)) {
+        std::vector<uint32_t> nodes;
+        for (auto &name : group)
+            nodes.push_back(resolve(name));
+        res._add_output(nodes);
+    }
+    return res;
+}
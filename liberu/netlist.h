@@ -0,0 +1,49 @@
+
+// netlist.h: circuits read from Bristol Fashion and BLIF netlists
+// MIT License
+//
+// Copyright (c) 2021 Geoffrey Tang
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+
+#ifndef _LIBERU_NETLIST_H
+#define _LIBERU_NETLIST_H
+
+#include <istream>
+
+#include "graph.h"
+
+
+/// Read a Bristol Fashion netlist, as used by MPC frameworks for AES,
+/// SHA-256 and the like. Input and output groups are those of the header,
+/// their bits in wire order, so bit 0 of a group is its first wire. XOR,
+/// AND, INV, EQ, EQW and MAND gates are understood.
+EruCircuit eru_read_bristol(std::istream &in);
+
+/// Read the first model of a BLIF netlist. Every .names cover becomes the
+/// gates computing it: covers of up to two inputs become single gates, the
+/// mixed-polarity ones landyn, lorny and so on, three inputs matching a
+/// multiplexer become lifelse, and larger ones a sum of products. Signals
+/// named name[0], name[1], ... in a row make up one input or output group,
+/// any other signal a group of its own. Latches and subcircuits are not
+/// supported. Run optimize() on the result to fold the inverters of wider
+/// covers into the gates reading them.
+EruCircuit eru_read_blif(std::istream &in);
+
+#endif  // _LIBERU_NETLIST_H
@@ -0,0 +1,184 @@
+
+// pool.cpp: bounded worker thread pool
+// MIT License
+//
+// Copyright (c) 2021 Geoffrey Tang
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <stdexcept>
+#include <system_error>
+
+#include "pool.h"
+
+
+EruThreadPool::EruThreadPool(size_t workers, size_t max_queue) :
+        _max_queue(max_queue), _busy(0), _stopping(false) {
+    if (workers == 0)
+        workers = std::thread::hardware_concurrency();
+    if (workers == 0)
+        workers = 1;
+    for (size_t i = 0; i < workers; i++)
+        _workers.push_back(std::thread(&EruThreadPool::_work, this));
+}
+
+EruThreadPool::~EruThreadPool() {
+    {
+        std::unique_lock<std::mutex> guard(_lock);
+        _stopping = true;
+    }
+    _cv_job.notify_all();
+    for (auto &worker : _workers)
+        worker.join();
+}
+
+void EruThreadPool::_work() {
+    while (true) {
+        std::function<void()> job;
+        {
+            std::unique_lock<std::mutex> guard(_lock);
+            _cv_job.wait(guard, [this] {
+                return _stopping || !_queue.empty(); });
+            if (_queue.empty())
+                return;  // stopping and drained
+            job = std::move(_queue.front());
+            _queue.pop();
+            _busy += 1;
+        }
+        _cv_job.notify_all();  // wake submitters waiting for room
+        std::exception_ptr error;
+        try {
+            job();
+        } catch (...) {
+            error = std::current_exception();
+        }
+        {
+            std::unique_lock<std::mutex> guard(_lock);
+            if (error && !_error)
+                _error = error;
+            _busy -= 1;
+            if (_busy == 0 && _queue.empty())
+                _cv_idle.notify_all();
+        }
+    }
+}
+
+bool EruThreadPool::try_submit(std::function<void()> job) {
+    {
+        std::unique_lock<std::mutex> guard(_lock);
+        if (_stopping || _queue.size() >= _max_queue)
+            return false;
+        _queue.push(std::move(job));
+    }
+    _cv_job.notify_all();
+    return true;
+}
+
+void EruThreadPool::submit(std::function<void()> job) {
+    {
+        std::unique_lock<std::mutex> guard(_lock);
+        _cv_job.wait(guard, [this] {
+            return _stopping || _queue.size() < _max_queue; });
+        if (_stopping)
+            throw std::runtime_error("submitting to stopped thread pool");
+        _queue.push(std::move(job));
+    }
+    _cv_job.notify_all();
+}
+
+void EruThreadPool::wait_idle() {
+    std::unique_lock<std::mutex> guard(_lock);
+    _cv_idle.wait(guard, [this] { return _busy == 0 && _queue.empty(); });
+    if (_error) {
+        std::exception_ptr error = _error;
+        _error = nullptr;
+        std::rethrow_exception(error);
+    }
+}
+
+size_t EruThreadPool::workers() {
+    return _workers.size();
+}
+
+size_t EruThreadPool::pending() {
+    std::unique_lock<std::mutex> guard(_lock);
+    return _queue.size();
+}
+
+/// Helper threads parallel_for may still start, shared by all its calls.
+static std::atomic<size_t> parallel_helpers(
+    std::max(1u, std::thread::hardware_concurrency()) - 1);
+
+/// Take up to want helpers out of the allowance, returns how many.
+static size_t parallel_reserve(size_t want) {
+    size_t free = parallel_helpers.load();
+    size_t take;
+    do {
+        take = std::min(free, want);
+    } while (take > 0 && !parallel_helpers.compare_exchange_weak(free,
+        free - take));
+    return take;
+}
+
+void _EruHazmat::parallel_for(size_t n, const std::function<void(size_t)> &fn,
+        size_t threads) {
+    if (threads == 0)
+        threads = std::thread::hardware_concurrency();
+    if (threads > n)
+        threads = n;
+    if (threads > 1)
+        threads = 1 + parallel_reserve(threads - 1);
+    if (threads <= 1) {
+        for (size_t i = 0; i < n; i++)
+            fn(i);
+        return;
+    }
+    std::atomic<size_t> next(0);
+    std::exception_ptr error = nullptr;
+    std::mutex error_lock;
+    JobMonitor *monitor = job_monitor;
+    auto work = [&] {
+        job_monitor = monitor;
+        for (size_t i; (i = next.fetch_add(1)) < n; ) {
+            try {
+                fn(i);
+            } catch (...) {
+                std::lock_guard<std::mutex> guard(error_lock);
+                if (error == nullptr)
+                    error = std::current_exception();
+                next = n;  // stop handing out work
+            }
+        }
+    };
+    std::vector<std::thread> helpers;
+    try {
+        for (size_t i = 1; i < threads; i++)
+            helpers.push_back(std::thread(work));
+    } catch (std::system_error &err) {}  // out of threads, do with fewer
+    work();
+    for (auto &helper : helpers)
+        helper.join();
+    parallel_helpers += threads - 1;
+    job_monitor = monitor;
+    if (error != nullptr)
+        std::rethrow_exception(error);
+}
@@ -0,0 +1,89 @@
+
+// pool.h: bounded worker thread pool
+// MIT License
+//
+// Copyright (c) 2021 Geoffrey Tang
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+
+#ifndef _LIBERU_POOL_H
+#define _LIBERU_POOL_H
+
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+
+#include "utils.h"
+
+
+/// Fixed-size pool of worker threads consuming a bounded FIFO queue. The
+/// queue bound is what gives callers backpressure: submissions beyond it
+/// are rejected instead of piling up unbounded work.
+class EruThreadPool {
+private:
+    std::vector<std::thread> _workers;
+    std::queue<std::function<void()>> _queue;
+    size_t _max_queue;
+    size_t _busy;
+    bool _stopping;
+    std::exception_ptr _error;  // first exception a job let through
+    std::mutex _lock;
+    std::condition_variable _cv_job;
+    std::condition_variable _cv_idle;
+    void _work();
+public:
+    /// @param workers: number of threads, 0 for hardware concurrency.
+    /// @param max_queue: maximum number of queued (not running) jobs.
+    EruThreadPool(size_t workers, size_t max_queue);
+    EruThreadPool(const EruThreadPool &other) = delete;
+    /// Waits for queued jobs to finish, then joins all workers.
+    ~EruThreadPool();
+    /// Enqueue job if the queue has room.
+    /// @return false if the queue is full or the pool is stopping.
+    bool try_submit(std::function<void()> job);
+    /// Enqueue job, blocking while the queue is full.
+    void submit(std::function<void()> job);
+    /// Block until every queued and running job has finished, then rethrow
+    /// the first exception a job let through since the last wait, if any.
+    /// Workers survive such jobs.
+    void wait_idle();
+    /// Number of worker threads.
+    size_t workers();
+    /// Number of queued jobs that have not started yet.
+    size_t pending();
+};
+
+/// THERE BE DRAGONS!
+namespace _EruHazmat {
+    /// Run fn(0) .. fn(n - 1) concurrently on up to `threads` threads (0 for
+    /// hardware concurrency), the calling thread included. The caller's job
+    /// monitor is carried over to the helpers, and the first exception
+    /// thrown by any fn is rethrown here once all threads have stopped.
+    /// Helper threads come out of one process-wide allowance of a thread
+    /// per core, so nested and concurrent calls run on fewer helpers, or
+    /// inline, rather than multiplying threads.
+    void parallel_for(size_t n, const std::function<void(size_t)> &fn,
+        size_t threads = 0);
+}
+
+#endif  // _LIBERU_POOL_H
@@ -0,0 +1,32 @@
+
+#include <iostream>
+#include "liberu.h"
+
+using namespace std;
+
+
+int main(int argc, char** argv) {
+    EruContext<EruGate> ctx(128);
+    ctx.gen_secret_key();
+    EruInt32(EruGate) a(&ctx), b(&ctx), c(&ctx);
+    a.encrypt(1234);
+    b.encrypt(-56);
+    printf("recording\n");
+    EruRecorder<EruGate> rec(&ctx);
+    rec.input(a);
+    rec.input(b);
+    auto t = a * b;
+    t += a;
+    rec.output(t);
+    EruCircuit circuit = rec.finish();
+    printf("optimizing\n");
+    auto stats = circuit.optimize();
+    printf("  gates = %d -> %d\n", (int)stats.gates_before,
+        (int)stats.gates_after);
+    printf("  bootstraps = %d -> %d\n", (int)stats.bootstraps_before,
+        (int)stats.bootstraps_after);
+    printf("running\n");
+    circuit.run(&ctx, {a._ptr(), b._ptr()}, {c._ptr()});
+    printf("  1234 * -56 + 1234 = %d\n", (int)c.decrypt());
+    return 0;
+}
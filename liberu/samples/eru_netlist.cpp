@@ -0,0 +1,41 @@
+
+#include <iostream>
+#include <sstream>
+#include "liberu.h"
+
+using namespace std;
+
+
+// 2-bit comparator, gt = a > b
+static const char *comparator_blif =
+    ".model cmp2\n"
+    ".inputs a[0] a[1] b[0] b[1]\n"
+    ".outputs gt\n"
+    ".names a[1] b[1] hi\n"
+    "10 1\n"
+    ".names a[1] b[1] eq\n"
+    "00 1\n"
+    "11 1\n"
+    ".names a[0] b[0] lo\n"
+    "10 1\n"
+    ".names hi eq lo gt\n"
+    "1-- 1\n"
+    "-11 1\n"
+    ".end\n";
+
+int main(int argc, char** argv) {
+    EruContext<EruGate> ctx(128);
+    ctx.gen_secret_key();
+    istringstream in(comparator_blif);
+    EruCircuit circuit = eru_read_blif(in);
+    circuit.optimize();
+    printf("  gates = %d, bootstraps = %d\n", (int)circuit.gates(),
+        (int)circuit.bootstraps());
+    EruIntGeneral<EruGate, 2> a(&ctx), b(&ctx);
+    EruBool<EruGate> gt(&ctx);
+    a.encrypt(2);
+    b.encrypt(1);
+    circuit.run(&ctx, {a._ptr(), b._ptr()}, {gt._ptr()}, circuit.levels());
+    printf("  2 > 1 = %d\n", (int)gt.decrypt());
+    return 0;
+}
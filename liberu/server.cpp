@@ -0,0 +1,283 @@
+
+// server.cpp: persistent service daemon over unix domain sockets
+// MIT License
+//
+// Copyright (c) 2021 Geoffrey Tang
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <poll.h>
+#include <stdexcept>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "server.h"
+#include "services.h"
+
+using namespace _EruHazmat;
+
+
+static bool _write_all(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = send(fd, buf, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        buf += n;
+        len -= n;
+    }
+    return true;
+}
+
+static bool _read_all(int fd, char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = recv(fd, buf, len, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        buf += n;
+        len -= n;
+    }
+    return true;
+}
+
+bool _EruHazmat::frame_write(int fd, uint8_t status, const EruData &payload) {
+    char header[9];
+    uint64_t len = payload.length();
+    header[0] = (char)status;
+    for (int i = 0; i < 8; i++)
+        header[1 + i] = (char)((len >> (8 * i)) & 0xff);
+    return _write_all(fd, header, 9) &&
+        _write_all(fd, payload.c_str(), payload.length());
+}
+
+bool _EruHazmat::frame_read(int fd, uint8_t &status, EruData &payload,
+        uint64_t max_length) {
+    char header[9];
+    if (!_read_all(fd, header, 9))
+        return false;
+    uint64_t len = 0;
+    for (int i = 0; i < 8; i++)
+        len |= ((uint64_t)header[1 + i] & 0xff) << (8 * i);
+    if (len > max_length)
+        return false;
+    status = (uint8_t)header[0];
+    // grow with the bytes that actually arrive, so that a bare header
+    // cannot make us reserve the whole announced length
+    payload.clear();
+    while (payload.length() < len) {
+        size_t have = payload.length();
+        size_t chunk = std::min<uint64_t>(len - have, (uint64_t)1 << 20);
+        payload.resize(have + chunk);
+        if (!_read_all(fd, &payload[have], chunk))
+            return false;
+    }
+    return true;
+}
+
+int _EruHazmat::unix_connect(const std::string &path) {
+    sockaddr_un addr;
+    if (path.length() >= sizeof(addr.sun_path))
+        return -1;
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+        return -1;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path.c_str());
+    if (connect(fd, (sockaddr*)&addr, sizeof(addr)) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/// One in-flight request. Shared between the connection thread, which
+/// waits for it until the deadline, and the worker that computes it.
+struct _EruServerJob {
+    std::mutex lock;
+    std::condition_variable cv;
+    bool done = false;
+    bool abandoned = false;
+    EruData request;
+    EruData response;
+    uint8_t status = ERU_FRAME_OK;
+    std::chrono::steady_clock::time_point deadline;
+    JobMonitor monitor;  // cancels the handler once abandoned
+};
+
+EruServer::EruServer(const EruServerConfig &config) :
+    EruServer(config, provide_service_s) {}
+
+EruServer::EruServer(const EruServerConfig &config, Handler handler) :
+        _config(config), _handler(handler), _listen_fd(-1),
+        _running(false), _served(0), _rejected(0), _timed_out(0),
+        _failed(0) {
+    svc_set_key_cache_size(_config.key_cache);
+    svc_set_memory_budget(_config.memory_budget, _config.spill_dir);
+    svc_set_circuit_cache(_config.circuit_cache, _config.circuit_dir);
+}
+
+EruServer::~EruServer() {
+    stop();
+}
+
+void EruServer::start() {
+    sockaddr_un addr;
+    if (_config.socket_path.length() >= sizeof(addr.sun_path))
+        throw std::runtime_error("socket path too long");
+    _listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (_listen_fd < 0)
+        throw std::runtime_error("cannot create socket");
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, _config.socket_path.c_str());
+    unlink(_config.socket_path.c_str());
+    if (bind(_listen_fd, (sockaddr*)&addr, sizeof(addr)) != 0 ||
+            listen(_listen_fd, 128) != 0) {
+        close(_listen_fd);
+        _listen_fd = -1;
+        throw std::runtime_error("cannot bind " + _config.socket_path);
+    }
+    _pool = std::unique_ptr<EruThreadPool>(new EruThreadPool(
+        _config.workers, _config.max_queue));
+    _running = true;
+    _acceptor = std::thread(&EruServer::_accept_loop, this);
+}
+
+void EruServer::stop() {
+    if (!_running.exchange(false))
+        return;
+    _acceptor.join();
+    close(_listen_fd);
+    unlink(_config.socket_path.c_str());
+    _listen_fd = -1;
+    // unblock connection threads waiting for their next frame
+    std::unique_lock<std::mutex> guard(_lock);
+    for (int fd : _connections)
+        shutdown(fd, SHUT_RDWR);
+    _cv_closed.wait(guard, [this] { return _connections.empty(); });
+    guard.unlock();
+    _pool.reset();  // drains whatever is still running
+}
+
+void EruServer::_accept_loop() {
+    pollfd pfd;
+    pfd.fd = _listen_fd;
+    pfd.events = POLLIN;
+    while (_running) {
+        // poll with a short timeout so that stop() is noticed promptly
+        if (poll(&pfd, 1, 100) <= 0)
+            continue;
+        int fd = accept(_listen_fd, nullptr, nullptr);
+        if (fd < 0)
+            continue;
+        std::unique_lock<std::mutex> guard(_lock);
+        if (_connections.size() >= _config.max_connections) {
+            guard.unlock();
+            frame_write(fd, ERU_FRAME_BUSY, "too many connections");
+            close(fd);
+            _rejected += 1;
+            continue;
+        }
+        _connections.insert(fd);
+        std::thread(&EruServer::_serve_connection, this, fd).detach();
+    }
+}
+
+void EruServer::_serve_connection(int fd) {
+    uint8_t status;
+    EruData request, response;
+    while (_running && frame_read(fd, status, request, _config.max_frame)) {
+        status = _dispatch(request, response);
+        if (!frame_write(fd, status, response))
+            break;
+    }
+    std::unique_lock<std::mutex> guard(_lock);
+    _connections.erase(fd);
+    close(fd);  // only now, so that accept() cannot reuse fd while tracked
+    _cv_closed.notify_all();
+}
+
+uint8_t EruServer::_dispatch(EruData &request, EruData &response) {
+    auto job = std::make_shared<_EruServerJob>();
+    job->request.swap(request);
+    job->deadline = std::chrono::steady_clock::now() +
+        std::chrono::milliseconds(_config.timeout_ms);
+    Handler handler = _handler;
+    bool queued = _pool->try_submit([job, handler, this] {
+        {
+            std::unique_lock<std::mutex> guard(job->lock);
+            if (job->abandoned || !_running)
+                return;  // timed out while queued, skip the work entirely
+        }
+        EruData result;
+        uint8_t status = ERU_FRAME_OK;
+        job_monitor = &job->monitor;
+        try {
+            result = handler(job->request);
+        } catch (std::exception &err) {
+            result = err.what();
+            status = ERU_FRAME_ERROR;
+        } catch (...) {
+            result = "unknown error";
+            status = ERU_FRAME_ERROR;
+        }
+        job_monitor = nullptr;
+        std::unique_lock<std::mutex> guard(job->lock);
+        job->response.swap(result);
+        job->status = status;
+        job->done = true;
+        job->cv.notify_all();
+    });
+    if (!queued) {
+        _rejected += 1;
+        response = "server busy";
+        return ERU_FRAME_BUSY;
+    }
+    std::unique_lock<std::mutex> guard(job->lock);
+    while (!job->done && _running &&
+            std::chrono::steady_clock::now() < job->deadline) {
+        // wake up periodically to notice stop() as well
+        auto wake = std::chrono::steady_clock::now() +
+            std::chrono::milliseconds(100);
+        job->cv.wait_until(guard, std::min(wake, job->deadline));
+    }
+    if (!job->done) {
+        // stop the computation at its next gate, freeing the worker
+        job->abandoned = true;
+        job->monitor.cancel = true;
+        _timed_out += 1;
+        response = "request timed out";
+        return ERU_FRAME_TIMEOUT;
+    }
+    response.swap(job->response);
+    if (job->status == ERU_FRAME_OK)
+        _served += 1;
+    else
+        _failed += 1;
+    return job->status;
+}
@@ -0,0 +1,112 @@
+
+// server.h: persistent service daemon over unix domain sockets
+// MIT License
+//
+// Copyright (c) 2021 Geoffrey Tang
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+
+#ifndef _LIBERU_SERVER_H
+#define _LIBERU_SERVER_H
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <set>
+#include <string>
+
+#include "pool.h"
+#include "utils.h"
+
+
+/// Status byte carried by every frame. Requests are sent with ERU_FRAME_OK.
+enum EruFrameStatus : uint8_t {
+    ERU_FRAME_OK = 0,
+    ERU_FRAME_BUSY = 1,  // queue full, retry later
+    ERU_FRAME_TIMEOUT = 2,  // deadline passed before the result was ready
+    ERU_FRAME_ERROR = 3,  // handler failed, payload holds the message
+};
+
+/// THERE BE DRAGONS!
+namespace _EruHazmat {
+    /// frame := <status: u8> <length: u64, little-endian> <payload>
+    /// @return false if the peer closed or the write failed.
+    bool frame_write(int fd, uint8_t status, const EruData &payload);
+
+    /// Read one frame, rejecting payloads longer than max_length. Servers
+    /// close the connection on an oversized frame.
+    /// @return false on EOF, I/O error or oversized frame.
+    bool frame_read(int fd, uint8_t &status, EruData &payload,
+        uint64_t max_length);
+
+    /// Connect to a unix domain socket.
+    /// @return Connected file descriptor, or -1 on failure.
+    int unix_connect(const std::string &path);
+}
+
+struct EruServerConfig {
+    std::string socket_path = "/tmp/eru.sock";
+    size_t workers = 0;  // 0 for one per core
+    size_t max_queue = 64;  // queued requests beyond this are rejected
+    size_t max_connections = 256;
+    uint64_t timeout_ms = 600000;  // per request, from arrival to reply
+    uint64_t max_frame = (uint64_t)256 << 20;  // default cloud keys take ~110 MB
+    size_t key_cache = 16;  // decoded cloud keys kept warm
+    size_t memory_budget = 0;  // bytes in memory per request, 0: no limit
+    std::string spill_dir = "";  // where requests over budget spill
+    size_t circuit_cache = 16;  // compiled circuits kept in memory
+    std::string circuit_dir = "";  // where compiled circuits persist
+};
+
+/// Long-running server around provide_service_s. Each connection carries a
+/// sequence of request frames; requests from all connections share one
+/// worker pool, so independent requests run concurrently.
+class EruServer {
+public:
+    typedef std::function<EruData(EruData&)> Handler;
+private:
+    EruServerConfig _config;
+    Handler _handler;
+    std::unique_ptr<EruThreadPool> _pool;
+    int _listen_fd;
+    std::atomic<bool> _running;
+    std::thread _acceptor;
+    std::mutex _lock;
+    std::condition_variable _cv_closed;
+    std::set<int> _connections;
+    std::atomic<uint64_t> _served, _rejected, _timed_out, _failed;
+    void _accept_loop();
+    void _serve_connection(int fd);
+    uint8_t _dispatch(EruData &request, EruData &response);
+public:
+    EruServer(const EruServerConfig &config);
+    EruServer(const EruServerConfig &config, Handler handler);
+    EruServer(const EruServer &other) = delete;
+    ~EruServer();
+    /// Bind the socket and start accepting connections in the background.
+    void start();
+    /// Stop accepting, close all connections and drain running requests.
+    void stop();
+    uint64_t served() { return _served; }
+    uint64_t rejected() { return _rejected; }
+    uint64_t timed_out() { return _timed_out; }
+    uint64_t failed() { return _failed; }
+};
+
+#endif  // _LIBERU_SERVER_H
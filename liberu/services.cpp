@@ -1,63 +1,624 @@
 
+#include <cstdlib>
+#include <cstring>
+#include <list>
+#include <map>
+#include <mutex>
+#include <openssl/sha.h>
+
+#include "pool.h"
 #include "services.h"
 
 using namespace std;
 
 
-vector<EruData> svc_addition(vector<EruData> &vals) {
-    EruContext<EruGate> ctx(128);
-    ctx.set_cloud_key(vals[0]);
-    EruInt64(EruGate) res(&ctx);
-    res = 0;
-    for (int i = 1; i < vals.size(); i++) {
-        EruInt64(EruGate) tmp(&ctx);
+/// Decoding and FFT-transforming a cloud key costs far more than a small
+/// computation, so long-running servers keep recently used keys warm.
+/// Keys are identified by the SHA-256 digest of their serialized form.
+class _EruKeyCache {
+private:
+    typedef pair<EruData, EruKey> _Entry;
+    list<_Entry> _lru;  // most recently used first
+    map<EruData, list<_Entry>::iterator> _index;
+    size_t _capacity = 0;
+    mutex _lock;
+public:
+    void set_capacity(size_t capacity) {
+        lock_guard<mutex> guard(_lock);
+        _capacity = capacity;
+        while (_lru.size() > _capacity) {
+            _index.erase(_lru.back().first);
+            _lru.pop_back();
+        }
+    }
+    /// @param decoded: set if the key was not warm and got decoded here.
+    EruKey get(EruDataView key, bool *decoded = nullptr) {
+        unsigned char md[SHA256_DIGEST_LENGTH];
+        SHA256((const unsigned char*)key.data, key.length, md);
+        EruData digest((char*)md, SHA256_DIGEST_LENGTH);
+        {
+            lock_guard<mutex> guard(_lock);
+            auto it = _index.find(digest);
+            if (it != _index.end()) {
+                _lru.splice(_lru.begin(), _lru, it->second);
+                return it->second->second;
+            }
+        }
+        // decode outside the lock, racing decoders just waste some work
+        EruKey result = EruKey::from_cloud(key);
+        if (decoded != nullptr)
+            *decoded = true;
+        lock_guard<mutex> guard(_lock);
+        if (_capacity == 0 || _index.find(digest) != _index.end())
+            return result;
+        _lru.push_front(_Entry(digest, result));
+        _index[digest] = _lru.begin();
+        if (_lru.size() > _capacity) {
+            _index.erase(_lru.back().first);
+            _lru.pop_back();
+        }
+        return result;
+    }
+};
+
+static _EruKeyCache svc_key_cache;
+
+void svc_set_key_cache_size(size_t capacity) {
+    svc_key_cache.set_capacity(capacity);
+}
+
+EruKeyImportStats svc_preload_key(int fd) {
+    _EruHazmat::FileView file(fd);
+    bool decoded = false;
+    svc_key_cache.get(file.view(), &decoded);
+    return decoded ? EruKey::last_import() : EruKeyImportStats();
+}
+
+static mutex svc_spill_lock;
+static size_t svc_spill_budget = 0;
+static string svc_spill_dir;
+
+void svc_set_memory_budget(size_t budget, const string &dir) {
+    lock_guard<mutex> guard(svc_spill_lock);
+    svc_spill_budget = budget;
+    svc_spill_dir = dir;
+}
+
+/// Apply the memory budget to a context made for the request's cloud key.
+static void svc_prepare(EruContext<EruGate> &ctx) {
+    lock_guard<mutex> guard(svc_spill_lock);
+    if (svc_spill_budget > 0)
+        ctx.set_memory_budget(svc_spill_budget, svc_spill_dir);
+}
+
+
+static EruCircuitCache svc_circuit_cache;
+
+void svc_set_circuit_cache(size_t capacity, const string &dir) {
+    svc_circuit_cache.configure(capacity, dir);
+}
+
+/// Fold a 64-bit binary operation over the request's values with its
+/// compiled circuit, recorded on ctx the first time it is needed. An empty
+/// fold yields init.
+static vector<EruData> svc_fold(vector<EruDataView> &vals,
+        const string &op, int64_t init) {
+    EruContext<EruGate> ctx(svc_key_cache.get(vals[0]));
+    svc_prepare(ctx);
+    auto program = svc_circuit_cache.get(op + "/64", [&]() {
+        EruRecorder<EruGate> rec(&ctx);
+        EruInt64(EruGate) a(&ctx), b(&ctx);
+        rec.input(a);
+        rec.input(b);
+        EruInt64(EruGate) r = op == "mul" ? a * b : a + b;
+        rec.output(r);
+        return rec.finish();
+    });
+    EruInt64(EruGate) res(&ctx), next(&ctx), tmp(&ctx);
+    EruInt64(EruGate) *cur = &res, *out = &next;
+    if (vals.size() < 2)
+        res = init;
+    else
+        res.bimport(vals[1]);
+    for (size_t i = 2; i < vals.size(); i++) {
         tmp.bimport(vals[i]);
-        res += tmp;
+        program->run(&ctx, {cur->_ptr(), tmp._ptr()}, {out->_ptr()});
+        std::swap(cur, out);
     }
     vector<EruData> vec;
-    vec.push_back(res.bexport());
+    vec.push_back(cur->bexport());
     return vec;
 }
 
-vector<EruData> svc_multiply(vector<EruData> &vals) {
-    EruContext<EruGate> ctx(128);
-    ctx.set_cloud_key(vals[0]);
-    EruInt64(EruGate) res(&ctx);
-    res = 1;
-    for (int i = 1; i < vals.size(); i++) {
-        EruInt64(EruGate) tmp(&ctx);
-        tmp.bimport(vals[i]);
-        res *= tmp;
+vector<EruData> svc_addition(vector<EruDataView> &vals) {
+    return svc_fold(vals, "add", 0);
+}
+
+vector<EruData> svc_multiply(vector<EruDataView> &vals) {
+    return svc_fold(vals, "mul", 1);
+}
+
+/// One instruction of an "exec" program after register renaming: every
+/// result gets its own value id, so only true data dependencies remain.
+struct _SvcNode {
+    uint8_t op;
+    int64_t imm;
+    size_t src[3];
+    size_t nsrc;
+    size_t level;  // longest dependency chain leading here
+    size_t last_use;  // level after which the value can be freed
+    bool live;  // contributes to some output
+};
+
+/// Parse program into renamed nodes and the value ids of its outputs.
+static void _svc_exec_parse(EruDataView program, size_t ninputs,
+        vector<_SvcNode> &nodes, vector<size_t> &outputs) {
+    const size_t none = (size_t)-1;
+    vector<size_t> regs(256, none);
+    if ((program.length - 1) % 5 != 0)
+        throw runtime_error("truncated bytecode");
+    for (size_t pc = 1; pc < program.length; pc += 5) {
+        uint8_t ins[5];
+        for (int i = 0; i < 5; i++)
+            ins[i] = (uint8_t)program.data[pc + i];
+        uint8_t op = ins[0], dst = ins[1];
+        auto reg = [&](uint8_t r) {
+            if (regs[r] == none)
+                throw runtime_error("bytecode reads undefined register");
+            return regs[r];
+        };
+        _SvcNode node = {op, 0, {0, 0, 0}, 0, 0, 0, false};
+        switch (op) {
+        case ERU_OP_OUTPUT:
+            outputs.push_back(reg(ins[2]));
+            continue;
+        case ERU_OP_INPUT:
+            if (ins[2] >= ninputs)
+                throw runtime_error("bytecode reads missing input");
+            node.imm = ins[2];
+            break;
+        case ERU_OP_CONST:
+            node.imm = (int32_t)((uint32_t)ins[2] << 8 |
+                (uint32_t)ins[3] << 16 | (uint32_t)ins[4] << 24) >> 8;
+            break;
+        case ERU_OP_NEG: case ERU_OP_NOT:
+            node.src[0] = reg(ins[2]);
+            node.nsrc = 1;
+            break;
+        case ERU_OP_SHL: case ERU_OP_SHR:
+            node.src[0] = reg(ins[2]);
+            node.nsrc = 1;
+            node.imm = ins[3];
+            if (node.imm >= (uint8_t)program.data[0])
+                throw runtime_error("bytecode shifts past the width");
+            break;
+        case ERU_OP_ADD: case ERU_OP_SUB: case ERU_OP_MUL:
+        case ERU_OP_AND: case ERU_OP_OR: case ERU_OP_XOR:
+        case ERU_OP_EQ: case ERU_OP_NE: case ERU_OP_LT:
+        case ERU_OP_LE: case ERU_OP_GT: case ERU_OP_GE:
+            node.src[0] = reg(ins[2]);
+            node.src[1] = reg(ins[3]);
+            node.nsrc = 2;
+            break;
+        case ERU_OP_SELECT:
+            node.src[0] = reg(ins[2]);
+            node.src[1] = reg(ins[3]);
+            node.src[2] = reg(ins[4]);
+            node.nsrc = 3;
+            break;
+        default:
+            throw runtime_error("unknown bytecode instruction");
+        }
+        for (size_t i = 0; i < node.nsrc; i++)
+            node.level = max(node.level, nodes[node.src[i]].level + 1);
+        regs[dst] = nodes.size();
+        nodes.push_back(node);
+    }
+    // drop everything that no output depends on
+    for (auto v : outputs) {
+        nodes[v].live = true;
+        nodes[v].last_use = none;  // kept until exported
+    }
+    for (size_t v = nodes.size(); v-- > 0; ) {
+        if (!nodes[v].live)
+            continue;
+        for (size_t i = 0; i < nodes[v].nsrc; i++) {
+            auto &src = nodes[nodes[v].src[i]];
+            src.live = true;
+            if (src.last_use != none)
+                src.last_use = max(src.last_use, nodes[v].level);
+        }
+    }
+}
+
+/// Evaluate an "exec" program level by level. Nodes within a level do not
+/// depend on each other and run concurrently; values are freed right after
+/// the level of their last reader.
+template <size_t _Size>
+vector<EruData> _svc_exec(EruContext<EruGate> &ctx, EruDataView program,
+        vector<EruDataView> &inputs) {
+    typedef EruIntGeneral<EruGate, _Size> _Int;
+    vector<_SvcNode> nodes;
+    vector<size_t> outputs;
+    _svc_exec_parse(program, inputs.size(), nodes, outputs);
+    vector<vector<size_t>> levels;
+    for (size_t v = 0; v < nodes.size(); v++) {
+        if (!nodes[v].live)
+            continue;
+        if (nodes[v].level >= levels.size())
+            levels.resize(nodes[v].level + 1);
+        levels[nodes[v].level].push_back(v);
+    }
+    vector<unique_ptr<_Int>> values(nodes.size());
+    auto env = ctx._env();
+    auto eval = [&](size_t v) {
+        auto &node = nodes[v];
+        _Int *x = node.nsrc > 0 ? values[node.src[0]].get() : nullptr;
+        _Int *y = node.nsrc > 1 ? values[node.src[1]].get() : nullptr;
+        _Int *z = node.nsrc > 2 ? values[node.src[2]].get() : nullptr;
+        _Int *res = nullptr;
+        #define eru_cmp_node(expr) {                                          \
+            EruBool<EruGate> cmp = expr;                                      \
+            res = new _Int(&ctx);                                             \
+            *res = 0;                                                         \
+            env->ldup(res->_ptr(), cmp._ptr());                               \
+        }
+        switch (node.op) {
+        case ERU_OP_INPUT:
+            res = new _Int(&ctx);
+            res->bimport(inputs[node.imm]);
+            break;
+        case ERU_OP_CONST:
+            res = new _Int(&ctx);
+            *res = node.imm;
+            break;
+        case ERU_OP_ADD: res = new _Int(*x + *y); break;
+        case ERU_OP_SUB: res = new _Int(*x - *y); break;
+        case ERU_OP_MUL: res = new _Int(*x * *y); break;
+        case ERU_OP_NEG: res = new _Int(-*x); break;
+        case ERU_OP_AND: res = new _Int(*x & *y); break;
+        case ERU_OP_OR: res = new _Int(*x | *y); break;
+        case ERU_OP_XOR: res = new _Int(*x ^ *y); break;
+        case ERU_OP_NOT: res = new _Int(~*x); break;
+        case ERU_OP_SHL: res = new _Int(*x << node.imm); break;
+        case ERU_OP_SHR: res = new _Int(*x >> node.imm); break;
+        case ERU_OP_EQ: eru_cmp_node(*x == *y); break;
+        case ERU_OP_NE: eru_cmp_node(*x != *y); break;
+        case ERU_OP_LT: eru_cmp_node(*x < *y); break;
+        case ERU_OP_LE: eru_cmp_node(*x <= *y); break;
+        case ERU_OP_GT: eru_cmp_node(*x > *y); break;
+        case ERU_OP_GE: eru_cmp_node(*x >= *y); break;
+        case ERU_OP_SELECT:
+            res = new _Int(&ctx);
+            for (size_t i = 0; i < _Size; i++)
+                env->lifelse(res->_ptr() + i, x->_ptr(), y->_ptr() + i,
+                    z->_ptr() + i);
+            break;
+        }
+        #undef eru_cmp_node
+        values[v] = unique_ptr<_Int>(res);
+    };
+    for (size_t level = 0; level < levels.size(); level++) {
+        auto &todo = levels[level];
+        _EruHazmat::parallel_for(todo.size(), [&](size_t i) {
+            eval(todo[i]); });
+        for (size_t v = 0; v < nodes.size(); v++)
+            if (nodes[v].live && nodes[v].last_use == level)
+                values[v].reset();
     }
     vector<EruData> vec;
-    vec.push_back(res.bexport());
+    for (auto v : outputs)
+        vec.push_back(values[v]->bexport());
     return vec;
 }
 
-EruData provide_service_s(EruData &input) {
-    auto x = _EruHazmat::binobjlist_decode(input);
-    string id = x[0];
-    vector<EruData> y;
-    for (int i = 1; i < x.size(); i++)
-        y.push_back(x[i]);
-    // verdict
-    vector<EruData> z;
+vector<EruData> svc_execute(vector<EruDataView> &vals) {
+    if (vals.size() < 2 || vals[1].length < 1)
+        throw runtime_error("missing bytecode");
+    EruContext<EruGate> ctx(svc_key_cache.get(vals[0]));
+    svc_prepare(ctx);
+    vector<EruDataView> inputs(vals.begin() + 2, vals.end());
+    switch ((uint8_t)vals[1].data[0]) {
+    case 8: return _svc_exec<8>(ctx, vals[1], inputs);
+    case 16: return _svc_exec<16>(ctx, vals[1], inputs);
+    case 32: return _svc_exec<32>(ctx, vals[1], inputs);
+    case 64: return _svc_exec<64>(ctx, vals[1], inputs);
+    default: throw runtime_error("unsupported bytecode width");
+    }
+}
+
+/// Evaluate an "agg" query. Columns are decoded on first use and shared by
+/// every instruction reading them; each instruction is batched across all
+/// rows internally.
+template <size_t _Size>
+vector<EruData> _svc_agg(EruContext<EruGate> &ctx, EruDataView query,
+        vector<EruDataView> &operands) {
+    typedef EruColumn<EruGate, _Size> _Col;
+    typedef EruColumn<EruGate, 1> _Mask;
+    typedef EruIntGeneral<EruGate, _Size> _Int;
+    if ((query.length - 1) % 5 != 0)
+        throw runtime_error("truncated query");
+    vector<unique_ptr<_Col>> cols(operands.size());
+    vector<unique_ptr<_Mask>> masks(255);
+    auto col = [&](uint8_t i) -> _Col& {
+        if (i >= operands.size())
+            throw runtime_error("query reads missing column");
+        if (!cols[i]) {
+            auto rows = _EruHazmat::binobjlist_view(operands[i]);
+            if (rows.empty())
+                throw runtime_error("empty column");
+            cols[i].reset(new _Col(&ctx, rows.size()));
+            for (size_t r = 0; r < rows.size(); r++)
+                cols[i]->bimport(r, rows[r]);
+        }
+        return *cols[i];
+    };
+    auto scalar = [&](uint8_t i) {
+        if (col(i).size() != 1)
+            throw runtime_error("scalar operand has more than one row");
+        return col(i).get(0);
+    };
+    // nullptr stands for all rows
+    auto mask = [&](uint8_t m) -> _Mask* {
+        if (m == 0xff)
+            return nullptr;
+        if (!masks[m])
+            throw runtime_error("query reads undefined mask");
+        return masks[m].get();
+    };
+    auto defined_mask = [&](uint8_t m) -> _Mask& {
+        _Mask *res = mask(m);
+        if (res == nullptr)
+            throw runtime_error("query combines the all-rows mask");
+        return *res;
+    };
+    auto set_mask = [&](uint8_t m, _Mask &&value) {
+        if (m == 0xff)
+            throw runtime_error("query writes the all-rows mask");
+        masks[m].reset(new _Mask(move(value)));
+    };
+    vector<EruData> vec;
+    for (size_t pc = 1; pc < query.length; pc += 5) {
+        uint8_t ins[5];
+        for (int i = 0; i < 5; i++)
+            ins[i] = (uint8_t)query.data[pc + i];
+        uint8_t op = ins[0], m = ins[1], a = ins[2], b = ins[3], c = ins[4];
+        #define eru_agg_pred(expr) {                                          \
+            _Int s = scalar(b);                                               \
+            set_mask(m, expr);                                                \
+        }
+        #define eru_agg_emit(method) {                                        \
+            _Mask *mk = mask(m);                                              \
+            _Int res = mk ? col(a).method(*mk) : col(a).method();             \
+            vec.push_back(res.bexport());                                     \
+        }
+        switch (op) {
+        case ERU_AGG_EQ: eru_agg_pred(col(a) == s); break;
+        case ERU_AGG_NE: eru_agg_pred(col(a) != s); break;
+        case ERU_AGG_LT: eru_agg_pred(col(a) < s); break;
+        case ERU_AGG_LE: eru_agg_pred(col(a) <= s); break;
+        case ERU_AGG_GT: eru_agg_pred(col(a) > s); break;
+        case ERU_AGG_GE: eru_agg_pred(col(a) >= s); break;
+        case ERU_AGG_AND:
+            set_mask(m, defined_mask(a) & defined_mask(b));
+            break;
+        case ERU_AGG_OR:
+            set_mask(m, defined_mask(a) | defined_mask(b));
+            break;
+        case ERU_AGG_NOT:
+            set_mask(m, ~defined_mask(a));
+            break;
+        case ERU_AGG_SUM: eru_agg_emit(sum); break;
+        case ERU_AGG_MIN: eru_agg_emit(min); break;
+        case ERU_AGG_MAX: eru_agg_emit(max); break;
+        case ERU_AGG_COUNT: {
+            _Mask *mk = mask(m);
+            _Int res(&ctx);
+            if (mk != nullptr)
+                res = mk->template count<_Size>();
+            else
+                res = (int64_t)col(a).size();
+            vec.push_back(res.bexport());
+            break;
+        }
+        case ERU_AGG_GROUP_SUM:
+            for (auto &res : col(b).group_sum(c, col(a), mask(m)))
+                vec.push_back(res.bexport());
+            break;
+        case ERU_AGG_GROUP_COUNT:
+            for (auto &res : col(b).template group_count<_Size>(c, mask(m)))
+                vec.push_back(res.bexport());
+            break;
+        default:
+            throw runtime_error("unknown query instruction");
+        }
+        #undef eru_agg_emit
+        #undef eru_agg_pred
+    }
+    return vec;
+}
+
+vector<EruData> svc_aggregate(vector<EruDataView> &vals) {
+    if (vals.size() < 2 || vals[1].length < 1)
+        throw runtime_error("missing query");
+    EruContext<EruGate> ctx(svc_key_cache.get(vals[0]));
+    svc_prepare(ctx);
+    vector<EruDataView> operands(vals.begin() + 2, vals.end());
+    switch ((uint8_t)vals[1].data[0]) {
+    case 8: return _svc_agg<8>(ctx, vals[1], operands);
+    case 16: return _svc_agg<16>(ctx, vals[1], operands);
+    case 32: return _svc_agg<32>(ctx, vals[1], operands);
+    case 64: return _svc_agg<64>(ctx, vals[1], operands);
+    default: throw runtime_error("unsupported query width");
+    }
+}
+
+/// Run service `id` on its arguments.
+/// @return false if there is no such service.
+static bool svc_dispatch(const EruData &id, vector<EruDataView> &args,
+        vector<EruData> &out) {
+    if (args.size() < 1)
+        throw runtime_error("missing cloud key");
     if (id == "add")
-        z = svc_addition(y);
+        out = svc_addition(args);
     else if (id == "mul")
-        z = svc_multiply(y);
-    // done
+        out = svc_multiply(args);
+    else if (id == "exec")
+        out = svc_execute(args);
+    else if (id == "agg")
+        out = svc_aggregate(args);
+    else
+        return false;
+    return true;
+}
+
+EruData provide_service_s(EruData &input) {
+    auto x = _EruHazmat::binobjlist_view(input);
+    if (x.size() < 1)
+        return "";
+    vector<EruDataView> y(x.begin() + 1, x.end());
+    vector<EruData> z;
+    svc_dispatch(x[0].str(), y, z);
     return _EruHazmat::binobjlist_encode(z);
 }
 
 int provide_service(char *input, int inlen, char **out) {
-    EruData einp;
-    for (int i = 0; i < inlen; i++)
-        einp += input[i];
+    EruData einp(input, inlen);
     EruData eout = provide_service_s(einp);
     int olen = eout.length();
     *out = new char[olen];
-    for (int i = 0; i < olen; i++)
-        (*out)[i] = eout[i];
+    memcpy(*out, eout.c_str(), olen);
     return olen;
 }
+
+// Zero-copy C interface
+
+static thread_local EruData eru_error;
+/// Encoded response of the last eru_service call that didn't fit.
+static thread_local EruData eru_pending;
+static thread_local bool eru_has_pending = false;
+
+/// Run a service and hand the encoded response to `emit`, translating
+/// exceptions into status codes.
+static int eru_run(const EruData &id, vector<EruDataView> &args,
+        function<int(const vector<EruData>&)> emit) {
+    vector<EruData> out;
+    try {
+        if (!svc_dispatch(id, args, out)) {
+            eru_error = "unknown service: " + id;
+            return ERU_E_UNKNOWN_OP;
+        }
+    } catch (EruCancelled &err) {
+        eru_error = err.what();
+        return ERU_E_CANCELLED;
+    } catch (exception &err) {
+        eru_error = err.what();
+        return ERU_E_FAILED;
+    }
+    return emit(out);
+}
+
+static int eru_emit_alloc(const vector<EruData> &out, uint8_t **buffer,
+        size_t *length) {
+    *length = _EruHazmat::binobjlist_length(out);
+    *buffer = (uint8_t*)std::malloc(*length > 0 ? *length : 1);
+    if (*buffer == nullptr) {
+        eru_error = "out of memory";
+        return ERU_E_FAILED;
+    }
+    _EruHazmat::binobjlist_encode_into(out, (char*)*buffer);
+    return ERU_OK;
+}
+
+static bool eru_gather(const eru_buffer *args, size_t nargs,
+        vector<EruDataView> &views) {
+    if (nargs > 0 && args == nullptr)
+        return false;
+    for (size_t i = 0; i < nargs; i++) {
+        if (args[i].data == nullptr && args[i].length > 0)
+            return false;
+        views.push_back(EruDataView((const char*)args[i].data,
+            args[i].length));
+    }
+    return true;
+}
+
+int eru_service(const char *op, const eru_buffer *args, size_t nargs,
+        uint8_t *out, size_t capacity, size_t *out_length) {
+    vector<EruDataView> views;
+    if (op == nullptr || out_length == nullptr ||
+            !eru_gather(args, nargs, views)) {
+        eru_error = "invalid argument";
+        return ERU_E_ARGUMENT;
+    }
+    EruData().swap(eru_pending);
+    eru_has_pending = false;
+    return eru_run(op, views, [&](const vector<EruData> &res) {
+        *out_length = _EruHazmat::binobjlist_length(res);
+        if (out == nullptr || *out_length > capacity) {
+            // keep it, computing it again could take seconds
+            eru_pending = _EruHazmat::binobjlist_encode(res);
+            eru_has_pending = true;
+            eru_error = "output buffer too small";
+            return (int)ERU_E_BUFFER_TOO_SMALL;
+        }
+        _EruHazmat::binobjlist_encode_into(res, (char*)out);
+        return (int)ERU_OK;
+    });
+}
+
+int eru_service_take(uint8_t *out, size_t capacity, size_t *out_length) {
+    if (out_length == nullptr || !eru_has_pending) {
+        eru_error = "no pending response";
+        return ERU_E_ARGUMENT;
+    }
+    *out_length = eru_pending.length();
+    if (out == nullptr || *out_length > capacity) {
+        eru_error = "output buffer too small";
+        return ERU_E_BUFFER_TOO_SMALL;
+    }
+    memcpy(out, eru_pending.data(), *out_length);
+    EruData().swap(eru_pending);
+    eru_has_pending = false;
+    return ERU_OK;
+}
+
+int eru_service_alloc(const char *op, const eru_buffer *args, size_t nargs,
+        uint8_t **out, size_t *out_length) {
+    vector<EruDataView> views;
+    if (op == nullptr || out == nullptr || out_length == nullptr ||
+            !eru_gather(args, nargs, views)) {
+        eru_error = "invalid argument";
+        return ERU_E_ARGUMENT;
+    }
+    return eru_run(op, views, [&](const vector<EruData> &res) {
+        return eru_emit_alloc(res, out, out_length);
+    });
+}
+
+int eru_service_encoded(const uint8_t *input, size_t length, uint8_t **out,
+        size_t *out_length) {
+    if ((input == nullptr && length > 0) || out == nullptr ||
+            out_length == nullptr) {
+        eru_error = "invalid argument";
+        return ERU_E_ARGUMENT;
+    }
+    auto x = _EruHazmat::binobjlist_view(
+        EruDataView((const char*)input, length));
+    if (x.size() < 1) {
+        eru_error = "empty request";
+        return ERU_E_ARGUMENT;
+    }
+    vector<EruDataView> y(x.begin() + 1, x.end());
+    return eru_run(x[0].str(), y, [&](const vector<EruData> &res) {
+        return eru_emit_alloc(res, out, out_length);
+    });
+}
+
+void eru_free(void *ptr) {
+    std::free(ptr);
+}
+
+const char* eru_last_error() {
+    return eru_error.c_str();
+}
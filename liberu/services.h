@@ -1,9 +1,88 @@
 
-#include "../liberu.h"
+#include <stddef.h>
+#include <stdint.h>
+
+#include "liberu.h"
 
 
 EruData provide_service_s(EruData &input);
 
+/// Opcodes of the "exec" service. A program is one byte holding the integer
+/// width (8, 16, 32 or 64) followed by 5-byte instructions
+///     <op> <dst> <a> <b> <c>
+/// over 256 registers; unused operand bytes are ignored. The request is
+///     ["exec", cloud_key, program, input_0, input_1, ...]
+/// and the response lists the values of every OUTPUT in program order.
+enum EruOpcode : uint8_t {
+    ERU_OP_INPUT = 0x01,  // r[dst] = input[a]
+    ERU_OP_CONST = 0x02,  // r[dst] = sign-extended 24-bit a | b << 8 | c << 16
+    ERU_OP_OUTPUT = 0x03,  // emit r[a]
+    ERU_OP_ADD = 0x10,  // r[dst] = r[a] + r[b]
+    ERU_OP_SUB = 0x11,  // r[dst] = r[a] - r[b]
+    ERU_OP_MUL = 0x12,  // r[dst] = r[a] * r[b]
+    ERU_OP_NEG = 0x13,  // r[dst] = -r[a]
+    ERU_OP_AND = 0x20,  // r[dst] = r[a] & r[b]
+    ERU_OP_OR = 0x21,  // r[dst] = r[a] | r[b]
+    ERU_OP_XOR = 0x22,  // r[dst] = r[a] ^ r[b]
+    ERU_OP_NOT = 0x23,  // r[dst] = ~r[a]
+    ERU_OP_SHL = 0x24,  // r[dst] = r[a] << b, b below the width
+    ERU_OP_SHR = 0x25,  // r[dst] = r[a] >> b, arithmetic
+    ERU_OP_EQ = 0x30,  // r[dst] = r[a] == r[b] ? 1 : 0, same for the rest
+    ERU_OP_NE = 0x31,
+    ERU_OP_LT = 0x32,  // signed comparisons
+    ERU_OP_LE = 0x33,
+    ERU_OP_GT = 0x34,
+    ERU_OP_GE = 0x35,
+    ERU_OP_SELECT = 0x40,  // r[dst] = (r[a] & 1) ? r[b] : r[c]
+};
+
+/// Opcodes of the "agg" service, aggregate queries over encrypted columns.
+/// A query is one byte holding the integer width (8, 16, 32 or 64)
+/// followed by 5-byte instructions
+///     <op> <m> <a> <b> <c>
+/// over 255 mask registers; m = 0xff stands for all rows. The request is
+///     ["agg", cloud_key, query, column_0, column_1, ...]
+/// where each column is a binobjlist of its rows. Every column has the same
+/// number of rows, except scalars which have exactly one. The response
+/// lists the values of every aggregate in query order.
+enum EruAggOpcode : uint8_t {
+    ERU_AGG_EQ = 0x01,  // m[m] = col[a] == scalar[b], row by row
+    ERU_AGG_NE = 0x02,
+    ERU_AGG_LT = 0x03,  // signed comparisons
+    ERU_AGG_LE = 0x04,
+    ERU_AGG_GT = 0x05,
+    ERU_AGG_GE = 0x06,
+    ERU_AGG_AND = 0x10,  // m[m] = m[a] & m[b]
+    ERU_AGG_OR = 0x11,  // m[m] = m[a] | m[b]
+    ERU_AGG_NOT = 0x12,  // m[m] = !m[a]
+    ERU_AGG_SUM = 0x20,  // emit sum of col[a] over the rows in m[m]
+    ERU_AGG_COUNT = 0x21,  // emit number of rows in m[m], or in col[a]
+    ERU_AGG_MIN = 0x22,  // emit minimum of col[a] over the rows in m[m]
+    ERU_AGG_MAX = 0x23,
+    ERU_AGG_GROUP_SUM = 0x24,  // emit, for g < c, the sum of col[a] over
+                               // the rows in m[m] where col[b] == g
+    ERU_AGG_GROUP_COUNT = 0x25,  // same with the number of rows
+};
+
+/// Keep up to `capacity` decoded cloud keys warm across requests. Defaults
+/// to 0, i.e. every request decodes its own key.
+void svc_set_key_cache_size(size_t capacity);
+
+/// Decode the cloud key in file descriptor fd into the key cache ahead of
+/// the first request that uses it. Needs a key cache.
+/// @return timings of the import, all zero if the key was already warm.
+EruKeyImportStats svc_preload_key(int fd);
+
+/// Let every request keep at most `budget` bytes of ciphertexts in memory
+/// and spill the rest to a file in `dir` ("" for $TMPDIR). Defaults to 0,
+/// i.e. no limit.
+void svc_set_memory_budget(size_t budget, const std::string &dir = "");
+
+/// Keep up to `capacity` compiled circuits of the arithmetic services in
+/// memory, and with a directory, share them with later processes through
+/// it. Defaults to 16 in memory, no directory.
+void svc_set_circuit_cache(size_t capacity, const std::string &dir = "");
+
 extern "C" {
     // /// @param arr: Input array of 64-bit integers.
     // /// @param nmemb: Number of integers.
@@ -11,5 +90,52 @@ extern "C" {
     // /// @param lens: Length of output strings.
     // void svc_request_addition(int64_t *arr, int nmemb, char **out, int **lens);
     // int svc_request_multiply(int64_t *arr, int nmembs, char **out);
+
+    /// Legacy entry point, output is allocated with new[]. Prefer the
+    /// eru_service family below.
     int provide_service(char *input, int inlen, char **out);
+
+    /// Status codes of the eru_service family.
+    enum EruStatus {
+        ERU_OK = 0,
+        ERU_E_ARGUMENT = -1,  // null pointers or malformed request
+        ERU_E_UNKNOWN_OP = -2,  // no service by that name
+        ERU_E_BUFFER_TOO_SMALL = -3,  // *out_length holds the needed size
+        ERU_E_FAILED = -4,  // service threw, see eru_last_error()
+        ERU_E_CANCELLED = -5,
+    };
+
+    /// Borrowed input buffer, never copied by the library.
+    typedef struct eru_buffer {
+        const uint8_t *data;
+        size_t length;
+    } eru_buffer;
+
+    /// Run service `op` on scatter-gather arguments, the first of which is
+    /// the cloud key, e.g. ["add": key, a, b], ["exec": key, program,
+    /// inputs...] or ["agg": key, query, columns...]. The binobjlist-encoded
+    /// response is written into the caller's buffer.
+    /// @param out_length: response size, also set on ERU_E_BUFFER_TOO_SMALL,
+    ///     after which eru_service_take hands out the response.
+    /// @return ERU_OK or a negative EruStatus.
+    int eru_service(const char *op, const eru_buffer *args, size_t nargs,
+        uint8_t *out, size_t capacity, size_t *out_length);
+    /// Same, but the response is allocated by the library. Release it with
+    /// eru_free.
+    int eru_service_alloc(const char *op, const eru_buffer *args,
+        size_t nargs, uint8_t **out, size_t *out_length);
+    /// Copy out the response the last eru_service call on this thread
+    /// could not fit, so that it need not run again. The response is kept
+    /// until it is taken or the next eru_service call.
+    /// @return ERU_OK, ERU_E_BUFFER_TOO_SMALL if it still doesn't fit, or
+    ///     ERU_E_ARGUMENT if there is none.
+    int eru_service_take(uint8_t *out, size_t capacity, size_t *out_length);
+    /// Like provide_service, on a binobjlist-encoded request that is read
+    /// in place. Release the response with eru_free.
+    int eru_service_encoded(const uint8_t *input, size_t length,
+        uint8_t **out, size_t *out_length);
+    /// Free a buffer returned by the library.
+    void eru_free(void *ptr);
+    /// Message describing the last failure on this thread.
+    const char* eru_last_error();
 }
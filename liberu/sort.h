@@ -0,0 +1,133 @@
+
+// sort.h: data-oblivious sorting networks over encrypted integers
+// MIT License
+//
+// Copyright (c) 2021 Geoffrey Tang
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+
+#ifndef _LIBERU_SORT_H
+#define _LIBERU_SORT_H
+
+#include <utility>
+#include <vector>
+
+#include "circuit.h"
+#include "context.h"
+#include "type_int.h"
+
+
+/// THERE BE DRAGONS!
+namespace _EruHazmat {
+    /// Comparators of Batcher's odd-even merge sort over n elements, one
+    /// list per stage. Comparators in a stage touch disjoint elements, and
+    /// each puts the smaller value on the lower index. Lengths that are not
+    /// a power of two are padded with maxima at the end, which no
+    /// comparator ever moves, so those comparators are simply left out.
+    inline std::vector<std::vector<std::pair<size_t, size_t>>>
+    merge_sort_network(size_t n) {
+        std::vector<std::vector<std::pair<size_t, size_t>>> stages;
+        for (size_t p = 1; p < n; p *= 2)
+            for (size_t k = p; k >= 1; k /= 2) {
+                std::vector<std::pair<size_t, size_t>> stage;
+                for (size_t j = k % p; j + k < n; j += 2 * k)
+                    for (size_t i = 0; i < k && i + j + k < n; i++)
+                        if ((i + j) / (2 * p) == (i + j + k) / (2 * p))
+                            stage.push_back(std::make_pair(i + j, i + j + k));
+                if (!stage.empty())
+                    stages.push_back(std::move(stage));
+            }
+        return stages;
+    }
+
+    /// Run the sorting network on raw elements: key i is at keys[i] with
+    /// key_size bits, its payload (moved along) at payloads[i] with
+    /// payload_size bits. Every stage compares all its pairs together, then
+    /// swaps them with two selects per bit, all bits of the stage at once.
+    template <typename _T>
+    void sort_network(EruContext<_T> *ctx, const std::vector<_T*> &keys,
+            size_t key_size, const std::vector<_T*> &payloads,
+            size_t payload_size, bool ascending, bool is_signed) {
+        auto env = ctx->_env();
+        size_t w = key_size + payload_size;
+        for (auto &stage : merge_sort_network(keys.size())) {
+            size_t m = stage.size();
+            // swap iff the higher index holds the smaller value
+            std::vector<std::pair<const _T*, const _T*>> cmp(m);
+            for (size_t c = 0; c < m; c++) {
+                auto lo = keys[stage[c].first], hi = keys[stage[c].second];
+                cmp[c] = ascending ? std::make_pair(hi, lo) :
+                    std::make_pair(lo, hi);
+            }
+            EruBits<_T> buf = ctx->allocate(m + m * w);
+            auto s = buf.ptr(), t = s + m;
+            less_many(ctx, s, cmp, key_size, is_signed);
+            gate_for<_T>(m * w, [&](size_t n) {
+                size_t c = n / w, i = n % w;
+                size_t lo = stage[c].first, hi = stage[c].second;
+                _T *a, *b;
+                if (i < key_size) {
+                    a = keys[lo] + i;
+                    b = keys[hi] + i;
+                } else {
+                    a = payloads[lo] + (i - key_size);
+                    b = payloads[hi] + (i - key_size);
+                }
+                env->lifelse(t + n, s + c, b, a);
+                env->lifelse(b, s + c, a, b);
+                env->ldup(a, t + n);
+            });
+            ctx->free(buf);
+        }
+    }
+}
+
+/// Sort encrypted integers in place with a data-oblivious network: the
+/// same comparators run whatever the values, so nothing about the order
+/// leaks. Batcher's odd-even merge sort takes log(n) (log(n) + 1) / 2
+/// stages of concurrent compare-and-swaps. Equal keys may be reordered.
+/// @param is_signed: compare as two's complement, otherwise as unsigned.
+template <typename _T, size_t _Size>
+void eru_sort(EruContext<_T> *ctx, std::vector<EruIntGeneral<_T, _Size>> &keys,
+        bool ascending = true, bool is_signed = true) {
+    std::vector<_T*> k(keys.size()), p(keys.size());
+    for (size_t i = 0; i < keys.size(); i++)
+        k[i] = keys[i]._ptr();
+    _EruHazmat::sort_network(ctx, k, _Size, p, 0, ascending, is_signed);
+}
+
+/// Sort keys as above, taking payloads[i] along with keys[i]. Payloads are
+/// any encrypted type (EruBool, EruIntGeneral, EruFloatGeneral,
+/// EruFixedGeneral) and cost two selects per bit and comparator, like keys.
+template <typename _T, size_t _Size, typename _P>
+void eru_sort(EruContext<_T> *ctx, std::vector<EruIntGeneral<_T, _Size>> &keys,
+        std::vector<_P> &payloads, bool ascending = true,
+        bool is_signed = true) {
+    if (payloads.size() != keys.size())
+        throw std::runtime_error("payload count does not match keys");
+    std::vector<_T*> k(keys.size()), p(keys.size());
+    for (size_t i = 0; i < keys.size(); i++) {
+        k[i] = keys[i]._ptr();
+        p[i] = payloads[i]._ptr();
+    }
+    _EruHazmat::sort_network(ctx, k, _Size, p, _P::_width(), ascending,
+        is_signed);
+}
+
+#endif  // _LIBERU_SORT_H
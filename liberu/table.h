@@ -0,0 +1,400 @@
+
+// table.h: encrypted columns with filters and aggregates
+// MIT License
+//
+// Copyright (c) 2021 Geoffrey Tang
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+
+#ifndef _LIBERU_TABLE_H
+#define _LIBERU_TABLE_H
+
+#include <utility>
+#include <vector>
+
+#include "circuit.h"
+#include "context.h"
+#include "type_int.h"
+
+
+/// One column of an encrypted table: a fixed number of rows of _Size-bit
+/// integers, stored back to back in one allocation. Predicates compare
+/// every row against a value and return a one-bit column (a mask), and
+/// aggregates reduce all rows, or only those whose mask bit is set, to a
+/// single value. Every operation batches its gates across all rows, so
+/// large tables keep every core busy.
+template <typename _T, size_t _Size>
+class EruColumn {
+    template <typename, size_t> friend class EruColumn;
+public:
+    typedef EruColumn<_T, 1> Mask;
+private:
+    typedef EruColumn<_T, _Size> _Self;
+    typedef EruIntGeneral<_T, _Size> _Int;
+    EruContext<_T> *_ctx;
+    EruBits<_T> _value;
+    size_t _rows;
+    bool _active;
+    void _check_index(size_t row) {
+        if (row >= _rows)
+            throw std::runtime_error("row index out of range");
+    }
+    template <size_t _OSize>
+    void _check_sibling(EruColumn<_T, _OSize> *other) {
+        if (_ctx != other->_ctx)
+            throw std::runtime_error("attempting cross-context arithmetic");
+        if (_rows != other->_rows)
+            throw std::runtime_error("column length mismatch");
+    }
+    /// Rows AND-ed with their mask bit, bit i of row r at r * _Size + i.
+    EruBits<_T> _masked(Mask &mask) {
+        _check_sibling(&mask);
+        auto env = _ctx->_env();
+        EruBits<_T> res = _ctx->allocate(_rows * _Size);
+        auto p = res.ptr();
+        _EruHazmat::gate_for<_T>(_rows * _Size, [&](size_t n) {
+            env->land(p + n, mask._ptr(n / _Size), _ptr(0) + n);
+        });
+        return res;
+    }
+    /// Row r < value (or value < row r if swap) of every row.
+    Mask _less(_Int &value, bool swap) {
+        std::vector<std::pair<const _T*, const _T*>> pairs(_rows);
+        for (size_t r = 0; r < _rows; r++)
+            pairs[r] = swap ? std::make_pair((const _T*)value._ptr(),
+                (const _T*)_ptr(r)) : std::make_pair((const _T*)_ptr(r),
+                (const _T*)value._ptr());
+        Mask res(_ctx, _rows);
+        _EruHazmat::less_many(_ctx, res._ptr(), pairs, _Size, true);
+        return res;
+    }
+    /// Row r == value of every row, an AND over the bitwise equalities.
+    Mask _equal(_Int &value) {
+        auto env = _ctx->_env();
+        auto v = value._ptr();
+        Mask res(_ctx, _rows);
+        EruBits<_T> tmp = _ctx->allocate(_rows);
+        auto t = tmp.ptr();
+        _EruHazmat::gate_for<_T>(_rows, [&](size_t r) {
+            auto e = res._ptr(r);
+            env->lxnor(e, _ptr(r), v);
+            for (size_t i = 1; i < _Size; i++) {
+                env->lxnor(t + r, _ptr(r) + i, v + i);
+                env->land(e, e, t + r);
+            }
+        });
+        _ctx->free(tmp);
+        return res;
+    }
+    /// Negate every bit in place.
+    Mask& _invert(Mask &mask) {
+        auto env = _ctx->_env();
+        _EruHazmat::gate_for<_T>(mask._rows, [&](size_t r) {
+            env->lnot(mask._ptr(r), mask._ptr(r));
+        });
+        return mask;
+    }
+    /// Masks of rows whose value is g, for g in 0 .. groups - 1, mask of
+    /// group g at row g * _rows. Values are read as unsigned.
+    EruBits<_T> _groups(size_t groups, Mask *mask) {
+        auto env = _ctx->_env();
+        EruBits<_T> res = _ctx->allocate(groups * _rows);
+        auto p = res.ptr();
+        _EruHazmat::gate_for<_T>(groups * _rows, [&](size_t n) {
+            size_t g = n / _rows, r = n % _rows;
+            auto x = _ptr(r), e = p + n;
+            // AND of the literals spelling g, bits of g above _Size never
+            // match
+            if (_EruHazmat::bit_width(g) > _Size) {
+                env->lval(e, false);
+                return;
+            }
+            if (mask != nullptr)
+                env->ldup(e, mask->_ptr(r));
+            else
+                env->lval(e, true);
+            for (size_t i = 0; i < _Size; i++) {
+                if (i < 64 && (g >> i) & 1)
+                    env->land(e, e, x + i);
+                else
+                    env->landyn(e, e, x + i);
+            }
+        });
+        return res;
+    }
+    /// Smallest (or largest if max) row among the masked ones, as a tree
+    /// of batched compare-and-select layers. Masked-out rows are replaced
+    /// by the identity first, which is also the result if none is left.
+    _Int _extreme(Mask *mask, bool max) {
+        auto env = _ctx->_env();
+        size_t count = _rows;
+        EruBits<_T> cur = _ctx->allocate(count * _Size);
+        _EruHazmat::gate_for<_T>(count * _Size, [&](size_t n) {
+            auto x = _ptr(0) + n;
+            bool sign = n % _Size == _Size - 1;
+            if (mask == nullptr)
+                env->ldup(cur.ptr() + n, x);
+            else if (max == sign)  // identity bit 1: !mask || x
+                env->lorny(cur.ptr() + n, mask->_ptr(n / _Size), x);
+            else  // identity bit 0: mask && x
+                env->land(cur.ptr() + n, mask->_ptr(n / _Size), x);
+        });
+        while (count > 1) {
+            size_t pairs = count / 2, next_count = (count + 1) / 2;
+            auto c = cur.ptr();
+            std::vector<std::pair<const _T*, const _T*>> cmp(pairs);
+            for (size_t j = 0; j < pairs; j++) {
+                const _T *a = c + 2 * j * _Size, *b = a + _Size;
+                cmp[j] = max ? std::make_pair(a, b) : std::make_pair(b, a);
+            }
+            // s: take the odd row of the pair
+            EruBits<_T> sel = _ctx->allocate(pairs);
+            EruBits<_T> next = _ctx->allocate(next_count * _Size);
+            auto s = sel.ptr(), d = next.ptr();
+            _EruHazmat::less_many(_ctx, s, cmp, _Size, true);
+            _EruHazmat::gate_for<_T>(next_count * _Size, [&](size_t n) {
+                size_t j = n / _Size, i = n % _Size;
+                auto a = c + 2 * j * _Size + i;
+                if (j < pairs)
+                    env->lifelse(d + n, s + j, a + _Size, a);
+                else
+                    env->ldup(d + n, a);
+            });
+            _ctx->free(sel);
+            _ctx->free(cur);
+            cur = next;
+            count = next_count;
+        }
+        return _Int(_ctx, cur);
+    }
+    /// Sum of the rows, bit i of row r at p[r * _Size + i].
+    _Int _sum(const _T *p) {
+        std::vector<std::vector<const _T*>> columns(_Size);
+        for (size_t i = 0; i < _Size; i++)
+            for (size_t r = 0; r < _rows; r++)
+                columns[i].push_back(p + r * _Size + i);
+        _Int res(_ctx);
+        _EruHazmat::column_sum(_ctx, res._ptr(), columns, _Size);
+        return res;
+    }
+    /// Number of set bits, row r at p[r].
+    template <size_t _CSize>
+    EruIntGeneral<_T, _CSize> _count(const _T *p) {
+        std::vector<std::vector<const _T*>> columns(1);
+        for (size_t r = 0; r < _rows; r++)
+            columns[0].push_back(p + r);
+        EruIntGeneral<_T, _CSize> res(_ctx);
+        _EruHazmat::column_sum(_ctx, res._ptr(), columns, _CSize);
+        return res;
+    }
+public:
+    /// Get delegated pointer to row r. Dangerous!
+    _T* _ptr(size_t row = 0) const {
+        return _value.ptr() + row * _Size;
+    }
+    /// Number of delegated bits per row.
+    static constexpr size_t _width() {
+        return _Size;
+    }
+    /// Raw constructor. Values undetermined.
+    EruColumn(EruContext<_T> *ctx, size_t rows) : _ctx(ctx), _rows(rows),
+            _active(true) {
+        if (rows == 0)
+            throw std::runtime_error("empty column");
+        _value = _ctx->allocate(_rows * _Size);
+    }
+    EruColumn(const _Self &other) = delete;
+    /// Move constructor. Takes over the bits of a temporary.
+    EruColumn(_Self &&other) : _ctx(other._ctx), _value(other._value),
+            _rows(other._rows), _active(other._active) {
+        other._active = false;
+    }
+    ~EruColumn() {
+        if (_active)
+            _ctx->free(_value);
+    }
+    size_t size() const {
+        return _rows;
+    }
+    /// Plaintext row access, free of gates.
+    _Int get(size_t row) {
+        _check_index(row);
+        _Int res(_ctx);
+        auto env = _ctx->_env();
+        for (size_t i = 0; i < _Size; i++)
+            env->ldup(res._ptr() + i, _ptr(row) + i);
+        return res;
+    }
+    void set(size_t row, _Int &value) {
+        _check_index(row);
+        auto env = _ctx->_env();
+        for (size_t i = 0; i < _Size; i++)
+            env->ldup(_ptr(row) + i, value._ptr() + i);
+    }
+    /// Encrypt & decrypt all rows at once.
+    void encrypt(const std::vector<int64_t> &values) {
+        if (values.size() != _rows)
+            throw std::runtime_error("column length mismatch");
+        _ctx->_encrypt_many(_ptr(), values.data(), _rows, _Size);
+    }
+    std::vector<int64_t> decrypt() {
+        std::vector<int64_t> res(_rows);
+        _ctx->_decrypt_many(res.data(), _ptr(), _rows, _Size, true);
+        return res;
+    }
+    /// Import & export of single rows, in the format of EruIntGeneral.
+    void bimport(size_t row, EruDataView data) {
+        _check_index(row);
+        if (_ctx->_env()->bimport_seeded(_ptr(row), _Size, data))
+            return;
+        auto split = _EruHazmat::binobjlist_view(data);
+        if (split.size() < _Size)
+            throw std::runtime_error("truncated ciphertext");
+        auto env = _ctx->_env();
+        _EruHazmat::check_params_tag(split, _Size, env->btag());
+        for (size_t i = 0; i < _Size; i++)
+            env->bimport(_ptr(row) + i, split[i]);
+    }
+    EruData bexport(size_t row) {
+        return get(row).bexport();
+    }
+    /// Predicates against one value, signed, giving a mask of the rows
+    /// where they hold.
+    Mask operator == (_Int &value) {
+        return _equal(value);
+    }
+    Mask operator != (_Int &value) {
+        Mask res = _equal(value);
+        _invert(res);
+        return res;
+    }
+    Mask operator < (_Int &value) {
+        return _less(value, false);
+    }
+    Mask operator > (_Int &value) {
+        return _less(value, true);
+    }
+    Mask operator <= (_Int &value) {
+        Mask res = _less(value, true);
+        _invert(res);
+        return res;
+    }
+    Mask operator >= (_Int &value) {
+        Mask res = _less(value, false);
+        _invert(res);
+        return res;
+    }
+    /// Bitwise operations row by row, i.e. AND / OR / NOT of masks.
+    #define eru_column_bitwise_op(op, gate)                                   \
+    _Self op (_Self &other) {                                                 \
+        _check_sibling(&other);                                               \
+        auto env = _ctx->_env();                                              \
+        _Self res(_ctx, _rows);                                               \
+        _EruHazmat::gate_for<_T>(_rows * _Size, [&](size_t n) {               \
+            env->gate(res._ptr(0) + n, _ptr(0) + n, other._ptr(0) + n);       \
+        });                                                                   \
+        return res;                                                           \
+    }
+    eru_column_bitwise_op(operator &, land);
+    eru_column_bitwise_op(operator |, lor);
+    eru_column_bitwise_op(operator ^, lxor);
+    #undef eru_column_bitwise_op
+    _Self operator ~ () {
+        auto env = _ctx->_env();
+        _Self res(_ctx, _rows);
+        _EruHazmat::gate_for<_T>(_rows * _Size, [&](size_t n) {
+            env->lnot(res._ptr(0) + n, _ptr(0) + n);
+        });
+        return res;
+    }
+    /// Sum of all rows, or of the rows in mask, wrapping like integers.
+    /// Rows are added by carry-save compression with one final carry
+    /// propagation.
+    _Int sum() {
+        return _sum(_ptr(0));
+    }
+    _Int sum(Mask &mask) {
+        EruBits<_T> masked = _masked(mask);
+        _Int res = _sum(masked.ptr());
+        _ctx->free(masked);
+        return res;
+    }
+    /// Number of set rows of a mask.
+    template <size_t _CSize = 32>
+    EruIntGeneral<_T, _CSize> count() {
+        static_assert(_Size == 1, "only masks can be counted");
+        return _count<_CSize>(_ptr(0));
+    }
+    /// Signed minimum & maximum of all rows, or of the rows in mask. An
+    /// empty mask gives the largest and the smallest value respectively.
+    _Int min() {
+        return _extreme(nullptr, false);
+    }
+    _Int min(Mask &mask) {
+        _check_sibling(&mask);
+        return _extreme(&mask, false);
+    }
+    _Int max() {
+        return _extreme(nullptr, true);
+    }
+    _Int max(Mask &mask) {
+        _check_sibling(&mask);
+        return _extreme(&mask, true);
+    }
+    /// GROUP BY on this column, read as unsigned keys 0 .. groups - 1:
+    /// entry g is the sum of the values (or the number of rows) whose key
+    /// is g, among the rows in mask if given. Rows with other keys count
+    /// nowhere. Each group costs one AND per key bit and row to select,
+    /// then a carry-save sum, so keep the number of groups small.
+    template <size_t _VSize>
+    std::vector<EruIntGeneral<_T, _VSize>> group_sum(size_t groups,
+            EruColumn<_T, _VSize> &values, Mask *mask = nullptr) {
+        _check_sibling(&values);
+        if (mask != nullptr)
+            _check_sibling(mask);
+        auto env = _ctx->_env();
+        EruBits<_T> sel = _groups(groups, mask);
+        EruBits<_T> masked = _ctx->allocate(groups * _rows * _VSize);
+        auto s = sel.ptr(), m = masked.ptr();
+        _EruHazmat::gate_for<_T>(groups * _rows * _VSize, [&](size_t n) {
+            env->land(m + n, s + n / _VSize, values._ptr(0) +
+                n % (_rows * _VSize));
+        });
+        std::vector<EruIntGeneral<_T, _VSize>> res;
+        for (size_t g = 0; g < groups; g++)
+            res.push_back(values._sum(m + g * _rows * _VSize));
+        _ctx->free(masked);
+        _ctx->free(sel);
+        return res;
+    }
+    template <size_t _CSize = 32>
+    std::vector<EruIntGeneral<_T, _CSize>> group_count(size_t groups,
+            Mask *mask = nullptr) {
+        if (mask != nullptr)
+            _check_sibling(mask);
+        EruBits<_T> sel = _groups(groups, mask);
+        std::vector<EruIntGeneral<_T, _CSize>> res;
+        for (size_t g = 0; g < groups; g++)
+            res.push_back(_count<_CSize>(sel.ptr() + g * _rows));
+        _ctx->free(sel);
+        return res;
+    }
+};
+
+#endif  // _LIBERU_TABLE_H
@@ -0,0 +1,156 @@
+
+#ifndef _LIBERU_TYPE_ARRAY
+#define _LIBERU_TYPE_ARRAY
+
+#include "circuit.h"
+#include "context.h"
+#include "type_int.h"
+
+
+/// Fixed-length array of encrypted elements (EruBool, EruIntGeneral,
+/// EruFloatGeneral, EruFixedGeneral) that can be read and written at an
+/// encrypted index without revealing it. Elements are stored back to back
+/// in one allocation.
+template <typename _T, typename _Elem>
+class EruArray {
+private:
+    static constexpr size_t _W = _Elem::_width();
+    EruContext<_T> *_ctx;
+    EruBits<_T> _value;
+    size_t _length;
+    void _check_index(size_t index) {
+        if (index >= _length)
+            throw std::runtime_error("array index out of range");
+    }
+    /// Number of index bits that address an element.
+    size_t _levels() {
+        size_t levels = 0;
+        while (((size_t)1 << levels) < _length)
+            levels++;
+        return levels;
+    }
+    /// r = index < 2^levels, i.e. no higher index bit set.
+    void _in_range(_T *r, const _T *index, size_t bits, size_t levels) {
+        auto env = _ctx->_env();
+        if (bits <= levels) {
+            env->lval(r, true);
+            return;
+        }
+        _EruHazmat::or_reduce(_ctx, r, index + levels, bits - levels);
+        env->lnot(r, r);
+    }
+public:
+    /// Get delegated pointer to element i. Dangerous!
+    _T* _ptr(size_t i = 0) const {
+        return _value.ptr() + i * _W;
+    }
+    EruArray(EruContext<_T> *ctx, size_t length) : _ctx(ctx),
+            _length(length) {
+        if (length == 0)
+            throw std::runtime_error("empty array");
+        _value = _ctx->allocate(_length * _W);
+    }
+    EruArray(const EruArray<_T, _Elem> &other) = delete;
+    ~EruArray() {
+        _ctx->free(_value);
+    }
+    size_t size() const {
+        return _length;
+    }
+    /// Plaintext index access, free of gates.
+    _Elem get(size_t index) {
+        _check_index(index);
+        EruBits<_T> res = _ctx->allocate(_W);
+        auto env = _ctx->_env();
+        for (size_t i = 0; i < _W; i++)
+            env->ldup(res.ptr() + i, _ptr(index) + i);
+        return _Elem(_ctx, res);
+    }
+    void set(size_t index, _Elem &value) {
+        _check_index(index);
+        auto env = _ctx->_env();
+        for (size_t i = 0; i < _W; i++)
+            env->ldup(_ptr(index) + i, value._ptr() + i);
+    }
+    /// Element at an encrypted index, read as unsigned. Out-of-range
+    /// indexes read zero. A balanced tree of multiplexers halves the
+    /// candidates on every index bit, n - 1 selects per element bit in
+    /// log(n) layers.
+    template <size_t _ISize>
+    _Elem read(EruIntGeneral<_T, _ISize> &index) {
+        auto env = _ctx->_env();
+        auto idx = index._ptr();
+        size_t levels = _levels();
+        size_t half = ((_length + 1) / 2) * _W;
+        EruBits<_T> buf = _ctx->allocate(2 * half + 1);
+        _T *cur = _ptr(), *nxt = buf.ptr(), *spare = nxt + half;
+        _T *ok = spare + half;
+        size_t count = _length;
+        for (size_t k = 0; k < levels; k++) {
+            // pair (2j, 2j + 1) on index bit k; a missing odd element
+            // counts as zero
+            size_t pairs = (count + 1) / 2;
+            const _T *sel = k < _ISize ? idx + k : nullptr;
+            _EruHazmat::gate_for<_T>(pairs * _W, [&](size_t n) {
+                size_t j = n / _W, i = n % _W;
+                const _T *lo = cur + 2 * j * _W + i;
+                if (sel == nullptr)  // index too narrow, bit is zero
+                    env->ldup(nxt + n, lo);
+                else if (2 * j + 1 < count)
+                    env->lifelse(nxt + n, sel, lo + _W, lo);
+                else
+                    env->landyn(nxt + n, lo, sel);
+            });
+            cur = nxt;
+            std::swap(nxt, spare);
+            count = pairs;
+        }
+        EruBits<_T> res = _ctx->allocate(_W);
+        auto r = res.ptr();
+        _in_range(ok, idx, _ISize, levels);
+        _EruHazmat::gate_for<_T>(_W, [&](size_t i) {
+            env->land(r + i, cur + i, ok);
+        });
+        _ctx->free(buf);
+        return _Elem(_ctx, res);
+    }
+    /// Store value at an encrypted index, read as unsigned. Out-of-range
+    /// indexes write nothing. The index is decoded once into a one-hot
+    /// mask shared by every element bit, then each bit selects between
+    /// the old and the new value in a single layer.
+    template <size_t _ISize>
+    void write(EruIntGeneral<_T, _ISize> &index, _Elem &value) {
+        auto env = _ctx->_env();
+        auto idx = index._ptr(), v = value._ptr(), p = _ptr();
+        size_t levels = _levels();
+        EruBits<_T> buf = _ctx->allocate(2 * ((size_t)1 << levels));
+        _T *cur = buf.ptr(), *nxt = cur + ((size_t)1 << levels);
+        // decoder: mask j of level k is set iff index bits below k spell j
+        _in_range(cur, idx, _ISize, levels);
+        for (size_t k = 0; k < levels; k++) {
+            size_t count = (size_t)1 << k;
+            if (k >= _ISize) {  // index too narrow, bit is zero
+                for (size_t j = 0; j < count; j++)
+                    env->lval(nxt + count + j, false);
+                for (size_t j = 0; j < count; j++)
+                    env->ldup(nxt + j, cur + j);
+            } else {
+                // the last level only needs the masks of real elements
+                size_t need = k + 1 == levels ? _length : 2 * count;
+                _EruHazmat::gate_for<_T>(need, [&](size_t n) {
+                    if (n < count)
+                        env->landyn(nxt + n, cur + n, idx + k);
+                    else
+                        env->land(nxt + n, cur + (n - count), idx + k);
+                });
+            }
+            std::swap(cur, nxt);
+        }
+        _EruHazmat::gate_for<_T>(_length * _W, [&](size_t n) {
+            env->lifelse(p + n, cur + n / _W, v + n % _W, p + n);
+        });
+        _ctx->free(buf);
+    }
+};
+
+#endif  // _LIBERU_TYPE_ARRAY
@@ -0,0 +1,361 @@
+
+#ifndef _LIBERU_TYPE_BIGINT
+#define _LIBERU_TYPE_BIGINT
+
+#include <memory>
+#include <vector>
+
+#include "circuit.h"
+#include "context.h"
+#include "type_bool.h"
+
+
+/// Integer whose width is chosen at runtime, for values wider than the
+/// EruIntGeneral sizes. Little-endian two's complement, wrapping modulo
+/// 2^bits; the same bits serve signed and unsigned values.
+template <typename _T>
+class EruBigInt {
+private:
+    /// Below this many bits schoolbook multiplication beats another level
+    /// of Karatsuba on gate count.
+    static constexpr size_t _karatsuba_cutoff = 24;
+    EruContext<_T> *_ctx;
+    EruBits<_T> _value;
+    size_t _bits;
+    bool _active;
+    void _free() {
+        if (_active) {
+            _ctx->free(_value);
+            _active = false;
+        }
+    }
+    void _check_sibling(const EruBigInt<_T> *other) {
+        if (_ctx != other->_ctx)
+            throw std::runtime_error("attempting cross-context arithmetic");
+        if (_bits != other->_bits)
+            throw std::runtime_error("mismatched integer widths");
+    }
+    /// Hidden assignment operation, bytes little-endian and zero-extended.
+    void _assign(const uint8_t *data, size_t length, bool encrypt) {
+        auto env = _ctx->_env();
+        auto p = _ptr();
+        std::unique_ptr<bool[]> bits(new bool[_bits]);
+        for (size_t i = 0; i < _bits; i++)
+            bits[i] = i / 8 < length && ((data[i / 8] >> (i % 8)) & 1);
+        if (encrypt) {
+            env->encrypt_many(p, bits.get(), _bits);
+            return;
+        }
+        for (size_t i = 0; i < _bits; i++)
+            env->lval(p + i, bits[i]);
+    }
+    /// r = a * b over 2n bits, a and b unsigned n-bit numbers. Splits
+    /// a = a1 * 2^h + a0 and b likewise, then takes three half-size
+    /// products: a0 * b0, a1 * b1 and (a0 + a1) * (b0 + b1), from which
+    /// the middle term is the last minus the first two.
+    /// @param depth: recursion depth, the top level runs its three
+    ///     products concurrently.
+    static void _karatsuba(EruContext<_T> *ctx, _T *r, const _T *a,
+            const _T *b, size_t n, size_t depth = 0) {
+        auto env = ctx->_env();
+        if (n <= _karatsuba_cutoff) {
+            _schoolbook(ctx, r, a, b, n);
+            return;
+        }
+        size_t h = n / 2, m = n - h;
+        // z0: 2h, z2: 2m, sums: m + 1 each, z1: 2m + 2
+        EruBits<_T> buf = ctx->allocate(2 * h + 2 * m + 2 * (m + 1) +
+            2 * m + 2 + 1);
+        auto z0 = buf.ptr(), z2 = z0 + 2 * h, sa = z2 + 2 * m;
+        auto sb = sa + m + 1, z1 = sb + m + 1, t = z1 + 2 * m + 2;
+        // a0 + a1 and b0 + b1, a0 zero-extended to m bits
+        {
+            EruBits<_T> ext = ctx->allocate(2 * m);
+            auto ea = ext.ptr(), eb = ea + m;
+            for (size_t i = 0; i < m; i++) {
+                if (i < h) {
+                    env->ldup(ea + i, a + i);
+                    env->ldup(eb + i, b + i);
+                } else {
+                    env->lval(ea + i, false);
+                    env->lval(eb + i, false);
+                }
+            }
+            _EruHazmat::prefix_add<_T>(ctx, sa, ea, a + h, m, nullptr,
+                sa + m);
+            _EruHazmat::prefix_add<_T>(ctx, sb, eb, b + h, m, nullptr,
+                sb + m);
+            ctx->free(ext);
+        }
+        auto product = [&](size_t k) {
+            if (k == 0)
+                _karatsuba(ctx, z0, a, b, h, depth + 1);
+            else if (k == 1)
+                _karatsuba(ctx, z2, a + h, b + h, m, depth + 1);
+            else
+                _karatsuba(ctx, z1, sa, sb, m + 1, depth + 1);
+        };
+        if (depth == 0) {
+            _EruHazmat::gate_for<_T>(3, product);
+        } else {
+            for (size_t k = 0; k < 3; k++)
+                product(k);
+        }
+        // z1 -= z0 + z2, then r = z0 + z1 * 2^h + z2 * 2^2h
+        {
+            size_t w = 2 * m + 2;
+            EruBits<_T> ext = ctx->allocate(w);
+            auto e = ext.ptr();
+            env->lval(t, true);
+            for (size_t pass = 0; pass < 2; pass++) {
+                const _T *z = pass == 0 ? z0 : z2;
+                size_t len = pass == 0 ? 2 * h : 2 * m;
+                _EruHazmat::gate_for<_T>(w, [&](size_t i) {
+                    if (i < len)
+                        env->lnot(e + i, z + i);
+                    else
+                        env->lval(e + i, true);
+                });
+                _EruHazmat::prefix_add<_T>(ctx, z1, z1, e, w, t);
+            }
+            ctx->free(ext);
+        }
+        for (size_t i = 0; i < 2 * h; i++)
+            env->ldup(r + i, z0 + i);
+        for (size_t i = 0; i < 2 * m; i++)
+            env->ldup(r + 2 * h + i, z2 + i);
+        {
+            size_t w = 2 * n - h;
+            EruBits<_T> ext = ctx->allocate(w);
+            auto e = ext.ptr();
+            for (size_t i = 0; i < w; i++) {
+                if (i < 2 * m + 2)
+                    env->ldup(e + i, z1 + i);
+                else
+                    env->lval(e + i, false);
+            }
+            _EruHazmat::prefix_add<_T>(ctx, r + h, r + h, e, w);
+            ctx->free(ext);
+        }
+        ctx->free(buf);
+    }
+    /// r = a * b over 2n bits by shifted rows.
+    static void _schoolbook(EruContext<_T> *ctx, _T *r, const _T *a,
+            const _T *b, size_t n) {
+        auto env = ctx->_env();
+        EruBits<_T> row = ctx->allocate(n);
+        auto w = row.ptr();
+        for (size_t i = 0; i < 2 * n; i++)
+            env->lval(r + i, false);
+        for (size_t j = 0; j < n; j++) {
+            _EruHazmat::gate_for<_T>(n, [&](size_t i) {
+                env->land(w + i, a + i, b + j);
+            });
+            // the sum of the rows so far fits in j + n bits
+            _EruHazmat::prefix_add<_T>(ctx, r + j, r + j, w, n, nullptr,
+                r + j + n);
+        }
+        ctx->free(row);
+    }
+public:
+    /// Get delegated pointer. Dangerous!
+    _T* _ptr() const {
+        return _value.ptr();
+    }
+    /// Raw constructor. Value undetermined.
+    EruBigInt(EruContext<_T> *ctx, size_t bits) : _ctx(ctx), _bits(bits),
+            _active(true) {
+        if (bits == 0)
+            throw std::runtime_error("zero-width integer");
+        _value = _ctx->allocate(_bits);
+    }
+    /// Constructs with predetermined value.
+    EruBigInt(EruContext<_T> *ctx, EruBits<_T> value, size_t bits) :
+        _ctx(ctx), _value(value), _bits(bits), _active(true) {}
+    /// Copy constructor that really copies data...
+    EruBigInt(const EruBigInt<_T> &other) : _ctx(other._ctx),
+            _bits(other._bits), _active(true) {
+        _value = _ctx->allocate(_bits);
+        auto env = _ctx->_env();
+        auto p1 = _ptr(), p2 = other._ptr();
+        for (size_t i = 0; i < _bits; i++)
+            env->ldup(p1 + i, p2 + i);
+    }
+    /// Move constructor. Takes over the bits of a temporary.
+    EruBigInt(EruBigInt<_T> &&other) : _ctx(other._ctx),
+            _value(other._value), _bits(other._bits),
+            _active(other._active) {
+        other._active = false;  // won't free over there this time
+    }
+    /// Copy constructor. Will not copy itself.
+    EruBigInt<_T>& operator = (EruBigInt<_T> &other) {
+        if (this == &other)
+            return *this;
+        _check_sibling(&other);
+        auto env = _ctx->_env();
+        auto p1 = _ptr(), p2 = other._ptr();
+        for (size_t i = 0; i < _bits; i++)
+            env->ldup(p1 + i, p2 + i);
+        return *this;
+    }
+    /// Move constructor.
+    EruBigInt<_T>& operator = (EruBigInt<_T> &&other) {
+        _check_sibling(&other);
+        _free();
+        _value = other._value;
+        _active = true;
+        other._active = false;  // won't free over there this time
+        return *this;
+    }
+    /// Destructor.
+    ~EruBigInt() {
+        _free();
+    }
+    /// Width in bits.
+    size_t bits() const {
+        return _bits;
+    }
+    /// Encrypt & decrypt, bytes little-endian. Shorter inputs are
+    /// zero-extended, longer ones truncated.
+    void encrypt(const uint8_t *data, size_t length) {
+        _assign(data, length, true);
+    }
+    void encrypt(const std::vector<uint8_t> &data) {
+        _assign(data.data(), data.size(), true);
+    }
+    /// Sign-extended from 64 bits.
+    void encrypt(int64_t value) {
+        _ctx->_encrypt_many(_ptr(), &value, 1, _bits);
+    }
+    /// @return (bits + 7) / 8 bytes.
+    std::vector<uint8_t> decrypt() {
+        std::vector<uint8_t> res((_bits + 7) / 8, 0);
+        auto env = _ctx->_env();
+        for (size_t i = 0; i < _bits; i++)
+            if (env->decrypt(_ptr() + i))
+                res[i / 8] |= (uint8_t)(1 << (i % 8));
+        return res;
+    }
+    /// Import & export
+    void bimport(EruDataView data) {
+        if (_ctx->_env()->bimport_seeded(_ptr(), _bits, data))
+            return;
+        auto split = _EruHazmat::binobjlist_view(data);
+        if (split.size() < _bits)
+            throw std::runtime_error("truncated ciphertext");
+        auto env = _ctx->_env();
+        _EruHazmat::check_params_tag(split, _bits, env->btag());
+        auto p = _ptr();
+        for (size_t i = 0; i < _bits; i++)
+            env->bimport(p + i, split[i]);
+    }
+    EruData bexport() {
+        std::vector<EruData> tmp;
+        auto env = _ctx->_env();
+        auto p = _ptr();
+        for (size_t i = 0; i < _bits; i++)
+            tmp.push_back(env->bexport(p + i));
+        EruData tag = env->btag();
+        if (!tag.empty())
+            tmp.push_back(tag);
+        return _EruHazmat::binobjlist_encode(tmp);
+    }
+    /// Compact export of a freshly encrypted value: a seed the masks are
+    /// expanded from and one body per bit, about n times smaller than
+    /// bexport. Rewrites the masks in place and needs the secret key.
+    /// bimport takes either format.
+    EruData bexport_compact() {
+        return _ctx->_env()->bexport_seeded(_ptr(), _bits);
+    }
+    /// Sets constant value.
+    EruBigInt<_T>& operator = (const std::vector<uint8_t> &data) {
+        _assign(data.data(), data.size(), false);
+        return *this;
+    }
+    /// Copy into a new width, zero- or sign-extending if wider.
+    EruBigInt<_T> resize(size_t bits, bool sign_extend = false) {
+        EruBigInt<_T> res(_ctx, bits);
+        auto env = _ctx->_env();
+        auto a = _ptr(), r = res._ptr();
+        for (size_t i = 0; i < bits; i++) {
+            if (i < _bits)
+                env->ldup(r + i, a + i);
+            else if (sign_extend)
+                env->ldup(r + i, a + _bits - 1);
+            else
+                env->lval(r + i, false);
+        }
+        return res;
+    }
+    /// Addition, with parallel-prefix carries.
+    EruBigInt<_T> operator + (EruBigInt<_T> &other) {
+        _check_sibling(&other);
+        EruBits<_T> res = _ctx->allocate(_bits);
+        _EruHazmat::prefix_add<_T>(_ctx, res.ptr(), _ptr(), other._ptr(),
+            _bits);
+        return EruBigInt<_T>(_ctx, res, _bits);
+    }
+    EruBigInt<_T>& operator += (EruBigInt<_T> &other) {
+        _check_sibling(&other);
+        _EruHazmat::prefix_add<_T>(_ctx, _ptr(), _ptr(), other._ptr(), _bits);
+        return *this;
+    }
+    /// Subtraction, as a + ~b + 1.
+    EruBigInt<_T> operator - (EruBigInt<_T> &other) {
+        _check_sibling(&other);
+        EruBits<_T> res = _ctx->allocate(_bits);
+        EruBits<_T> one = _ctx->allocate(1);
+        auto env = _ctx->_env();
+        auto b = other._ptr(), r = res.ptr();
+        _EruHazmat::gate_for<_T>(_bits, [&](size_t i) {
+            env->lnot(r + i, b + i);
+        });
+        env->lval(one.ptr(), true);
+        _EruHazmat::prefix_add<_T>(_ctx, r, _ptr(), r, _bits, one.ptr());
+        _ctx->free(one);
+        return EruBigInt<_T>(_ctx, res, _bits);
+    }
+    EruBigInt<_T>& operator -= (EruBigInt<_T> &other) {
+        *this = *this - other;
+        return *this;
+    }
+    /// Multiply, keeping the low bits.
+    EruBigInt<_T> operator * (EruBigInt<_T> &other) {
+        EruBigInt<_T> wide = mul_wide(other);
+        return wide.resize(_bits);
+    }
+    EruBigInt<_T>& operator *= (EruBigInt<_T> &other) {
+        *this = *this * other;
+        return *this;
+    }
+    /// Full unsigned product, 2 * bits wide. Sign-extend both operands
+    /// with resize() first for a signed one.
+    EruBigInt<_T> mul_wide(EruBigInt<_T> &other) {
+        _check_sibling(&other);
+        EruBits<_T> res = _ctx->allocate(2 * _bits);
+        _karatsuba(_ctx, res.ptr(), _ptr(), other._ptr(), _bits);
+        return EruBigInt<_T>(_ctx, res, 2 * _bits);
+    }
+    /// Equality.
+    EruBool<_T> operator == (EruBigInt<_T> &other) {
+        _check_sibling(&other);
+        EruBits<_T> res = _ctx->allocate(1);
+        EruBits<_T> tmp = _ctx->allocate(_bits);
+        auto env = _ctx->_env();
+        auto a = _ptr(), b = other._ptr(), t = tmp.ptr();
+        _EruHazmat::gate_for<_T>(_bits, [&](size_t i) {
+            env->lxor(t + i, a + i, b + i);
+        });
+        _EruHazmat::or_reduce(_ctx, res.ptr(), t, _bits);
+        env->lnot(res.ptr(), res.ptr());
+        _ctx->free(tmp);
+        return EruBool<_T>(_ctx, res);
+    }
+    EruBool<_T> operator != (EruBigInt<_T> &other) {
+        EruBool<_T> res = *this == other;
+        _ctx->_env()->lnot(res._ptr(), res._ptr());
+        return res;
+    }
+};
+
+#endif  // _LIBERU_TYPE_BIGINT
@@ -30,6 +30,10 @@ public:
     _T* _ptr() const {
         return _value.ptr();
     }
+    /// Number of delegated bits.
+    static constexpr size_t _width() {
+        return 1;
+    }
     /// Raw constructor. Value undetermined.
     EruBool(EruContext<_T> *ctx) : _ctx(ctx), _active(true) {
         _value = _ctx->allocate(1);
@@ -43,6 +47,12 @@ public:
         _value = _ctx->allocate(1);
         _ctx->_env()->ldup(_ptr(), other._ptr());
     }
+    /// Move constructor. Takes over the bit of a temporary.
+    /// EruBool this(other_expr);
+    EruBool(EruBool<_T> &&other) : _ctx(other._ctx), _value(other._value),
+            _active(other._active) {
+        other._active = false;  // won't free over there this time
+    }
     /// Copy constructor. Will not copy itself.
     /// EruBool this = other;
     EruBool<_T>& operator = (EruBool<_T> &other) {
@@ -75,12 +85,20 @@ public:
         return _ctx->_env()->decrypt(_ptr());
     }
     /// Import & export
-    void bimport(const EruData &data) {
-        _ctx->_env()->bimport(_ptr(), data);
+    void bimport(EruDataView data) {
+        if (!_ctx->_env()->bimport_seeded(_ptr(), 1, data))
+            _ctx->_env()->bimport(_ptr(), data);
     }
     EruData bexport() {
         return _ctx->_env()->bexport(_ptr());
     }
+    /// Compact export of a freshly encrypted value: a seed the masks are
+    /// expanded from and one body per bit, about n times smaller than
+    /// bexport. Rewrites the masks in place and needs the secret key.
+    /// bimport takes either format.
+    EruData bexport_compact() {
+        return _ctx->_env()->bexport_seeded(_ptr(), 1);
+    }
     /// Sets constant value to value.
     EruBool<_T>& operator = (const bool value) {
         _ctx->_env()->lval(_ptr(), value);
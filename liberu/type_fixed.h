@@ -0,0 +1,295 @@
+
+#ifndef _LIBERU_TYPE_FIXED
+#define _LIBERU_TYPE_FIXED
+
+#include <cmath>
+#include <vector>
+
+#include "circuit.h"
+#include "context.h"
+#include "type_int.h"
+
+
+/// What happens when a fixed-point result leaves the representable range.
+/// Saturation costs a few gates per bit on add / sub, and makes multiply
+/// compute the full upper half of the product to detect it.
+enum EruOverflow {
+    ERU_OVERFLOW_WRAP = 0,  // two's complement wrap-around, like integers
+    ERU_OVERFLOW_SATURATE = 1,  // clamp to the largest / smallest value
+};
+
+/// Signed fixed-point number, an EruIntGeneral scaled by 2^-_FracBits.
+/// _IntBits includes the sign bit.
+/// 0     ... FracBits-1   FracBits ... FracBits+IntBits-1
+/// [2^-FracBits ... 2^-1] [2^0 ... sign]
+template <typename _T, size_t _IntBits, size_t _FracBits,
+    EruOverflow _Overflow = ERU_OVERFLOW_WRAP>
+class EruFixedGeneral {
+private:
+    typedef EruFixedGeneral<_T, _IntBits, _FracBits, _Overflow> _Self;
+    static constexpr size_t _Size = _IntBits + _FracBits;
+    typedef EruIntGeneral<_T, _Size> _Int;
+    /// Extra product columns below the kept ones. The carries of columns
+    /// further down are dropped, and so are the guard columns once summed,
+    /// which keeps the product within about 1.2 ULP below exact.
+    static constexpr size_t _Guard = _EruHazmat::bit_width(_FracBits) <
+        _FracBits ? _EruHazmat::bit_width(_FracBits) : _FracBits;
+    EruContext<_T> *_ctx;
+    _Int _value;
+    void _check_sibling(_Self *other) {
+        if (_ctx != other->_ctx)
+            throw std::runtime_error("attempting cross-context arithmetic");
+    }
+    /// Scaled two's complement bits of value, rounded to nearest and
+    /// clamped to the representable range.
+    static std::vector<bool> _to_bits(double value) {
+        std::vector<bool> bits(_Size, false);
+        bool neg = value < 0;
+        double x = std::nearbyint(std::ldexp(std::fabs(value), _FracBits));
+        double max = std::ldexp(1.0, _Size - 1);
+        if (std::isnan(value))
+            x = 0.0;
+        if (x >= max) {  // clamp, the most negative value is one further
+            for (size_t i = 0; i + 1 < _Size; i++)
+                bits[i] = !neg;
+            bits[_Size - 1] = neg;
+            return bits;
+        }
+        for (size_t i = 0; i < _Size; i++) {
+            double half = std::floor(x / 2.0);
+            bits[i] = x - 2.0 * half != 0.0;
+            x = half;
+        }
+        if (neg)  // negate: invert, then add one
+            for (size_t i = 0, carry = 1; i < _Size; i++) {
+                bool bit = !bits[i];
+                bits[i] = bit != (carry != 0);
+                carry = bit && carry;
+            }
+        return bits;
+    }
+    /// Pick the clamped value on overflow.
+    /// @param sign: sign of the exact result, MAX if clear, MIN if set.
+    void _saturate(_T *r, const _T *overflow, const _T *sign) {
+        auto env = _ctx->_env();
+        EruBits<_T> tmp = _ctx->allocate(1);
+        auto t = tmp.ptr();
+        env->lnot(t, sign);
+        _EruHazmat::gate_for<_T>(_Size, [&](size_t i) {
+            env->lifelse(r + i, overflow, i + 1 < _Size ? t : sign, r + i);
+        });
+        _ctx->free(tmp);
+    }
+    /// a + b, b negated first if negate.
+    _Self _add(_Self &other, bool negate) {
+        _check_sibling(&other);
+        _Int res = negate ? _value - other._value : _value + other._value;
+        if (_Overflow == ERU_OVERFLOW_SATURATE) {
+            // overflow iff the operands (b negated) share a sign that the
+            // result doesn't
+            auto env = _ctx->_env();
+            auto sa = _ptr() + _Size - 1, sb = other._ptr() + _Size - 1;
+            auto sr = res._ptr() + _Size - 1;
+            EruBits<_T> tmp = _ctx->allocate(2);
+            auto t = tmp.ptr();
+            if (negate)
+                env->lxor(t, sa, sb);
+            else
+                env->lxnor(t, sa, sb);
+            env->lxor(t + 1, sa, sr);
+            env->land(t, t, t + 1);
+            _saturate(res._ptr(), t, sa);
+            _ctx->free(tmp);
+        }
+        return _Self(_ctx, std::move(res));
+    }
+    /// Bits [lo, hi) of the sign-extended product of a and b. Only partial
+    /// products landing in those columns are formed, and the rows are
+    /// added with ripple adders no wider than the window.
+    void _mul_columns(_T *r, const _T *a, const _T *b, size_t lo,
+            size_t hi) {
+        auto env = _ctx->_env();
+        size_t width = hi - lo;
+        EruBits<_T> pp = _ctx->allocate(hi * width);
+        EruBits<_T> tmp = _ctx->allocate(3);
+        auto p = pp.ptr(), t = tmp.ptr();
+        #define ext(x, i) ((x) + ((i) < _Size ? (i) : _Size - 1))
+        // all partial products of one layer: row j, column lo + k
+        _EruHazmat::gate_for<_T>(hi * width, [&](size_t n) {
+            size_t j = n / width, c = lo + n % width;
+            if (c >= j)
+                env->land(p + n, ext(a, c - j), ext(b, j));
+        });
+        for (size_t k = 0; k < width; k++)
+            env->lval(r + k, false);
+        for (size_t j = 0; j < hi; j++) {
+            size_t first = j > lo ? j - lo : 0;
+            env->lval(t, false);
+            for (size_t k = first; k < width; k++) {
+                const _T *x = p + j * width + k;
+                // r[k] += x with carry t[0]
+                env->lxor(t + 1, r + k, x);
+                env->land(t + 2, r + k, x);
+                env->lxor(r + k, t + 1, t);
+                env->land(t + 1, t + 1, t);
+                env->lor(t, t + 1, t + 2);
+            }
+        }
+        #undef ext
+        _ctx->free(tmp);
+        _ctx->free(pp);
+    }
+    _Self _mul(_Self &other) {
+        _check_sibling(&other);
+        constexpr size_t lo = _FracBits - _Guard;
+        constexpr size_t hi = _Overflow == ERU_OVERFLOW_SATURATE ?
+            2 * _Size : _Size + _FracBits;
+        auto env = _ctx->_env();
+        EruBits<_T> cols = _ctx->allocate(hi - lo);
+        auto c = cols.ptr();
+        _mul_columns(c, _ptr(), other._ptr(), lo, hi);
+        EruBits<_T> res = _ctx->allocate(_Size);
+        auto r = res.ptr();
+        for (size_t i = 0; i < _Size; i++)
+            env->ldup(r + i, c + _Guard + i);
+        if (_Overflow == ERU_OVERFLOW_SATURATE) {
+            // the result fits iff every bit above it repeats its sign
+            size_t top = hi - lo, n = top - (_Guard + _Size - 1);
+            EruBits<_T> diff = _ctx->allocate(n + 1);
+            auto d = diff.ptr(), sign = c + top - 1;
+            _EruHazmat::gate_for<_T>(n, [&](size_t i) {
+                env->lxor(d + i, c + _Guard + _Size - 1 + i, sign);
+            });
+            _EruHazmat::or_reduce(_ctx, d + n, d, n);
+            _saturate(r, d + n, sign);
+            _ctx->free(diff);
+        }
+        _ctx->free(cols);
+        return _Self(_ctx, _Int(_ctx, res));
+    }
+public:
+    /// Get delegated pointer. Dangerous!
+    _T* _ptr() const {
+        return _value._ptr();
+    }
+    /// Number of delegated bits.
+    static constexpr size_t _width() {
+        return _Size;
+    }
+    /// Raw constructor. Value undetermined.
+    EruFixedGeneral(EruContext<_T> *ctx) : _ctx(ctx), _value(ctx) {}
+    /// Constructs around raw scaled bits.
+    EruFixedGeneral(EruContext<_T> *ctx, _Int &&value) : _ctx(ctx),
+        _value(std::move(value)) {}
+    /// Constructs with predetermined value.
+    EruFixedGeneral(EruContext<_T> *ctx, EruBits<_T> value) : _ctx(ctx),
+        _value(ctx, value) {}
+    /// Copy constructor that really copies data...
+    EruFixedGeneral(const _Self &other) : _ctx(other._ctx),
+        _value(other._value) {}
+    /// Move constructor. Takes over the bits of a temporary.
+    EruFixedGeneral(_Self &&other) : _ctx(other._ctx),
+        _value(std::move(other._value)) {}
+    /// Copy constructor. Will not copy itself.
+    _Self& operator = (_Self &other) {
+        _check_sibling(&other);
+        _value = other._value;
+        return *this;
+    }
+    /// Move constructor.
+    _Self& operator = (_Self &&other) {
+        _check_sibling(&other);
+        _value = std::move(other._value);
+        return *this;
+    }
+    /// Underlying integer, the value times 2^_FracBits.
+    _Int& raw() {
+        return _value;
+    }
+    /// Encrypt & decrypt. Encryption rounds to nearest and clamps.
+    void encrypt(const double value) {
+        auto bits = _to_bits(value);
+        bool raw[_Size];
+        for (size_t i = 0; i < _Size; i++)
+            raw[i] = bits[i];
+        _ctx->_env()->encrypt_many(_ptr(), raw, _Size);
+    }
+    double decrypt() {
+        bool bits[_Size];
+        _ctx->_env()->decrypt_many(_ptr(), bits, _Size);
+        double result = 0.0;
+        for (size_t i = 0; i + 1 < _Size; i++)
+            if (bits[i])
+                result += std::ldexp(1.0, (int)i - (int)_FracBits);
+        if (bits[_Size - 1])
+            result -= std::ldexp(1.0, (int)_IntBits - 1);
+        return result;
+    }
+    /// Import & export
+    void bimport(EruDataView data) {
+        _value.bimport(data);
+    }
+    EruData bexport() {
+        return _value.bexport();
+    }
+    /// Compact export of a freshly encrypted value, see EruIntGeneral.
+    EruData bexport_compact() {
+        return _value.bexport_compact();
+    }
+    /// Sets constant value.
+    _Self& operator = (const double value) {
+        auto bits = _to_bits(value);
+        auto env = _ctx->_env();
+        for (size_t i = 0; i < _Size; i++)
+            env->lval(_ptr() + i, bits[i]);
+        return *this;
+    }
+    /// Addition and subtraction, at the cost of the integer ones.
+    _Self operator + (_Self &other) {
+        return _add(other, false);
+    }
+    _Self& operator += (_Self &other) {
+        *this = _add(other, false);
+        return *this;
+    }
+    _Self operator - (_Self &other) {
+        return _add(other, true);
+    }
+    _Self& operator -= (_Self &other) {
+        *this = _add(other, true);
+        return *this;
+    }
+    /// Negate value. Wraps on the most negative value.
+    _Self operator - () {
+        return _Self(_ctx, -_value);
+    }
+    /// Multiply as a truncated product: the result is within about 1.2 ULP
+    /// below the exact value, not always its floor.
+    _Self operator * (_Self &other) {
+        return _mul(other);
+    }
+    _Self& operator *= (_Self &other) {
+        *this = _mul(other);
+        return *this;
+    }
+    /// Comparisons are those of the scaled integers.
+    #define eru_fixed_compare_op(op)                                          \
+    EruBool<_T> op (_Self &other) {                                           \
+        _check_sibling(&other);                                               \
+        return _value.op(other._value);                                       \
+    }
+    eru_fixed_compare_op(operator ==);
+    eru_fixed_compare_op(operator !=);
+    eru_fixed_compare_op(operator <);
+    eru_fixed_compare_op(operator >);
+    eru_fixed_compare_op(operator <=);
+    eru_fixed_compare_op(operator >=);
+    #undef eru_fixed_compare_op
+};
+
+#define EruFixed16(_T) EruFixedGeneral<_T, 8, 8>
+#define EruFixed32(_T) EruFixedGeneral<_T, 16, 16>
+#define EruFixed64(_T) EruFixedGeneral<_T, 32, 32>
+#define EruFixed(_T) EruFixedGeneral<_T, 16, 16>
+
+#endif  // _LIBERU_TYPE_FIXED
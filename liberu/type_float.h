@@ -2,19 +2,39 @@
 #ifndef _LIBERU_TYPE_FLOAT
 #define _LIBERU_TYPE_FLOAT
 
+#include <cmath>
+
+#include "circuit.h"
 #include "context.h"
 #include "type_int.h"
 
 
+/// How arithmetic results are fitted back into the fraction. Truncation
+/// skips the rounding incrementer, saving two gates per exponent and
+/// fraction bit on every operation.
+enum EruRounding {
+    ERU_ROUND_TRUNCATE = 0,  // toward zero
+    ERU_ROUND_NEAREST = 1,  // to nearest, ties to even
+};
+
 /// Floating-point number stored in IEEE-754-like format. Currently missing
-/// NaN support.
-template <typename _T, size_t _ExpSize, size_t _DigSize>
+/// NaN support, and products below the normal range are flushed to zero.
+/// 0     ... DigSize-1   DigSize ... DigSize+ExpSize-1   DigSize+ExpSize
+/// [fraction, LSB first] [biased exponent, LSB first]    [sign]
+template <typename _T, size_t _ExpSize, size_t _DigSize,
+    EruRounding _Round = ERU_ROUND_NEAREST>
 class EruFloatGeneral {
 private:
-    typedef EruFloatGeneral<_T, _ExpSize, _DigSize> _Self;
+    typedef EruFloatGeneral<_T, _ExpSize, _DigSize, _Round> _Self;
     typedef EruIntGeneral<_T, _ExpSize> _ExpInt;
     typedef EruIntGeneral<_T, (_DigSize + 1) * 2> _DigInt;
     static constexpr size_t _Size = 1 + _ExpSize + _DigSize;
+    /// Exponent arithmetic needs headroom for the normalization shift and
+    /// a sign to detect underflow.
+    static constexpr size_t _WideSize = (_ExpSize > _EruHazmat::bit_width(
+        (_DigSize + 1) * 2) ? _ExpSize : _EruHazmat::bit_width(
+        (_DigSize + 1) * 2)) + 2;
+    typedef EruIntGeneral<_T, _WideSize> _WideInt;
     EruContext<_T> *_ctx;
     EruBits<_T> _value;
     bool _active;
@@ -28,36 +48,272 @@ private:
         if (_ctx != other->_ctx)
             throw std::runtime_error("attempting cross-context arithmetic");
     }
-    /// Hidden assignment operation
+    /// Bit pattern of value, LSB first. Fractions are truncated, values
+    /// out of range become infinities or subnormals.
+    void _pack(double value, bool *bits) {
+        const int64_t bias = ((int64_t)1 << (_ExpSize - 1)) - 1;
+        const int64_t inf = ((int64_t)1 << _ExpSize) - 1;
+        bits[_DigSize + _ExpSize] = std::signbit(value);
+        // biased exponent and the mantissa scaled into [0, 2)
+        int64_t exp = 0;
+        double mant = std::fabs(value);
+        if (std::isnan(value)) {
+            exp = inf;
+            mant = 1.5;
+        } else if (std::isinf(value)) {
+            exp = inf;
+        } else if (mant != 0.0) {
+            int x;
+            std::frexp(mant, &x);
+            exp = x - 1 + bias;
+            if (exp >= inf) {
+                exp = inf;
+                mant = 0.0;
+            } else if (exp <= 0) {
+                exp = 0;
+                mant = std::ldexp(mant, (int)bias - 1);
+            } else {
+                mant = std::ldexp(mant, 1 - x);
+            }
+        }
+        for (size_t i = 0; i < _ExpSize; i++)
+            bits[_DigSize + i] = (exp >> i) & 1;
+        // fraction bits from the top, doubling is exact
+        if (mant >= 1.0)
+            mant -= 1.0;
+        for (size_t i = _DigSize; i >= 1; i--) {
+            mant *= 2.0;
+            bits[i - 1] = mant >= 1.0;
+            if (mant >= 1.0)
+                mant -= 1.0;
+        }
+    }
+    /// Hidden assignment operation, a trivial (public) encoding of value.
     void _assign(double value) {
-        const size_t d_exp = 11, d_dig = 52;
-        uint64_t iv = *(uint64_t*)(&value);
+        bool bits[_Size];
+        _pack(value, bits);
         auto env = _ctx->_env();
         auto p = _ptr();
-        // set sign
-        #define bitof(t, x) ((t & ((uint64_t)1 << (x))) == 0 ? false : true)
-        env->lval(p + _DigSize + _ExpSize, bitof(iv, d_dig + d_exp));
-        // set exponent
-        uint64_t exp = 0;  // on f64, exp -= 1023
-        for (size_t i = 0; i < d_exp; i++)
-            exp |= ((iv >> (d_dig + i)) & 1) << i;
-        exp -= ((uint64_t)1 << (d_exp - 1)) - 1;
-        exp += ((uint64_t)1 << (_ExpSize - 1)) - 1;
+        for (size_t i = 0; i < _Size; i++)
+            env->lval(p + i, bits[i]);
+    }
+    /// Zero-extend n unsigned bits into a fresh wide integer.
+    _WideInt _widen(const _T *a, size_t n) {
+        _WideInt res(_ctx);
+        auto env = _ctx->_env();
+        auto r = res._ptr();
+        for (size_t i = 0; i < _WideSize; i++) {
+            if (i < n)
+                env->ldup(r + i, a + i);
+            else
+                env->lval(r + i, false);
+        }
+        return res;
+    }
+    /// Split p into the mantissa m (_DigSize + 1 bits, hidden bit on top)
+    /// and exponent e (_ExpSize bits). Subnormals get exponent 1 and a
+    /// clear hidden bit, so both cases scale alike.
+    void _unpack(const _T *p, _T *m, _T *e) {
+        auto env = _ctx->_env();
+        for (size_t i = 0; i < _DigSize; i++)
+            env->ldup(m + i, p + i);
+        _EruHazmat::or_reduce(_ctx, m + _DigSize, p + _DigSize, _ExpSize);
         for (size_t i = 0; i < _ExpSize; i++)
-            env->lval(p + _DigSize + i, bitof(exp, i));
-        // set fraction
-        size_t i = 0;
-        for (i = 0; i < d_dig && i < _DigSize; i++)
-            env->lval(p + _DigSize - 1 - i, bitof(iv, d_dig - 1 - i));
-        for (; i < _DigSize; i++)
-            env->lval(p + _DigSize - 1 - i, false);
-        #undef bitof
+            env->ldup(e + i, p + _DigSize + i);
+        env->lorny(e, m + _DigSize, e);
+    }
+    /// Round and write a result into r.
+    /// @param e: biased exponent for m normalized to its top bit.
+    /// @param m: n bits, hidden bit on top, then the fraction, the guard bit
+    ///     and at least one more bit folded into the sticky bit.
+    void _pack(_T *r, const _T *sign, _WideInt &e, const _T *m, size_t n,
+            EruRounding mode) {
+        auto env = _ctx->_env();
+        const _T *hidden = m + n - 1, *frac = m + n - 1 - _DigSize;
+        EruBits<_T> tmp = _ctx->allocate(3);
+        auto t = tmp.ptr();  // [round up, sticky, keep]
+        // r = (fraction, hidden ? exponent : 0), subnormals keep exponent 0
+        _EruHazmat::gate_for<_T>(_DigSize + _ExpSize, [&](size_t i) {
+            if (i < _DigSize)
+                env->ldup(r + i, frac + i);
+            else
+                env->land(r + i, e._ptr() + (i - _DigSize), hidden);
+        });
+        if (mode == ERU_ROUND_NEAREST) {
+            // round up = guard && (sticky || lsb), then let the carry ripple
+            // through fraction into exponent
+            _EruHazmat::or_reduce(_ctx, t + 1, m, n - 2 - _DigSize);
+            env->lor(t + 1, t + 1, frac);
+            env->land(t, t + 1, frac - 1);
+            for (size_t i = 0; i < _DigSize + _ExpSize; i++) {
+                env->lxor(t + 1, r + i, t);
+                env->land(t, r + i, t);
+                env->ldup(r + i, t + 1);
+            }
+        }
+        // out of range: infinity above, flushed to zero below
+        _WideInt bound(_ctx);
+        bound = ((int64_t)1 << _ExpSize) - 1;
+        EruBool<_T> inf = e >= bound;
+        bound = 0;
+        EruBool<_T> zero = e <= bound;
+        env->land(inf._ptr(), inf._ptr(), hidden);
+        env->lnor(t + 2, inf._ptr(), zero._ptr());
+        _EruHazmat::gate_for<_T>(_DigSize + _ExpSize, [&](size_t i) {
+            if (i < _DigSize) {
+                env->land(r + i, r + i, t + 2);
+            } else {
+                env->lor(r + i, r + i, inf._ptr());
+                env->landyn(r + i, r + i, zero._ptr());
+            }
+        });
+        env->ldup(r + _DigSize + _ExpSize, sign);
+        _ctx->free(tmp);
+    }
+    /// Sum of this and other, other's sign flipped if negate.
+    _Self _add(_Self &other, bool negate, EruRounding mode) {
+        _check_sibling(&other);
+        constexpr size_t M = _DigSize, E = _ExpSize, W = M + 4;
+        constexpr size_t L = _EruHazmat::bit_width(W + 1);
+        constexpr size_t Y = (L > E ? L : E);
+        auto env = _ctx->_env();
+        EruBits<_T> res = _ctx->allocate(_Size);
+        // order operands by magnitude so the difference stays positive
+        EruBits<_T> ops = _ctx->allocate(3 * _Size + 1);
+        auto a = _ptr(), b = ops.ptr(), big = b + _Size;
+        auto small = big + _Size, lt = small + _Size;
+        for (size_t i = 0; i < _Size; i++)
+            env->ldup(b + i, other._ptr() + i);
+        if (negate)
+            env->lnot(b + _Size - 1, b + _Size - 1);
+        _EruHazmat::less_unsigned(_ctx, lt, a, b, E + M);
+        _EruHazmat::gate_for<_T>(_Size, [&](size_t i) {
+            env->lifelse(big + i, lt, b + i, a + i);
+            env->lifelse(small + i, lt, a + i, b + i);
+        });
+        // mantissas widened by guard, round and sticky bits
+        EruBits<_T> work = _ctx->allocate(4 * W + 2 * E + 2 * Y + 6);
+        auto mb = work.ptr(), ms = mb + W, sum = ms + W, sh = sum + W + 1;
+        auto eb = sh + W + 1, es = eb + E, lz = es + E, amt = lz + Y;
+        auto t = amt + Y;  // [effective subtraction, carry, scratch x 2]
+        for (size_t i = 0; i < 3; i++) {
+            env->lval(mb + i, false);
+            env->lval(ms + i, false);
+        }
+        _unpack(big, mb + 3, eb);
+        _unpack(small, ms + 3, es);
+        // align the smaller operand on the exponent difference
+        {
+            _ExpInt xb(_ctx), xs(_ctx);
+            for (size_t i = 0; i < E; i++) {
+                env->ldup(xb._ptr() + i, eb + i);
+                env->ldup(xs._ptr() + i, es + i);
+            }
+            _ExpInt d = xb - xs;
+            _EruHazmat::barrel_shift(_ctx, ms, ms, W, d._ptr(), E, false,
+                true);
+        }
+        // sum = mb + ms, or mb + ~ms + 1 on opposite signs, with one more
+        // bit for the carry out
+        env->lxor(t, big + _Size - 1, small + _Size - 1);
+        _EruHazmat::gate_for<_T>(W, [&](size_t i) {
+            env->lxor(ms + i, ms + i, t);
+        });
+        env->ldup(t + 1, t);
+        for (size_t i = 0; i < W; i++) {
+            env->lxor(t + 2, mb + i, ms + i);
+            env->lxor(sum + i, t + 2, t + 1);
+            env->land(t + 3, t + 2, t + 1);
+            env->land(t + 2, mb + i, ms + i);
+            env->lor(t + 1, t + 2, t + 3);
+        }
+        env->lxor(sum + W, t, t + 1);
+        // normalize, but never below exponent 1 so subnormals come out
+        _EruHazmat::count_leading_zeros(_ctx, lz, sum, W + 1);
+        for (size_t i = L; i < Y; i++)
+            env->lval(lz + i, false);
+        for (size_t i = 0; i < Y; i++) {
+            if (i < E)
+                env->ldup(amt + i, eb + i);
+            else
+                env->lval(amt + i, false);
+        }
+        _EruHazmat::less_unsigned(_ctx, t + 2, amt, lz, Y);
+        _EruHazmat::gate_for<_T>(Y, [&](size_t i) {
+            env->lifelse(amt + i, t + 2, amt + i, lz + i);
+        });
+        _EruHazmat::barrel_shift(_ctx, sh, sum, W + 1, amt, Y, true);
+        _WideInt e = _widen(eb, E), s = _widen(amt, Y), one(_ctx);
+        one = 1;
+        e += one;
+        e -= s;
+        _pack(res.ptr(), big + _Size - 1, e, sh, W + 1, mode);
+        _ctx->free(work);
+        _ctx->free(ops);
+        return _Self(_ctx, res);
+    }
+    /// Product of this and other.
+    _Self _mul(_Self &other, EruRounding mode) {
+        _check_sibling(&other);
+        constexpr size_t M = _DigSize, E = _ExpSize, N = (M + 1) * 2;
+        constexpr size_t L = _EruHazmat::bit_width(N);
+        auto env = _ctx->_env();
+        EruBits<_T> res = _ctx->allocate(_Size);
+        EruBits<_T> work = _ctx->allocate(2 * E + L + N + 1);
+        auto ea = work.ptr(), eb = ea + E, lz = eb + E, sh = lz + L;
+        auto sign = sh + N;
+        _DigInt ma(_ctx), mb(_ctx);
+        ma = 0;
+        mb = 0;
+        _unpack(_ptr(), ma._ptr(), ea);
+        _unpack(other._ptr(), mb._ptr(), eb);
+        env->lxor(sign, _ptr() + _Size - 1, other._ptr() + _Size - 1);
+        // the full double-width product, normalized to its top bit
+        _DigInt prod = ma * mb;
+        _EruHazmat::count_leading_zeros(_ctx, lz, prod._ptr(), N);
+        _EruHazmat::barrel_shift(_ctx, sh, prod._ptr(), N, lz, L, true);
+        // e = ea + eb - bias + 1 - lz, the 1 for the product's extra integer
+        // bit
+        _WideInt e = _widen(ea, E), x = _widen(eb, E), bias(_ctx);
+        bias = ((int64_t)1 << (E - 1)) - 2;
+        e += x;
+        e -= bias;
+        x = _widen(lz, L);
+        e -= x;
+        _pack(res.ptr(), sign, e, sh, N, mode);
+        _ctx->free(work);
+        return _Self(_ctx, res);
+    }
+    /// a < b on magnitudes only.
+    EruBits<_T> _less(const _T *a, const _T *b) {
+        EruBits<_T> res = _ctx->allocate(1);
+        _EruHazmat::less_unsigned(_ctx, res.ptr(), a, b,
+            _ExpSize + _DigSize);
+        return res;
+    }
+    /// Both this and other are zero, of either sign.
+    EruBits<_T> _both_zero(_Self &other) {
+        EruBits<_T> res = _ctx->allocate(1);
+        EruBits<_T> tmp = _ctx->allocate(_Size - 1);
+        auto env = _ctx->_env();
+        auto a = _ptr(), b = other._ptr(), t = tmp.ptr();
+        _EruHazmat::gate_for<_T>(_Size - 1, [&](size_t i) {
+            env->lor(t + i, a + i, b + i);
+        });
+        _EruHazmat::or_reduce(_ctx, res.ptr(), t, _Size - 1);
+        env->lnot(res.ptr(), res.ptr());
+        _ctx->free(tmp);
+        return res;
     }
 public:
     /// Get delegated pointer. Dangerous!
     _T* _ptr() const {
         return _value.ptr();
     }
+    /// Number of delegated bits.
+    static constexpr size_t _width() {
+        return _Size;
+    }
     /// Raw constructor. Value undetermined.
     EruFloatGeneral(EruContext<_T> *ctx) : _ctx(ctx), _active(true) {
         _value = _ctx->allocate(_Size);
@@ -75,6 +331,12 @@ public:
         for (size_t i = 0; i < _Size; i++)
             env->ldup(p1 + i, p2 + i);
     }
+    /// Move constructor. Takes over the bits of a temporary.
+    /// EruFloatGeneral this(other_expr);
+    EruFloatGeneral(_Self &&other) : _ctx(other._ctx), _value(other._value),
+            _active(other._active) {
+        other._active = false;  // won't free over there this time
+    }
     /// Copy constructor. Will not copy itself.
     /// EruIntGeneral this = other;
     _Self& operator = (_Self &other) {
@@ -104,34 +366,41 @@ public:
     }
     /// Encrypt & decrypt
     void encrypt(const double value) {
-        _assign(value);
+        bool bits[_Size];
+        _pack(value, bits);
+        _ctx->_env()->encrypt_many(_ptr(), bits, _Size);
     }
     double decrypt() {
-        const size_t d_exp = 11, d_dig = 52;
-        uint64_t result = 0;
+        const int64_t bias = ((int64_t)1 << (_ExpSize - 1)) - 1;
+        const int64_t inf = ((int64_t)1 << _ExpSize) - 1;
         auto env = _ctx->_env();
         auto p = _ptr();
-        // extract sign
-        #define setbit(t, x, y) t |= (env->decrypt(p + (y)) ?                 \
-            (uint64_t)1 : 0) << (x)
-        // extract exponent
-        uint64_t exp = 0;  // on f64, exp -= 1023
+        int64_t exp = 0;
         for (size_t i = 0; i < _ExpSize; i++)
-            setbit(exp, i, _DigSize + i);
-        exp -= ((uint64_t)1 << (_ExpSize - 1)) - 1;
-        exp += ((uint64_t)1 << (d_exp - 1)) - 1;
-        for (size_t i = 0; i < d_exp; i++)
-            result |= ((exp >> i) & 1) << (d_dig + i);
-        // extract fraction
-        for (size_t i = 0; i < _DigSize && i < d_dig; i++)
-            setbit(result, d_dig - 1 - i, _DigSize - 1 - i);
-        #undef setbit
-        return *(double*)(&result);
+            if (env->decrypt(p + _DigSize + i))
+                exp |= (int64_t)1 << i;
+        double mant = 0.0;
+        for (size_t i = 0; i < _DigSize; i++)
+            if (env->decrypt(p + i))
+                mant += std::ldexp(1.0, (int)i - (int)_DigSize);
+        double result;
+        if (exp == inf)  // no NaNs yet
+            result = INFINITY;
+        else if (exp == 0)
+            result = std::ldexp(mant, 1 - (int)bias);
+        else
+            result = std::ldexp(1.0 + mant, (int)(exp - bias));
+        return env->decrypt(p + _DigSize + _ExpSize) ? -result : result;
     }
     /// Import & export
-    void bimport(const EruData &data) {
-        auto split = _EruHazmat::binobjlist_decode(data);
+    void bimport(EruDataView data) {
+        if (_ctx->_env()->bimport_seeded(_ptr(), _Size, data))
+            return;
+        auto split = _EruHazmat::binobjlist_view(data);
+        if (split.size() < _Size)
+            throw std::runtime_error("truncated ciphertext");
         auto env = _ctx->_env();
+        _EruHazmat::check_params_tag(split, _Size, env->btag());
         auto p = _ptr();
         for (size_t i = 0; i < _Size; i++)
             env->bimport(p + i, split[i]);
@@ -142,13 +411,123 @@ public:
         auto p = _ptr();
         for (size_t i = 0; i < _Size; i++)
             tmp.push_back(env->bexport(p + i));
+        EruData tag = env->btag();
+        if (!tag.empty())
+            tmp.push_back(tag);
         return _EruHazmat::binobjlist_encode(tmp);
     }
+    /// Compact export of a freshly encrypted value: a seed the masks are
+    /// expanded from and one body per bit, about n times smaller than
+    /// bexport. Rewrites the masks in place and needs the secret key.
+    /// bimport takes either format.
+    EruData bexport_compact() {
+        return _ctx->_env()->bexport_seeded(_ptr(), _Size);
+    }
     /// Sets constant value.
     _Self& operator = (const double value) {
         _assign(value);
         return *this;
     }
+    /// Arithmetic with explicit rounding. The operators round as the type
+    /// says.
+    _Self add(_Self &other, EruRounding mode) {
+        return _add(other, false, mode);
+    }
+    _Self sub(_Self &other, EruRounding mode) {
+        return _add(other, true, mode);
+    }
+    _Self mul(_Self &other, EruRounding mode) {
+        return _mul(other, mode);
+    }
+    /// Addition.
+    _Self operator + (_Self &other) {
+        return _add(other, false, _Round);
+    }
+    _Self& operator += (_Self &other) {
+        *this = _add(other, false, _Round);
+        return *this;
+    }
+    /// Subtraction.
+    _Self operator - (_Self &other) {
+        return _add(other, true, _Round);
+    }
+    _Self& operator -= (_Self &other) {
+        *this = _add(other, true, _Round);
+        return *this;
+    }
+    /// Negate value, which only flips the sign.
+    _Self operator - () {
+        _Self res(*this);
+        auto p = res._ptr() + _Size - 1;
+        _ctx->_env()->lnot(p, p);
+        return res;
+    }
+    /// Multiply!
+    _Self operator * (_Self &other) {
+        return _mul(other, _Round);
+    }
+    _Self& operator *= (_Self &other) {
+        *this = _mul(other, _Round);
+        return *this;
+    }
+    /// Equality, +0 equals -0.
+    EruBool<_T> operator == (_Self &other) {
+        _check_sibling(&other);
+        EruBits<_T> res = _ctx->allocate(1);
+        EruBits<_T> tmp = _ctx->allocate(_Size);
+        auto env = _ctx->_env();
+        auto a = _ptr(), b = other._ptr(), t = tmp.ptr();
+        _EruHazmat::gate_for<_T>(_Size, [&](size_t i) {
+            env->lxor(t + i, a + i, b + i);
+        });
+        _EruHazmat::or_reduce(_ctx, res.ptr(), t, _Size);
+        EruBits<_T> zero = _both_zero(other);
+        env->lorny(res.ptr(), res.ptr(), zero.ptr());
+        _ctx->free(zero);
+        _ctx->free(tmp);
+        return EruBool<_T>(_ctx, res);
+    }
+    EruBool<_T> operator != (_Self &other) {
+        EruBool<_T> res = *this == other;
+        _ctx->_env()->lnot(res._ptr(), res._ptr());
+        return res;
+    }
+    /// Ordering. Magnitudes compare as integers, so only the signs need
+    /// sorting out.
+    EruBool<_T> operator < (_Self &other) {
+        _check_sibling(&other);
+        auto env = _ctx->_env();
+        auto sa = _ptr() + _Size - 1, sb = other._ptr() + _Size - 1;
+        EruBits<_T> ab = _less(_ptr(), other._ptr());
+        EruBits<_T> ba = _less(other._ptr(), _ptr());
+        EruBits<_T> zero = _both_zero(other);
+        EruBits<_T> res = _ctx->allocate(1);
+        auto r = res.ptr();
+        // same signs: negative numbers order by reverse magnitude
+        env->lifelse(ab.ptr(), sa, ba.ptr(), ab.ptr());
+        // different signs: a < b iff a is the negative one, unless both
+        // are zeros
+        env->landyn(ba.ptr(), sa, zero.ptr());
+        env->lxor(r, sa, sb);
+        env->lifelse(r, r, ba.ptr(), ab.ptr());
+        _ctx->free(zero);
+        _ctx->free(ba);
+        _ctx->free(ab);
+        return EruBool<_T>(_ctx, res);
+    }
+    EruBool<_T> operator > (_Self &other) {
+        return other < *this;
+    }
+    EruBool<_T> operator <= (_Self &other) {
+        EruBool<_T> res = other < *this;
+        _ctx->_env()->lnot(res._ptr(), res._ptr());
+        return res;
+    }
+    EruBool<_T> operator >= (_Self &other) {
+        EruBool<_T> res = *this < other;
+        _ctx->_env()->lnot(res._ptr(), res._ptr());
+        return res;
+    }
 };
 
 #define EruFloat16(_T) EruFloatGeneral<_T, 5, 10>
@@ -2,6 +2,11 @@
 #ifndef _LIBERU_TYPE_INT
 #define _LIBERU_TYPE_INT
 
+#include <algorithm>
+#include <utility>
+#include <vector>
+
+#include "circuit.h"
 #include "context.h"
 #include "type_bool.h"
 
@@ -11,6 +16,7 @@
 /// [2^0] [2^1] ... [2^_Size-1] [sign: 0 = positive, 1 = negative]
 template <typename _T, size_t _Size>
 class EruIntGeneral {
+    template <typename, size_t> friend class EruIntGeneral;
 private:
     EruContext<_T> *_ctx;
     EruBits<_T> _value;
@@ -47,6 +53,10 @@ public:
     _T* _ptr() const {
         return _value.ptr();
     }
+    /// Number of delegated bits.
+    static constexpr size_t _width() {
+        return _Size;
+    }
     /// Raw constructor. Value undetermined.
     EruIntGeneral(EruContext<_T> *ctx) : _ctx(ctx), _active(true) {
         _value = _ctx->allocate(_Size);
@@ -64,6 +74,12 @@ public:
         for (size_t i = 0; i < _Size; i++)
             env->ldup(p1 + i, p2 + i);
     }
+    /// Move constructor. Takes over the bits of a temporary.
+    /// EruIntGeneral this(other_expr);
+    EruIntGeneral(EruIntGeneral<_T, _Size> &&other) : _ctx(other._ctx),
+            _value(other._value), _active(other._active) {
+        other._active = false;  // won't free over there this time
+    }
     /// Copy constructor. Will not copy itself.
     /// EruIntGeneral this = other;
     EruIntGeneral<_T, _Size>& operator = (EruIntGeneral<_T, _Size> &other) {
@@ -93,34 +109,32 @@ public:
     }
     /// Encrypt & decrypt
     void encrypt(const int64_t value) {
-        auto env = _ctx->_env();
-        auto p = _ptr();
-        if (value >= 0) {
-            for (size_t i = 0; i < 63 && i < _Size; i++)
-                env->encrypt(p + i, (value & (1ll << i)) ? true : false);
-            for (size_t i = 63; i < _Size; i++)
-                env->encrypt(p + i, false);
-        } else {
-            uint64_t *uvalue = (uint64_t*)&value;
-            for (size_t i = 0; i < 64 && i < _Size; *uvalue >>= 1, i++)
-                env->encrypt(p + i, (*uvalue & 1) ? true : false);
-            for (size_t i = 64; i < _Size; i++)
-                env->encrypt(p + i, true);
-        }
+        bool bits[_Size];
+        for (size_t i = 0; i < _Size; i++)
+            bits[i] = i < 64 ? ((uint64_t)value >> i) & 1 : value < 0;
+        _ctx->_env()->encrypt_many(_ptr(), bits, _Size);
     }
     int64_t decrypt() {
         uint64_t result = 0;
-        auto env = _ctx->_env();
-        auto p = _ptr();
+        bool bits[_Size];
+        _ctx->_env()->decrypt_many(_ptr(), bits, _Size);
         for (size_t i = 0; i < 64 && i < _Size; i++)
-            if (env->decrypt(p + i))
+            if (bits[i])
                 result |= (uint64_t)1 << i;
+        // sign-extend narrower integers
+        if (_Size < 64 && (result & ((uint64_t)1 << (_Size - 1))))
+            result |= ~(uint64_t)0 << (_Size % 64);
         return *(int64_t*)(&result);
     }
     /// Import & export
-    void bimport(const EruData &data) {
-        auto split = _EruHazmat::binobjlist_decode(data);
+    void bimport(EruDataView data) {
+        if (_ctx->_env()->bimport_seeded(_ptr(), _Size, data))
+            return;
+        auto split = _EruHazmat::binobjlist_view(data);
+        if (split.size() < _Size)
+            throw std::runtime_error("truncated ciphertext");
         auto env = _ctx->_env();
+        _EruHazmat::check_params_tag(split, _Size, env->btag());
         auto p = _ptr();
         for (size_t i = 0; i < _Size; i++)
             env->bimport(p + i, split[i]);
@@ -131,8 +145,18 @@ public:
         auto p = _ptr();
         for (size_t i = 0; i < _Size; i++)
             tmp.push_back(env->bexport(p + i));
+        EruData tag = env->btag();
+        if (!tag.empty())
+            tmp.push_back(tag);
         return _EruHazmat::binobjlist_encode(tmp);
     }
+    /// Compact export of a freshly encrypted value: a seed the masks are
+    /// expanded from and one body per bit, about n times smaller than
+    /// bexport. Rewrites the masks in place and needs the secret key.
+    /// bimport takes either format.
+    EruData bexport_compact() {
+        return _ctx->_env()->bexport_seeded(_ptr(), _Size);
+    }
     /// Sets constant value.
     EruIntGeneral<_T, _Size>& operator = (const int64_t value) {
         _assign(value);
@@ -230,8 +254,14 @@ public:
         _ctx->free(flag);
         return EruIntGeneral<_T, _Size>(_ctx, res);
     }
+    /// Shifts by _Size or more move every bit out, clamp them there.
+    static int64_t _clamp_shift(int64_t bits) {
+        return std::max<int64_t>(-(int64_t)_Size,
+            std::min<int64_t>(bits, _Size));
+    }
     /// Left-shift (equiv. *2)
     EruIntGeneral<_T, _Size> operator << (int64_t bits) {
+        bits = _clamp_shift(bits);
         if (bits < 0)
             return *this >> (-bits);
         EruBits<_T> res = _ctx->allocate(_Size);
@@ -244,6 +274,7 @@ public:
         return EruIntGeneral<_T, _Size>(_ctx, res);
     }
     EruIntGeneral<_T, _Size>& operator <<= (int64_t bits) {
+        bits = _clamp_shift(bits);
         if (bits < 0) {
             *this >>= (-bits);
             return *this;
@@ -258,6 +289,7 @@ public:
     }
     /// Right-shift (equiv. /2)
     EruIntGeneral<_T, _Size> operator >> (int64_t bits) {
+        bits = _clamp_shift(bits);
         if (bits < 0)
             return *this << (-bits);
         EruBits<_T> res = _ctx->allocate(_Size);
@@ -271,6 +303,7 @@ public:
         return EruIntGeneral<_T, _Size>(_ctx, res);
     }
     EruIntGeneral<_T, _Size> operator >>= (int64_t bits) {
+        bits = _clamp_shift(bits);
         if (bits < 0) {
             *this <<= (-bits);
             return *this;
@@ -284,6 +317,50 @@ public:
             env->ldup(a + i, a + (_Size - 1));
         return *this;
     }
+    /// Shifts by an encrypted amount, read as unsigned. Shifting by _Size
+    /// or more clears the value, or fills it with the sign on >>.
+    template <size_t _ASize>
+    EruIntGeneral<_T, _Size> operator << (EruIntGeneral<_T, _ASize> &amount) {
+        return _shift(amount, true);
+    }
+    template <size_t _ASize>
+    EruIntGeneral<_T, _Size>& operator <<= (
+            EruIntGeneral<_T, _ASize> &amount) {
+        *this = _shift(amount, true);
+        return *this;
+    }
+    template <size_t _ASize>
+    EruIntGeneral<_T, _Size> operator >> (EruIntGeneral<_T, _ASize> &amount) {
+        return _shift(amount, false);
+    }
+    template <size_t _ASize>
+    EruIntGeneral<_T, _Size>& operator >>= (
+            EruIntGeneral<_T, _ASize> &amount) {
+        *this = _shift(amount, false);
+        return *this;
+    }
+    /// Rotations, by a plaintext amount (free) or an encrypted one read as
+    /// unsigned. Amounts wrap modulo _Size.
+    EruIntGeneral<_T, _Size> rotl(int64_t bits) {
+        size_t by = (size_t)(((bits % (int64_t)_Size) + _Size) % _Size);
+        EruBits<_T> res = _ctx->allocate(_Size);
+        auto env = _ctx->_env();
+        auto a = _ptr(), b = res.ptr();
+        for (size_t i = 0; i < _Size; i++)
+            env->ldup(b + (i + by) % _Size, a + i);
+        return EruIntGeneral<_T, _Size>(_ctx, res);
+    }
+    EruIntGeneral<_T, _Size> rotr(int64_t bits) {
+        return rotl(-(bits % (int64_t)_Size));
+    }
+    template <size_t _ASize>
+    EruIntGeneral<_T, _Size> rotl(EruIntGeneral<_T, _ASize> &amount) {
+        return _rotate(amount, true);
+    }
+    template <size_t _ASize>
+    EruIntGeneral<_T, _Size> rotr(EruIntGeneral<_T, _ASize> &amount) {
+        return _rotate(amount, false);
+    }
     /// Multiply!
     EruIntGeneral<_T, _Size> operator * (EruIntGeneral<_T, _Size> &other) {
         _check_sibling(&other);
@@ -300,7 +377,6 @@ public:
             auto p2 = tmp._ptr();
             for (size_t j = 0; j < _Size; j++)
                 env->land(p2 + j, p2 + j, p1 + i);
-            printf("  operating on (%lu/%lu)\n", i, _Size);
             res += tmp;
         }
         return res;
@@ -328,6 +404,325 @@ public:
     eru_int_binary_op(operator |, lor);
     eru_int_binary_op(operator ^, lxor);
     #undef eru_int_binary_op
+    EruIntGeneral<_T, _Size> operator ~ () {
+        EruBits<_T> res = _ctx->allocate(_Size);
+        auto env = _ctx->_env();
+        auto a = _ptr(), b = res.ptr();
+        for (size_t i = 0; i < _Size; i++)
+            env->lnot(b + i, a + i);
+        return EruIntGeneral<_T, _Size>(_ctx, res);
+    }
+    /// Equality.
+    EruBool<_T> operator == (EruIntGeneral<_T, _Size> &other) {
+        _check_sibling(&other);
+        EruBits<_T> res = _ctx->allocate(1);
+        EruBits<_T> tmp = _ctx->allocate(1);
+        auto env = _ctx->_env();
+        auto a = _ptr(), b = other._ptr(), r = res.ptr(), t = tmp.ptr();
+        env->lxnor(r, a, b);
+        for (size_t i = 1; i < _Size; i++) {
+            env->lxnor(t, a + i, b + i);
+            env->land(r, r, t);
+        }
+        _ctx->free(tmp);
+        return EruBool<_T>(_ctx, res);
+    }
+    EruBool<_T> operator != (EruIntGeneral<_T, _Size> &other) {
+        EruBool<_T> res = *this == other;
+        _ctx->_env()->lnot(res._ptr(), res._ptr());
+        return res;
+    }
+    /// Signed ordering.
+    EruBool<_T> operator < (EruIntGeneral<_T, _Size> &other) {
+        _check_sibling(&other);
+        return EruBool<_T>(_ctx, _less(_ptr(), other._ptr()));
+    }
+    EruBool<_T> operator > (EruIntGeneral<_T, _Size> &other) {
+        _check_sibling(&other);
+        return EruBool<_T>(_ctx, _less(other._ptr(), _ptr()));
+    }
+    EruBool<_T> operator <= (EruIntGeneral<_T, _Size> &other) {
+        EruBool<_T> res = *this > other;
+        _ctx->_env()->lnot(res._ptr(), res._ptr());
+        return res;
+    }
+    EruBool<_T> operator >= (EruIntGeneral<_T, _Size> &other) {
+        EruBool<_T> res = *this < other;
+        _ctx->_env()->lnot(res._ptr(), res._ptr());
+        return res;
+    }
+    /// Quotient and remainder, rounding toward zero like C. Unsigned when
+    /// is_signed is false. Dividing by an encrypted zero can't trap: it
+    /// gives the dividend as remainder and an all-ones quotient unsigned;
+    /// signed, the quotient is -1, or 1 for negative dividends.
+    std::pair<EruIntGeneral<_T, _Size>, EruIntGeneral<_T, _Size>> divmod(
+            EruIntGeneral<_T, _Size> &other, bool is_signed = true) {
+        _check_sibling(&other);
+        EruIntGeneral<_T, _Size> q(_ctx), r(_ctx);
+        if (!is_signed) {
+            _udivmod(q._ptr(), r._ptr(), _ptr(), other._ptr());
+            return std::make_pair(std::move(q), std::move(r));
+        }
+        // divide magnitudes, then quotient takes sign a ^ b and remainder
+        // the sign of a
+        EruBits<_T> tmp = _ctx->allocate(2 * _Size + 1);
+        auto a = tmp.ptr(), b = a + _Size, sq = b + _Size;
+        auto sa = _ptr() + _Size - 1, sb = other._ptr() + _Size - 1;
+        _negate_if(a, _ptr(), sa);
+        _negate_if(b, other._ptr(), sb);
+        _udivmod(q._ptr(), r._ptr(), a, b);
+        _ctx->_env()->lxor(sq, sa, sb);
+        _negate_if(q._ptr(), q._ptr(), sq);
+        _negate_if(r._ptr(), r._ptr(), sa);
+        _ctx->free(tmp);
+        return std::make_pair(std::move(q), std::move(r));
+    }
+    /// Division by a plaintext constant, as a multiplication by its
+    /// precomputed reciprocal. Powers of two cost nothing but the sign
+    /// handling.
+    std::pair<EruIntGeneral<_T, _Size>, EruIntGeneral<_T, _Size>> divmod(
+            int64_t divisor, bool is_signed = true) {
+        if (divisor == 0)
+            throw std::runtime_error("division by zero");
+        EruIntGeneral<_T, _Size> q(_ctx);
+        uint64_t d = (uint64_t)divisor;
+        if (!is_signed) {
+            _udiv_const(q._ptr(), _ptr(), d);
+        } else {
+            if (divisor < 0)
+                d = ~d + 1;
+            EruBits<_T> tmp = _ctx->allocate(_Size + 1);
+            auto a = tmp.ptr(), sq = a + _Size;
+            auto sa = _ptr() + _Size - 1;
+            _negate_if(a, _ptr(), sa);
+            _udiv_const(q._ptr(), a, d);
+            if (divisor < 0)
+                _ctx->_env()->lnot(sq, sa);
+            else
+                _ctx->_env()->ldup(sq, sa);
+            _negate_if(q._ptr(), q._ptr(), sq);
+            _ctx->free(tmp);
+        }
+        // r = a - q * divisor
+        EruIntGeneral<_T, _Size> qd(_ctx);
+        std::vector<bool> m(_Size > 64 ? _Size : 64);
+        for (size_t i = 0; i < m.size(); i++)
+            m[i] = i < 64 ? ((uint64_t)divisor >> i) & 1 :
+                is_signed && divisor < 0;
+        _mul_const(qd._ptr(), _Size, q._ptr(), _Size, m);
+        EruIntGeneral<_T, _Size> r = *this - qd;
+        return std::make_pair(std::move(q), std::move(r));
+    }
+    EruIntGeneral<_T, _Size> operator / (EruIntGeneral<_T, _Size> &other) {
+        return std::move(divmod(other).first);
+    }
+    EruIntGeneral<_T, _Size>& operator /= (EruIntGeneral<_T, _Size> &other) {
+        *this = std::move(divmod(other).first);
+        return *this;
+    }
+    EruIntGeneral<_T, _Size> operator % (EruIntGeneral<_T, _Size> &other) {
+        return std::move(divmod(other).second);
+    }
+    EruIntGeneral<_T, _Size>& operator %= (EruIntGeneral<_T, _Size> &other) {
+        *this = std::move(divmod(other).second);
+        return *this;
+    }
+    EruIntGeneral<_T, _Size> operator / (int64_t divisor) {
+        return std::move(divmod(divisor).first);
+    }
+    EruIntGeneral<_T, _Size>& operator /= (int64_t divisor) {
+        *this = std::move(divmod(divisor).first);
+        return *this;
+    }
+    EruIntGeneral<_T, _Size> operator % (int64_t divisor) {
+        return std::move(divmod(divisor).second);
+    }
+    EruIntGeneral<_T, _Size>& operator %= (int64_t divisor) {
+        *this = std::move(divmod(divisor).second);
+        return *this;
+    }
+private:
+    template <size_t _ASize>
+    EruIntGeneral<_T, _Size> _shift(EruIntGeneral<_T, _ASize> &amount,
+            bool left) {
+        if (_ctx != amount._ctx)
+            throw std::runtime_error("attempting cross-context arithmetic");
+        EruBits<_T> res = _ctx->allocate(_Size);
+        _EruHazmat::barrel_shift(_ctx, res.ptr(), _ptr(), _Size,
+            amount._ptr(), _ASize, left, false,
+            left ? nullptr : _ptr() + _Size - 1);
+        return EruIntGeneral<_T, _Size>(_ctx, res);
+    }
+    template <size_t _ASize>
+    EruIntGeneral<_T, _Size> _rotate(EruIntGeneral<_T, _ASize> &amount,
+            bool left) {
+        if (_ctx != amount._ctx)
+            throw std::runtime_error("attempting cross-context arithmetic");
+        EruBits<_T> res = _ctx->allocate(_Size);
+        _EruHazmat::barrel_rotate(_ctx, res.ptr(), _ptr(), _Size,
+            amount._ptr(), _ASize, left);
+        return EruIntGeneral<_T, _Size>(_ctx, res);
+    }
+    /// r = sign ? -a : a. Negating flips every bit above the lowest set
+    /// one, so bit i flips when sign and any bit below i is set. r may
+    /// alias a, sign may not alias r.
+    void _negate_if(_T *r, const _T *a, const _T *sign) {
+        constexpr size_t n = _Size;
+        auto env = _ctx->_env();
+        if (n == 1) {
+            env->ldup(r, a);
+            return;
+        }
+        // low[i - 1]: any of a[0 .. i - 1] set
+        EruBits<_T> tmp = _ctx->allocate(2 * (n - 1));
+        auto low = tmp.ptr(), flip = low + n - 1;
+        env->ldup(low, a);
+        for (size_t i = 1; i + 1 < n; i++)
+            env->lor(low + i, low + i - 1, a + i);
+        _EruHazmat::gate_for<_T>(n - 1, [&](size_t i) {
+            env->land(flip + i, low + i, sign);
+            env->lxor(r + i + 1, a + i + 1, flip + i);
+        });
+        env->ldup(r, a);
+        _ctx->free(tmp);
+    }
+    /// r = a + b + carry over n bits as a ripple adder, three bootstraps a
+    /// bit. carry may be null, r may alias neither a nor b.
+    void _ripple_add(_T *r, const _T *a, const _T *b, size_t n,
+            const _T *carry) {
+        auto env = _ctx->_env();
+        EruBits<_T> tmp = _ctx->allocate(2);
+        auto c = tmp.ptr(), t = c + 1;
+        if (carry != nullptr)
+            env->ldup(c, carry);
+        else
+            env->lval(c, false);
+        for (size_t i = 0; i < n; i++) {
+            env->lxor(t, a + i, b + i);
+            env->lxor(r + i, t, c);
+            if (i + 1 < n)
+                env->lifelse(c, t, c, a + i);
+        }
+        _ctx->free(tmp);
+    }
+    /// Unsigned non-restoring division. The partial remainder may go
+    /// negative instead of being restored, so every step is a single
+    /// ripple adder that adds or subtracts the divisor depending on its
+    /// sign.
+    void _udivmod(_T *q, _T *r, const _T *a, const _T *b) {
+        constexpr size_t n = _Size;
+        auto env = _ctx->_env();
+        // rem: n + 1 bit partial remainder, sh: it shifted in, y: +/- b
+        EruBits<_T> buf = _ctx->allocate(3 * (n + 1) + 1);
+        auto rem = buf.ptr(), sh = rem + n + 1, y = sh + n + 1;
+        auto sub = y + n + 1;
+        for (size_t i = 0; i <= n; i++)
+            env->lval(rem + i, false);
+        for (size_t k = n; k >= 1; k--) {
+            // sh = 2 * rem + a[k - 1], dropping the top bit is safe as the
+            // result is back within n + 1 bits
+            env->ldup(sh, a + (k - 1));
+            for (size_t i = 1; i <= n; i++)
+                env->ldup(sh + i, rem + i - 1);
+            // subtract while the remainder is non-negative: sh + ~b + 1
+            env->lnot(sub, rem + n);
+            _EruHazmat::gate_for<_T>(n + 1, [&](size_t i) {
+                if (i < n)
+                    env->lxor(y + i, b + i, sub);
+                else
+                    env->ldup(y + i, sub);
+            });
+            _ripple_add(rem, sh, y, n + 1, sub);
+            env->lnot(q + (k - 1), rem + n);
+        }
+        // a negative final remainder still owes one divisor
+        _EruHazmat::gate_for<_T>(n, [&](size_t i) {
+            env->land(y + i, b + i, rem + n);
+        });
+        _ripple_add(r, rem, y, n, nullptr);
+        _ctx->free(buf);
+    }
+    /// r = a * m over r_size bits, a unsigned a_size bits and m a plaintext
+    /// constant. Only the set bits of m cost an addition.
+    void _mul_const(_T *r, size_t r_size, const _T *a, size_t a_size,
+            const std::vector<bool> &m) {
+        auto env = _ctx->_env();
+        for (size_t i = 0; i < r_size; i++)
+            env->lval(r + i, false);
+        for (size_t j = 0; j < m.size() && j < r_size; j++) {
+            if (!m[j])
+                continue;
+            // rows so far sum below 2^(j + a_size), so the carry out of
+            // this one lands on a clear bit
+            size_t w = a_size < r_size - j ? a_size : r_size - j;
+            _EruHazmat::prefix_add<_T>(_ctx, r + j, r + j, a, w, nullptr,
+                j + w < r_size ? r + j + w : nullptr);
+        }
+    }
+    /// q = a / d for unsigned a, with the round-up reciprocal of
+    /// Granlund & Montgomery: for l = ceil(log2(d)) and
+    /// m = ceil(2^(n + l) / d) < 2^(n + 1), floor(a * m / 2^(n + l)) is
+    /// exact for every n-bit a.
+    void _udiv_const(_T *q, const _T *a, uint64_t d) {
+        constexpr size_t n = _Size;
+        auto env = _ctx->_env();
+        size_t l = 0;
+        while (l < 64 && ((uint64_t)1 << l) < d)
+            l++;
+        if (l < 64 && ((uint64_t)1 << l) == d) {  // powers of two shift
+            for (size_t i = 0; i < n; i++) {
+                if (i + l < n)
+                    env->ldup(q + i, a + i + l);
+                else
+                    env->lval(q + i, false);
+            }
+            return;
+        }
+        // long division of 2^(n + l) by d, the remainder stays below d
+        std::vector<bool> m(n + l + 1, false);
+        uint64_t rem = 0;
+        for (size_t i = n + l + 1; i >= 1; i--) {
+            bool bit = i - 1 == n + l;
+            bool over = rem >> 63;
+            rem = (rem << 1) | (bit ? 1 : 0);
+            if (over || rem >= d) {
+                rem -= d;
+                m[i - 1] = true;
+            }
+        }
+        for (size_t i = 0; rem != 0 && i < m.size(); i++) {  // round up
+            m[i] = !m[i];
+            if (m[i])
+                break;
+        }
+        m.resize(n + 1);
+        EruBits<_T> prod = _ctx->allocate(2 * n + 1);
+        _mul_const(prod.ptr(), 2 * n + 1, a, n, m);
+        for (size_t i = 0; i < n; i++) {
+            if (n + l + i <= 2 * n)
+                env->ldup(q + i, prod.ptr() + n + l + i);
+            else
+                env->lval(q + i, false);
+        }
+        _ctx->free(prod);
+    }
+    /// a < b as the borrow out of a - b, without computing the difference.
+    EruBits<_T> _less(const _T *a, const _T *b) {
+        EruBits<_T> res = _ctx->allocate(1);
+        EruBits<_T> tmp = _ctx->allocate(1);
+        auto env = _ctx->_env();
+        auto r = res.ptr(), t = tmp.ptr();
+        // borrow = !a[0] && b[0]
+        env->landny(r, a, b);
+        for (size_t i = 1; i < _Size; i++) {
+            // equal bits pass the borrow on, otherwise b[i] decides; on
+            // the sign bit it's a[i] that decides since 1 means negative
+            env->lxnor(t, a + i, b + i);
+            env->lifelse(r, t, r, i + 1 < _Size ? b + i : a + i);
+        }
+        _ctx->free(tmp);
+        return res;
+    }
 };
 
 /// Basic integer definitions.
@@ -1,15 +1,17 @@
 
 #include "utils.h"
 
+#include <cerrno>
 #include <iomanip>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 
+thread_local _EruHazmat::JobMonitor *_EruHazmat::job_monitor = nullptr;
+
 EruData _EruHazmat::dump_sstream(std::stringstream &stream) {
-    EruData result;
-    int ch;
-    while ((ch = stream.get()) != EOF)
-        result += (char)ch;
-    return result;
+    return stream.str();
 }
 
 /// binobjlist := <null> // <binobjlist> <binobj>
@@ -18,37 +20,96 @@ EruData _EruHazmat::dump_sstream(std::stringstream &stream) {
 /// length := [0xff] // <num> <length>, nums are stored in little-endian
 /// num := [0x00] .. [0xfe], stored in base-255
 EruData _EruHazmat::binobjlist_encode(const std::vector<EruData>& objs) {
-    EruData result;
+    EruData result(binobjlist_length(objs), '\0');
+    binobjlist_encode_into(objs, &result[0]);
+    return result;
+}
+
+size_t _EruHazmat::binobjlist_length(const std::vector<EruData> &objs) {
+    size_t result = 0;
+    for (auto &obj : objs) {
+        for (uint64_t len = obj.length(); len > 0; len /= 255)
+            result += 1;
+        result += 1 + obj.length();
+    }
+    return result;
+}
+
+char* _EruHazmat::binobjlist_encode_into(const std::vector<EruData> &objs,
+        char *out) {
     for (auto &obj : objs) {
         // encode length
         uint64_t len = obj.length();
         for (; len > 0; len /= 255)
-            result += (char)(len % 255);
-        result += (char)0xff;
+            *out++ = (char)(len % 255);
+        *out++ = (char)0xff;
         // add data
-        result += obj;
+        obj.copy(out, obj.length());
+        out += obj.length();
     }
-    return result;
+    return out;
 }
 
 std::vector<EruData> _EruHazmat::binobjlist_decode(const EruData &data) {
     std::vector<EruData> result;
-    EruData buffer;
-    for (int i = 0; i < data.length(); ) {
+    for (auto &view : binobjlist_view(data))
+        result.push_back(view.str());
+    return result;
+}
+
+std::vector<EruDataView> _EruHazmat::binobjlist_view(EruDataView data) {
+    std::vector<EruDataView> result;
+    for (size_t i = 0; i < data.length; ) {
         uint64_t len = 0, pwr = 1;
-        for (; i < data.length() && data[i] != (char)0xff; i++) {
-            len += ((uint64_t)data[i] & 0xff) * pwr;
+        for (; i < data.length && data.data[i] != (char)0xff; i++) {
+            len += ((uint64_t)data.data[i] & 0xff) * pwr;
             pwr *= 255;
         }
         i++;
-        for (int j = 0; i < data.length() && j < len; i++, j++)
-            buffer += data[i];
-        result.push_back(buffer);
-        buffer.clear();
+        if (i > data.length)
+            i = data.length;
+        if (len > data.length - i)
+            len = data.length - i;  // truncated, keep what's there
+        result.push_back(EruDataView(data.data + i, len));
+        i += len;
     }
     return result;
 }
 
+_EruHazmat::FileView::FileView(int fd) : _map(nullptr), _length(0) {
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+        throw std::runtime_error("cannot stat file");
+    if (S_ISREG(st.st_mode) && st.st_size > 0) {
+        void *p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p != MAP_FAILED) {
+            _map = (const char*)p;
+            _length = st.st_size;
+            madvise(p, _length, MADV_SEQUENTIAL);
+            return;
+        }
+    }
+    char buf[65536];
+    for (ssize_t n; (n = read(fd, buf, sizeof(buf))) != 0; ) {
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            throw std::runtime_error("cannot read file");
+        _buffer.append(buf, n);
+    }
+}
+
+_EruHazmat::FileView::~FileView() {
+    if (_map != nullptr)
+        munmap((void*)_map, _length);
+}
+
+EruDataView _EruHazmat::FileView::view() const {
+    if (_map != nullptr)
+        return EruDataView(_map, _length);
+    return EruDataView(_buffer);
+}
+
 std::ostream& _EruHazmat::print_hex_box(std::ostream &out, std::string msg) {
     for (int i = 0; i < msg.length(); i++) {
         if (i % 32 == 0)
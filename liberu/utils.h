@@ -2,13 +2,35 @@
 #ifndef _LIBERU_UTILS_H
 #define _LIBERU_UTILS_H
 
+#include <atomic>
 #include <iostream>
 #include <sstream>
+#include <stdexcept>
 #include <vector>
 
 
 typedef std::string EruData;
 
+/// Borrowed slice of binary data, which must outlive the view.
+struct EruDataView {
+    const char *data;
+    size_t length;
+    EruDataView() : data(nullptr), length(0) {}
+    EruDataView(const char *data, size_t length) : data(data),
+        length(length) {}
+    EruDataView(const EruData &data) : data(data.c_str()),
+        length(data.length()) {}
+    EruData str() const {
+        return EruData(data, length);
+    }
+};
+
+/// Thrown out of a computation whose job has been cancelled.
+class EruCancelled : public std::runtime_error {
+public:
+    EruCancelled() : std::runtime_error("computation cancelled") {}
+};
+
 /// THERE BE DRAGONS!
 namespace _EruHazmat {
     /// Dump std::stringstream contents all into EruData.
@@ -21,16 +43,68 @@ namespace _EruHazmat {
     /// @return: Decodable single string.
     EruData binobjlist_encode(const std::vector<EruData> &objs);
 
+    /// Encode straight into a caller buffer of binobjlist_length(objs).
+    /// @return: Pointer past the last written byte.
+    char* binobjlist_encode_into(const std::vector<EruData> &objs, char *out);
+    size_t binobjlist_length(const std::vector<EruData> &objs);
+
     /// Strip encoded binary list object bulk into multiple objects.
     /// @param data: binobjlist_encode'd object aggregate.
     /// @return: List of EruData's.
     std::vector<EruData> binobjlist_decode(const EruData &data);
 
+    /// Like binobjlist_decode, but returns views into data, copying nothing.
+    std::vector<EruDataView> binobjlist_view(EruDataView data);
+
+    /// Read-only stream buffer over borrowed memory, for feeding TFHE's
+    /// stream readers without first copying into a std::stringstream.
+    class membuf : public std::streambuf {
+    public:
+        membuf(EruDataView data) {
+            char *p = const_cast<char*>(data.data);
+            setg(p, p, p + data.length);
+        }
+    };
+
+    /// Contents of a file descriptor, mapped read-only when it is a regular
+    /// file and read into memory otherwise (pipes, sockets). The descriptor
+    /// stays owned by the caller.
+    class FileView {
+    private:
+        const char *_map;
+        size_t _length;
+        EruData _buffer;
+    public:
+        FileView(int fd);
+        FileView(const FileView &other) = delete;
+        ~FileView();
+        EruDataView view() const;
+    };
+
     /// Prints string like in WinHex.
     /// @param out: Export stream, like std::cout.
     /// @param msg: Binary content.
     /// @return The same export stream.
     std::ostream& print_hex_box(std::ostream &out, std::string msg);
+
+    /// Progress and cancellation hooks of the job running on a thread.
+    struct JobMonitor {
+        std::atomic<bool> cancel;
+        std::atomic<uint64_t> gates;
+        JobMonitor() : cancel(false), gates(0) {}
+    };
+    extern thread_local JobMonitor *job_monitor;
+
+    /// Cancellation point, called once per gate: counts the gate towards
+    /// the current job's progress and throws EruCancelled if requested.
+    inline void job_tick() {
+        JobMonitor *monitor = job_monitor;
+        if (monitor == nullptr)
+            return;
+        monitor->gates.fetch_add(1, std::memory_order_relaxed);
+        if (monitor->cancel.load(std::memory_order_relaxed))
+            throw EruCancelled();
+    }
 }
 
 #endif  // _LIBERU_UTILS_H